@@ -0,0 +1,327 @@
+#include "Benchmark.h"
+#include "ThreadPool.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <regex>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef MAYAPLUGINS_REVISION
+#define MAYAPLUGINS_REVISION    "unknown"
+#endif
+
+
+static const int64_t    MAX_ITERATIONS      = 1000000000;
+
+
+Benchmark::State::State( int64_t arg, double minTime )
+:   _arg(arg),
+    _minTime(minTime),
+    _iterations(0),
+    _running(false),
+    _paused(false),
+    _realTime(0),
+    _cpuTime(0),
+    _cpuStart(0),
+    _itemsProcessed(0)
+{
+}
+
+bool Benchmark::State::keepRunning()
+{
+    if (!_running)
+    {
+        _running = true;
+        resumeTiming();
+        return true;
+    }
+
+    ++_iterations;
+
+    double realTime = _realTime;
+    if (!_paused)
+        realTime += std::chrono::duration<double>(Clock::now() - _realStart).count();
+
+    if (realTime < _minTime && _iterations < MAX_ITERATIONS)
+        return true;
+
+    pauseTiming();
+    _running = false;
+    return false;
+}
+
+void Benchmark::State::pauseTiming()
+{
+    if (_paused)
+        return;
+
+    _realTime += std::chrono::duration<double>(Clock::now() - _realStart).count();
+    _cpuTime += double(std::clock() - _cpuStart) / CLOCKS_PER_SEC;
+    _paused = true;
+}
+
+void Benchmark::State::resumeTiming()
+{
+    _paused = false;
+    _realStart = Clock::now();
+    _cpuStart = std::clock();
+}
+
+
+namespace Benchmark
+{
+    // A deque, so returned definitions stay put while more are added
+    static std::deque<Definition>& definitions()
+    {
+        static std::deque<Definition> definitions;
+        return definitions;
+    }
+
+    class Result
+    {
+    public:
+        std::string                     name;
+        int64_t                         iterations;
+        double                          realTime;           // ns per iteration
+        double                          cpuTime;
+        double                          itemsPerSecond;
+        std::map<std::string, double>   counters;
+    };
+
+    class Runner
+    {
+    public:
+        Runner() : minTime(0.5), json(false), large(false), list(false)    {}
+
+        bool    parse( int argc, char** argv );
+        Result  run( const Definition& definition, int64_t arg ) const;
+
+        static void     printConsole( const Result& result );
+        static void     writeJson( const std::vector<Result>& results, std::ostream& out );
+
+        std::string     filter;
+        double          minTime;
+        bool            json;
+        bool            large;
+        bool            list;
+        std::string     out;
+    };
+};
+
+
+Benchmark::Definition& Benchmark::add( const std::string& name, Function function )
+{
+    definitions().push_back(Definition(name, function));
+    return definitions().back();
+}
+
+
+static bool parseFlag( const char* arg, const char* flag, std::string& value )
+{
+    size_t length = strlen(flag);
+    if (strncmp(arg, flag, length) != 0)
+        return false;
+
+    if (arg[length] == '=')
+        value = arg + length + 1;
+    else if (arg[length] == 0)
+        value = "true";
+    else
+        return false;
+
+    return true;
+}
+
+bool Benchmark::Runner::parse( int argc, char** argv )
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string value;
+        if (parseFlag(argv[i], "--benchmark_filter", value))
+            filter = value;
+        else if (parseFlag(argv[i], "--benchmark_min_time", value))
+            minTime = atof(value.c_str());
+        else if (parseFlag(argv[i], "--benchmark_format", value) && (value == "console" || value == "json"))
+            json = value == "json";
+        else if (parseFlag(argv[i], "--benchmark_out", value))
+            out = value;
+        else if (parseFlag(argv[i], "--benchmark_large", value))
+            large = value != "false";
+        else if (parseFlag(argv[i], "--benchmark_list_tests", value))
+            list = value != "false";
+        else
+        {
+            std::cerr << "Unknown flag " << argv[i] << "\n"
+                      << "Usage: " << argv[0] << "\n"
+                      << "    [--benchmark_filter=<regex>]\n"
+                      << "    [--benchmark_min_time=<seconds>]\n"
+                      << "    [--benchmark_format=<console|json>]\n"
+                      << "    [--benchmark_out=<json file>]\n"
+                      << "    [--benchmark_large]             Also run the 1M vertex / 5000 pose sizes\n"
+                      << "    [--benchmark_list_tests]\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+Benchmark::Result Benchmark::Runner::run( const Definition& definition, int64_t arg ) const
+{
+    State state(arg, minTime);
+    definition.function(state);
+
+    Result result;
+    std::ostringstream name;
+    name << definition.name << "/" << arg;
+    result.name = name.str();
+
+    result.iterations = std::max<int64_t>(state._iterations, 1);
+    result.realTime = state._realTime * 1e9 / result.iterations;
+    result.cpuTime = state._cpuTime * 1e9 / result.iterations;
+    result.itemsPerSecond = state._itemsProcessed && state._realTime > 0 ?
+                            state._itemsProcessed * result.iterations / state._realTime : 0;
+    result.counters = state._counters;
+    return result;
+}
+
+
+void Benchmark::Runner::printConsole( const Result& result )
+{
+    std::cout << std::left << std::setw(36) << result.name << std::right
+              << std::fixed << std::setprecision(0)
+              << std::setw(14) << result.realTime << " ns"
+              << std::setw(14) << result.cpuTime << " ns"
+              << std::setw(12) << result.iterations;
+
+    if (result.itemsPerSecond > 0)
+        std::cout << std::setprecision(3) << std::setw(12) << result.itemsPerSecond * 1e-6 << "M items/s";
+
+    for (std::map<std::string, double>::const_iterator iter = result.counters.begin(); iter != result.counters.end(); ++iter)
+        std::cout << " " << iter->first << "=" << std::setprecision(3) << iter->second;
+
+    std::cout << std::endl;
+}
+
+void Benchmark::Runner::writeJson( const std::vector<Result>& results, std::ostream& out )
+{
+    char date[64] = "";
+    std::time_t now = std::time(0);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+    out << std::setprecision(10);
+    out << "{\n"
+        << "  \"context\": {\n"
+        << "    \"date\": \"" << date << "\",\n"
+        << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"threads\": " << ThreadPool::numThreads() << ",\n"
+        << "    \"revision\": \"" << MAYAPLUGINS_REVISION << "\",\n"
+#ifdef NDEBUG
+        << "    \"library_build_type\": \"release\"\n"
+#else
+        << "    \"library_build_type\": \"debug\"\n"
+#endif
+        << "  },\n"
+        << "  \"benchmarks\": [";
+
+    for (unsigned i = 0; i < results.size(); ++i)
+    {
+        const Result& result = results[i];
+        out << (i ? "," : "") << "\n"
+            << "    {\n"
+            << "      \"name\": \"" << result.name << "\",\n"
+            << "      \"run_name\": \"" << result.name << "\",\n"
+            << "      \"run_type\": \"iteration\",\n"
+            << "      \"iterations\": " << result.iterations << ",\n"
+            << "      \"real_time\": " << result.realTime << ",\n"
+            << "      \"cpu_time\": " << result.cpuTime << ",\n"
+            << "      \"time_unit\": \"ns\"";
+
+        if (result.itemsPerSecond > 0)
+            out << ",\n      \"items_per_second\": " << result.itemsPerSecond;
+
+        for (std::map<std::string, double>::const_iterator iter = result.counters.begin(); iter != result.counters.end(); ++iter)
+            out << ",\n      \"" << iter->first << "\": " << iter->second;
+
+        out << "\n    }";
+    }
+
+    out << "\n  ]\n}\n";
+}
+
+
+int Benchmark::run( int argc, char** argv )
+{
+    Runner runner;
+    if (!runner.parse(argc, argv))
+        return 1;
+
+    std::regex filter;
+    try
+    {
+        filter = std::regex(runner.filter.empty() ? "." : runner.filter);
+    }
+    catch (const std::regex_error&)
+    {
+        std::cerr << "Invalid --benchmark_filter " << runner.filter << "\n";
+        return 1;
+    }
+
+    if (!runner.json)
+    {
+        std::cout << std::left << std::setw(36) << "Benchmark" << std::right
+                  << std::setw(17) << "Time" << std::setw(17) << "CPU" << std::setw(12) << "Iterations" << "\n"
+                  << std::string(82, '-') << std::endl;
+    }
+
+    std::vector<Result> results;
+    const std::deque<Definition>& all = definitions();
+    for (unsigned i = 0; i < all.size(); ++i)
+    {
+        std::vector<int64_t> args = all[i].args;
+        if (runner.large)
+            args.insert(args.end(), all[i].largeArgs.begin(), all[i].largeArgs.end());
+
+        for (unsigned a = 0; a < args.size(); ++a)
+        {
+            std::ostringstream name;
+            name << all[i].name << "/" << args[a];
+            if (!std::regex_search(name.str(), filter))
+                continue;
+
+            if (runner.list)
+            {
+                std::cout << name.str() << "\n";
+                continue;
+            }
+
+            results.push_back(runner.run(all[i], args[a]));
+            if (!runner.json)
+                Runner::printConsole(results.back());
+        }
+    }
+
+    if (runner.list)
+        return 0;
+
+    if (runner.json)
+        Runner::writeJson(results, std::cout);
+
+    if (!runner.out.empty())
+    {
+        std::ofstream file(runner.out.c_str());
+        if (!file)
+        {
+            std::cerr << "Failed to write " << runner.out << "\n";
+            return 1;
+        }
+        Runner::writeJson(results, file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <ctime>
+#include <stdint.h>
+
+
+// Minimal Google Benchmark style harness, no dependency beyond the standard
+// library. A benchmark function runs its timed body in
+//
+//     while (state.keepRunning())
+//         ...
+//
+// once per registered argument, repeated until it ran at least min time.
+// Results print as a table, or as Google Benchmark compatible JSON
+namespace Benchmark
+{
+    class State
+    {
+    public:
+        State( int64_t arg, double minTime );
+
+        // True while more iterations should run, times them
+        bool        keepRunning();
+
+        // Exclude per iteration setup from the time
+        void        pauseTiming();
+        void        resumeTiming();
+
+        int64_t     arg() const                 { return _arg; }
+        int64_t     iterations() const          { return _iterations; }
+
+        // Items (vertices, poses..) an iteration processes, reported per second
+        void        setItemsProcessed( int64_t items )              { _itemsProcessed = items; }
+
+        // Extra value reported as is, averaged by the caller if it varies
+        void        setCounter( const std::string& name, double value ) { _counters[name] = value; }
+
+    private:
+        friend class Runner;
+
+        typedef std::chrono::high_resolution_clock  Clock;
+
+        int64_t                         _arg;
+        double                          _minTime;
+        int64_t                         _iterations;
+        bool                            _running;
+        bool                            _paused;
+        double                          _realTime;          // Seconds
+        double                          _cpuTime;
+        Clock::time_point               _realStart;
+        std::clock_t                    _cpuStart;
+        int64_t                         _itemsProcessed;
+        std::map<std::string, double>   _counters;
+    };
+
+    typedef void (*Function)( State& state );
+
+    class Definition
+    {
+    public:
+        Definition( const std::string& name, Function function ) : name(name), function(function)  {}
+
+        // Sizes to run at, large ones only with --benchmark_large
+        Definition& arg( int64_t value )            { args.push_back(value); return *this; }
+        Definition& largeArg( int64_t value )       { largeArgs.push_back(value); return *this; }
+
+        std::string             name;
+        Function                function;
+        std::vector<int64_t>    args;
+        std::vector<int64_t>    largeArgs;
+    };
+
+    Definition&     add( const std::string& name, Function function );
+
+    // Parse the --benchmark_* flags and run the registered benchmarks, returns
+    // the process exit code
+    int             run( int argc, char** argv );
+};
+
+#endif
@@ -0,0 +1,400 @@
+#include "Benchmark.h"
+#include "RigGenerator.h"
+#include "ThreadPool.h"
+#include "utils.h"
+#include "Core/Topology.h"
+#include "Core/Relax.h"
+#include "Core/PoseSolver.h"
+#include "Core/Deltas.h"
+
+#include <memory>
+#include <algorithm>
+#include <stdlib.h>
+#include <math.h>
+
+
+// Deformer kernels on procedural rigs, timed the way the nodes run them.
+// Sizes are vertex counts for mesh benchmarks, pose counts for pose ones
+
+static const unsigned   RELAX_ITERATIONS        = 10;
+static const float      RELAX_AMOUNT            = 0.5f;
+
+// Warm start plays a slow shear up the cylinder, frames per iteration
+static const unsigned   WARM_ITERATIONS         = 50;
+static const double     WARM_TOLERANCE          = 0.05;
+static const double     WARM_SHEAR              = 0.002;
+static const unsigned   WARM_FRAMES             = 200;
+
+// Pose benchmarks run on one skinned mesh
+static const unsigned   POSE_MESH_VERTICES      = 10000;
+static const unsigned   NUM_JOINTS              = 20;
+static const unsigned   NUM_INFLUENCES          = 4;
+static const double     BEND_ANGLE              = 90.0;
+static const double     SPARSE_DENSITY          = 0.02;
+static const double     DENSE_DENSITY           = 1.0;
+
+
+// Pose library with its skinned mesh and solved pose matrix. The last one is
+// kept, benchmarks of the same size share it
+class PoseRig
+{
+public:
+    PoseRig() : numPoses(0), density(0), solved(false)  {}
+
+    unsigned                    numPoses;
+    double                      density;
+
+    RigGenerator::Mesh          mesh;
+    RigGenerator::Skin          skin;
+    std::vector<double>         skinMatrices;
+    RigGenerator::PoseLibrary   library;
+
+    bool                        solved;
+    std::vector<double>         pose2PoseWeights;
+};
+
+static PoseRig& poseRig( unsigned numPoses, double density, bool solve )
+{
+    static std::unique_ptr<PoseRig> rig;
+    if (!rig || rig->numPoses != numPoses || rig->density != density)
+    {
+        // Free the last rig first, dense libraries are large
+        rig.reset();
+        rig.reset(new PoseRig());
+        rig->numPoses = numPoses;
+        rig->density = density;
+
+        RigGenerator::makeMesh(POSE_MESH_VERTICES, rig->mesh);
+        RigGenerator::makeSkin(rig->mesh, NUM_JOINTS, NUM_INFLUENCES, rig->skin);
+        RigGenerator::makeSkinMatrices(NUM_JOINTS, BEND_ANGLE, rig->skinMatrices);
+        RigGenerator::makePoseLibrary(numPoses, NUM_JOINTS, rig->mesh.numVertices, density, rig->library);
+    }
+
+    if (solve && !rig->solved)
+    {
+        PoseSolver::solvePoseMatrix(rig->library.poses, true, rig->pose2PoseWeights);
+        rig->solved = true;
+    }
+
+    return *rig;
+}
+
+static void makeTopology( const RigGenerator::Mesh& mesh, std::unique_ptr<Topology>& topology )
+{
+    topology.reset(new Topology(0, mesh.numVertices, &mesh.faceCounts[0], (unsigned)mesh.faceCounts.size(), &mesh.faceVertices[0]));
+}
+
+
+// Adjacency of a new mesh topology
+static void topologyBuild( Benchmark::State& state )
+{
+    RigGenerator::Mesh mesh;
+    RigGenerator::makeMesh((unsigned)state.arg(), mesh);
+
+    std::unique_ptr<Topology> topology;
+    while (state.keepRunning())
+        makeTopology(mesh, topology);
+
+    state.setItemsProcessed(mesh.numVertices);
+}
+
+// Relax passes from the input points, as relaxDeformer without warm start
+static void relaxSmooth( Benchmark::State& state )
+{
+    RigGenerator::Mesh mesh;
+    RigGenerator::makeMesh((unsigned)state.arg(), mesh);
+    std::unique_ptr<Topology> topology;
+    makeTopology(mesh, topology);
+
+    std::vector<double> buffers[2];
+    int passes = 0;
+    while (state.keepRunning())
+    {
+        state.pauseTiming();
+        buffers[0] = mesh.points;
+        state.resumeTiming();
+
+        passes = Relax::smooth(*topology, buffers, RELAX_ITERATIONS, RELAX_AMOUNT, 0, Relax::TOLERANCE_MAX);
+    }
+
+    state.setItemsProcessed((int64_t)mesh.numVertices * RELAX_ITERATIONS);
+    state.setCounter("passes", passes);
+}
+
+// Frames of slow input motion relaxed with warm start, as relaxDeformer with
+// warmStart on. Checks the warm result against a cold start of the same frame
+// each time, warm_gap is the largest distance of a vertex between the two
+// over all frames, in tolerances. It has to stay below a few, not grow with
+// frames
+static void relaxWarmStart( Benchmark::State& state )
+{
+    RigGenerator::Mesh mesh;
+    RigGenerator::makeMesh((unsigned)state.arg(), mesh);
+    std::unique_ptr<Topology> topology;
+    makeTopology(mesh, topology);
+
+    const unsigned count = mesh.numVertices * 3;
+
+    Relax::WarmStart warmStart;
+    std::vector<float> points(count);
+    std::vector<double> buffers[2], coldBuffers[2];
+    unsigned frame = 0;
+    int64_t passes = 0;
+    double maxGap = 0;
+    while (state.keepRunning())
+    {
+        state.pauseTiming();
+        double shear = WARM_SHEAR * (frame++ % WARM_FRAMES);
+        for (unsigned v = 0; v < mesh.numVertices; ++v)
+        {
+            points[v * 3] = (float)(mesh.points[v * 3] + shear * mesh.points[v * 3 + 1]);
+            points[v * 3 + 1] = (float)mesh.points[v * 3 + 1];
+            points[v * 3 + 2] = (float)mesh.points[v * 3 + 2];
+        }
+        state.resumeTiming();
+
+        passes += warmStart.relax(*topology, &points[0], buffers, WARM_ITERATIONS, RELAX_AMOUNT, WARM_TOLERANCE, Relax::TOLERANCE_MAX);
+
+        state.pauseTiming();
+        coldBuffers[0].assign(points.begin(), points.end());
+        Relax::smooth(*topology, coldBuffers, WARM_ITERATIONS, RELAX_AMOUNT, WARM_TOLERANCE, Relax::TOLERANCE_MAX);
+        for (unsigned v = 0; v < mesh.numVertices; ++v)
+        {
+            double dx = buffers[0][v * 3] - coldBuffers[0][v * 3];
+            double dy = buffers[0][v * 3 + 1] - coldBuffers[0][v * 3 + 1];
+            double dz = buffers[0][v * 3 + 2] - coldBuffers[0][v * 3 + 2];
+            maxGap = std::max(maxGap, sqrt(dx * dx + dy * dy + dz * dz));
+        }
+        state.resumeTiming();
+    }
+
+    state.setItemsProcessed(mesh.numVertices);
+    state.setCounter("passes", (double)passes / std::max(1u, frame));
+    state.setCounter("warm_gap", maxGap / WARM_TOLERANCE);
+}
+
+// Rest relative (delta mush) frame: relax the posed points, put the rest
+// detail back. The rest detail is encoded once beforehand
+static void relaxDeltaMush( Benchmark::State& state )
+{
+    RigGenerator::Mesh mesh;
+    RigGenerator::makeMesh((unsigned)state.arg(), mesh);
+    std::unique_ptr<Topology> topology;
+    makeTopology(mesh, topology);
+
+    std::vector<double> buffers[2];
+    std::vector<double> restDeltas = mesh.points;
+    buffers[0] = mesh.points;
+    Relax::smooth(*topology, buffers, RELAX_ITERATIONS, RELAX_AMOUNT, 0, Relax::TOLERANCE_MAX);
+    Relax::encodeDetail(*topology, &restDeltas[0], &buffers[0][0], &restDeltas[0]);
+
+    // Posed points, sheared up the cylinder
+    std::vector<double> posed = mesh.points;
+    for (unsigned v = 0; v < mesh.numVertices; ++v)
+        posed[v * 3] += 0.1 * posed[v * 3 + 1];
+
+    std::vector<double> positions(mesh.numVertices * 3);
+    while (state.keepRunning())
+    {
+        state.pauseTiming();
+        buffers[0] = posed;
+        state.resumeTiming();
+
+        Relax::smooth(*topology, buffers, RELAX_ITERATIONS, RELAX_AMOUNT, 0, Relax::TOLERANCE_MAX);
+        Relax::decodeDetail(*topology, &buffers[0][0], &restDeltas[0], &positions[0]);
+    }
+
+    state.setItemsProcessed(mesh.numVertices);
+}
+
+
+// Pose to pose matrix, solved whenever poses change
+static void posesSolve( Benchmark::State& state )
+{
+    PoseRig& rig = poseRig((unsigned)state.arg(), SPARSE_DENSITY, false);
+
+    std::vector<double> pose2PoseWeights;
+    while (state.keepRunning())
+        PoseSolver::solvePoseMatrix(rig.library.poses, true, pose2PoseWeights);
+
+    state.setItemsProcessed(rig.numPoses);
+}
+
+// Weight of every pose at the joint frames of a frame
+static void posesWeights( Benchmark::State& state )
+{
+    PoseRig& rig = poseRig((unsigned)state.arg(), SPARSE_DENSITY, true);
+
+    PoseSolver::JointFrameMap frames;
+    std::vector<double> weights;
+    unsigned frame = 0, activePoses = 0;
+    while (state.keepRunning())
+    {
+        state.pauseTiming();
+        RigGenerator::makeJointFrames(rig.library, NUM_JOINTS, frame++, frames);
+        state.resumeTiming();
+
+        PoseSolver::poseWeights(rig.library.poses, rig.pose2PoseWeights, frames, true, weights);
+
+        for (unsigned i = 0; i < weights.size(); ++i)
+            activePoses += weights[i] >= FLOAT_TOLERANCE;
+    }
+
+    state.setItemsProcessed(rig.numPoses);
+    state.setCounter("active_poses", (double)activePoses / std::max(1u, frame));
+}
+
+
+// Every target of the library summed at once, as on a full rebuild of the
+// base delta
+static void deltasAccumulate( Benchmark::State& state, double density )
+{
+    PoseRig& rig = poseRig((unsigned)state.arg(), density, false);
+    const std::vector<RigGenerator::Target>& targets = rig.library.targets;
+
+    std::vector<double> delta(rig.mesh.numVertices * 3);
+    std::vector<char> touched(rig.mesh.numVertices, 0);
+    std::vector<int> touchedComponents;
+
+    int64_t items = 0;
+    for (unsigned t = 0; t < targets.size(); ++t)
+        items += targets[t].components.size();
+
+    while (state.keepRunning())
+    {
+        for (unsigned t = 0; t < targets.size(); ++t)
+            Deltas::accumulate(&targets[t].components[0], &targets[t].deltas[0], (unsigned)targets[t].components.size(),
+                               1.0 / (t + 1), &delta[0], &touched[0], touchedComponents);
+
+        for (unsigned i = 0; i < touchedComponents.size(); ++i)
+            touched[touchedComponents[i]] = 0;
+        touchedComponents.clear();
+    }
+
+    state.setItemsProcessed(items);
+    state.setCounter("target_mb", rig.library.bytes() / (1024.0 * 1024.0));
+}
+
+static void deltasAccumulateSparse( Benchmark::State& state )
+{
+    deltasAccumulate(state, SPARSE_DENSITY);
+}
+
+static void deltasAccumulateDense( Benchmark::State& state )
+{
+    deltasAccumulate(state, DENSE_DENSITY);
+}
+
+// Bind to skin space of every vertex of a skinned mesh
+static void deltasSkinSpace( Benchmark::State& state )
+{
+    RigGenerator::Mesh mesh;
+    RigGenerator::makeMesh((unsigned)state.arg(), mesh);
+    RigGenerator::Skin skin;
+    RigGenerator::makeSkin(mesh, NUM_JOINTS, NUM_INFLUENCES, skin);
+    std::vector<double> skinMatrices;
+    RigGenerator::makeSkinMatrices(NUM_JOINTS, BEND_ANGLE, skinMatrices);
+
+    std::vector<int> components(mesh.numVertices);
+    for (unsigned v = 0; v < mesh.numVertices; ++v)
+        components[v] = v;
+
+    std::vector<double> delta;
+    while (state.keepRunning())
+    {
+        state.pauseTiming();
+        delta = mesh.points;
+        state.resumeTiming();
+
+        Deltas::toSkinSpace(&components[0], mesh.numVertices, &skin.weightOffsets[0], mesh.numVertices,
+                            &skin.weightJoints[0], &skin.weightValues[0], &skinMatrices[0], NUM_JOINTS, &delta[0]);
+    }
+
+    state.setItemsProcessed(mesh.numVertices);
+}
+
+
+// One poseSpaceDeformer frame past the pose matrix solve: pose weights, the
+// active targets summed, then taken to skin space
+static void evaluate( Benchmark::State& state, double density )
+{
+    PoseRig& rig = poseRig((unsigned)state.arg(), density, true);
+    const std::vector<RigGenerator::Target>& targets = rig.library.targets;
+    const unsigned numVertices = rig.mesh.numVertices;
+
+    PoseSolver::JointFrameMap frames;
+    std::vector<double> weights;
+    std::vector<double> delta(numVertices * 3);
+    std::vector<char> touched(numVertices, 0);
+    std::vector<int> touchedComponents;
+
+    unsigned frame = 0, activePoses = 0;
+    int64_t touchedVertices = 0;
+    while (state.keepRunning())
+    {
+        state.pauseTiming();
+        RigGenerator::makeJointFrames(rig.library, NUM_JOINTS, frame++, frames);
+        state.resumeTiming();
+
+        PoseSolver::poseWeights(rig.library.poses, rig.pose2PoseWeights, frames, true, weights);
+
+        for (unsigned p = 0; p < weights.size(); ++p)
+        {
+            if (weights[p] < FLOAT_TOLERANCE)
+                continue;
+
+            ++activePoses;
+            Deltas::accumulate(&targets[p].components[0], &targets[p].deltas[0], (unsigned)targets[p].components.size(),
+                               weights[p], &delta[0], &touched[0], touchedComponents);
+        }
+
+        if (!touchedComponents.empty())
+            Deltas::toSkinSpace(&touchedComponents[0], (unsigned)touchedComponents.size(), &rig.skin.weightOffsets[0], numVertices,
+                                &rig.skin.weightJoints[0], &rig.skin.weightValues[0], &rig.skinMatrices[0], NUM_JOINTS, &delta[0]);
+
+        touchedVertices += touchedComponents.size();
+        for (unsigned i = 0; i < touchedComponents.size(); ++i)
+            touched[touchedComponents[i]] = 0;
+        touchedComponents.clear();
+    }
+
+    state.setCounter("active_poses", (double)activePoses / std::max(1u, frame));
+    state.setCounter("touched_vertices", (double)touchedVertices / std::max(1u, frame));
+}
+
+static void evaluateSparse( Benchmark::State& state )
+{
+    evaluate(state, SPARSE_DENSITY);
+}
+
+static void evaluateDense( Benchmark::State& state )
+{
+    evaluate(state, DENSE_DENSITY);
+}
+
+
+int main( int argc, char** argv )
+{
+    // Same scheduler setup as the plugin, MAYAPLUGINS_THREADS caps its threads
+    ThreadPool::initialize();
+    const char* threadCap = getenv("MAYAPLUGINS_THREADS");
+    if (threadCap)
+        ThreadPool::setThreadCap(atoi(threadCap));
+
+    Benchmark::add("topology/build", topologyBuild).arg(1000).arg(10000).arg(100000).largeArg(1000000);
+    Benchmark::add("relax/smooth", relaxSmooth).arg(1000).arg(10000).arg(100000).largeArg(1000000);
+    Benchmark::add("relax/warmStart", relaxWarmStart).arg(400).arg(10000).arg(100000);
+    Benchmark::add("relax/deltaMush", relaxDeltaMush).arg(1000).arg(10000).arg(100000).largeArg(1000000);
+    Benchmark::add("poses/solve", posesSolve).arg(10).arg(100).arg(1000).largeArg(5000);
+    Benchmark::add("poses/weights", posesWeights).arg(10).arg(100).arg(1000).largeArg(5000);
+    Benchmark::add("deltas/accumulate/sparse", deltasAccumulateSparse).arg(10).arg(100).arg(1000).arg(5000);
+    Benchmark::add("deltas/accumulate/dense", deltasAccumulateDense).arg(10).arg(100).largeArg(1000);
+    Benchmark::add("deltas/skinSpace", deltasSkinSpace).arg(1000).arg(10000).arg(100000).largeArg(1000000);
+    Benchmark::add("evaluate/sparse", evaluateSparse).arg(10).arg(100).arg(1000).largeArg(5000);
+    Benchmark::add("evaluate/dense", evaluateDense).arg(10).arg(100).largeArg(1000);
+
+    int result = Benchmark::run(argc, argv);
+
+    ThreadPool::uninitialize();
+    return result;
+}
@@ -0,0 +1,191 @@
+#include "RigGenerator.h"
+#include "utils.h"
+
+#include <math.h>
+#include <random>
+#include <algorithm>
+
+#include <Eigen/Dense>
+using namespace Eigen;
+
+
+static const double     CYLINDER_HEIGHT     = 10.0;
+static const double     CYLINDER_RADIUS     = 1.0;
+static const double     TARGET_MAGNITUDE    = 0.1;
+
+
+// Rest frame turned by a rotation, as PoseSolver takes it
+static PoseSolver::JointFrame rotateFrame( const PoseSolver::JointFrame& frame, const AngleAxisd& rotation )
+{
+    PoseSolver::JointFrame rotated;
+    Map<Vector3d>(rotated.axis) = rotation * Map<const Vector3d>(frame.axis);
+    Map<Vector3d>(rotated.up) = rotation * Map<const Vector3d>(frame.up);
+    return rotated;
+}
+
+
+size_t RigGenerator::PoseLibrary::bytes() const
+{
+    size_t bytes = 0;
+    for (unsigned i = 0; i < targets.size(); ++i)
+        bytes += targets[i].components.size() * sizeof(int) + targets[i].deltas.size() * sizeof(double);
+    return bytes;
+}
+
+
+void RigGenerator::makeMesh( unsigned numVertices, Mesh& mesh )
+{
+    const unsigned segments = std::max(8u, (unsigned)sqrt((double)numVertices));
+    const unsigned rings = std::max(2u, (numVertices + segments - 1) / segments);
+
+    mesh.numVertices = rings * segments;
+    mesh.points.resize(mesh.numVertices * 3);
+    for (unsigned r = 0; r < rings; ++r)
+        for (unsigned s = 0; s < segments; ++s)
+        {
+            double angle = 2 * 3.141592653589793 * s / segments;
+            double* p = &mesh.points[(r * segments + s) * 3];
+            p[0] = CYLINDER_RADIUS * cos(angle);
+            p[1] = CYLINDER_HEIGHT * r / (rings - 1);
+            p[2] = CYLINDER_RADIUS * sin(angle);
+        }
+
+    const unsigned numFaces = (rings - 1) * segments;
+    mesh.faceCounts.assign(numFaces, 4);
+    mesh.faceVertices.resize(numFaces * 4);
+    int* fv = &mesh.faceVertices[0];
+    for (unsigned r = 0; r + 1 < rings; ++r)
+        for (unsigned s = 0; s < segments; ++s)
+        {
+            unsigned next = (s + 1) % segments;
+            *fv++ = r * segments + s;
+            *fv++ = r * segments + next;
+            *fv++ = (r + 1) * segments + next;
+            *fv++ = (r + 1) * segments + s;
+        }
+}
+
+
+void RigGenerator::makeSkin( const Mesh& mesh, unsigned numJoints, unsigned influences, Skin& skin )
+{
+    influences = std::min(influences, numJoints);
+    const double spacing = CYLINDER_HEIGHT / std::max(1u, numJoints - 1);
+
+    skin.weightOffsets.resize(mesh.numVertices + 1);
+    skin.weightJoints.resize(mesh.numVertices * influences);
+    skin.weightValues.resize(mesh.numVertices * influences);
+
+    for (unsigned v = 0; v < mesh.numVertices; ++v)
+    {
+        const unsigned offset = v * influences;
+        skin.weightOffsets[v] = offset;
+
+        // Closest joints, falling off with distance along the chain
+        double position = mesh.points[v * 3 + 1] / spacing;
+        int first = (int)floor(position - 0.5 * (influences - 1));
+        first = std::max(0, std::min(first, (int)(numJoints - influences)));
+
+        double sum = 0;
+        for (unsigned i = 0; i < influences; ++i)
+        {
+            double distance = position - (first + i);
+            double weight = 1 / (1 + distance * distance);
+            skin.weightJoints[offset + i] = first + i;
+            skin.weightValues[offset + i] = weight;
+            sum += weight;
+        }
+
+        for (unsigned i = 0; i < influences; ++i)
+            skin.weightValues[offset + i] /= sum;
+    }
+    skin.weightOffsets[mesh.numVertices] = mesh.numVertices * influences;
+}
+
+
+void RigGenerator::makeSkinMatrices( unsigned numJoints, double angle, std::vector<double>& matrices )
+{
+    matrices.assign(numJoints * 16, 0.0);
+    for (unsigned j = 0; j < numJoints; ++j)
+    {
+        // Row vector convention, the 3x3 part is the transposed rotation
+        Matrix3d rotation = AngleAxisd(DEG2RAD(angle) * j / numJoints, Vector3d::UnitZ()).toRotationMatrix();
+        double* m = &matrices[j * 16];
+        Map<Matrix<double, 4, 4, RowMajor> > matrix(m);
+        matrix.setIdentity();
+        matrix.topLeftCorner<3, 3>() = rotation.transpose();
+        matrix(3, 1) = CYLINDER_HEIGHT * j / numJoints;
+    }
+}
+
+
+PoseSolver::JointFrame RigGenerator::restFrame()
+{
+    PoseSolver::JointFrame frame;
+    frame.axis[0] = 1;
+    frame.up[1] = 1;
+    return frame;
+}
+
+
+void RigGenerator::makePoseLibrary( unsigned numPoses, unsigned numJoints, unsigned numVertices, double density, PoseLibrary& library )
+{
+    std::mt19937 random(numPoses * 31 + numVertices);
+    std::uniform_real_distribution<double> unit(-1.0, 1.0);
+    std::uniform_real_distribution<double> swing(10.0, 90.0);
+    std::uniform_real_distribution<double> fallOff(30.0, 60.0);
+
+    const PoseSolver::JointFrame rest = restFrame();
+    const unsigned numComponents = std::max(1u, std::min(numVertices, (unsigned)(density * numVertices)));
+
+    library.poses.resize(numPoses);
+    library.targets.resize(numPoses);
+    for (unsigned p = 0; p < numPoses; ++p)
+    {
+        // One joint, every other pose a second one further up the chain
+        PoseSolver::Pose& pose = library.poses[p];
+        pose.joints.clear();
+
+        unsigned numPoseJoints = p % 2 && numJoints > 1 ? 2 : 1;
+        unsigned jtIdx = p % numJoints;
+        for (unsigned j = 0; j < numPoseJoints; ++j)
+        {
+            Vector3d axis(unit(random), unit(random), unit(random));
+            if (axis.norm() < 1e-3)
+                axis = Vector3d::UnitZ();
+
+            PoseSolver::PoseJoint& poseJt = pose.joints[(jtIdx + j) % numJoints];
+            poseJt.frame = rotateFrame(rest, AngleAxisd(DEG2RAD(swing(random)), axis.normalized()));
+            poseJt.fallOff = (float)fallOff(random);
+        }
+
+        // Band of vertices from a random start, wrapping around
+        Target& target = library.targets[p];
+        target.components.resize(numComponents);
+        target.deltas.resize(numComponents * 3);
+
+        unsigned start = numComponents < numVertices ? random() % numVertices : 0;
+        for (unsigned i = 0; i < numComponents; ++i)
+            target.components[i] = (start + i) % numVertices;
+        std::sort(target.components.begin(), target.components.end());
+
+        for (unsigned i = 0; i < numComponents * 3; ++i)
+            target.deltas[i] = TARGET_MAGNITUDE * unit(random);
+    }
+}
+
+
+void RigGenerator::makeJointFrames( const PoseLibrary& library, unsigned numJoints, unsigned frame, PoseSolver::JointFrameMap& frames )
+{
+    frames.clear();
+    for (unsigned j = 0; j < numJoints; ++j)
+        frames[j] = restFrame();
+
+    if (library.poses.empty())
+        return;
+
+    // Slightly off the pose, so it and its neighbours weight in
+    const PoseSolver::Pose& pose = library.poses[frame % library.poses.size()];
+    AngleAxisd offset(DEG2RAD(5.0 * sin(frame * 0.1)), Vector3d::UnitZ());
+    for (PoseSolver::PoseJointMap::const_iterator iter = pose.joints.begin(); iter != pose.joints.end(); ++iter)
+        frames[iter->first] = rotateFrame(iter->second.frame, offset);
+}
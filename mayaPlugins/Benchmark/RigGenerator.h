@@ -0,0 +1,87 @@
+#ifndef RIGGENERATOR_H
+#define RIGGENERATOR_H
+
+#include "Core/PoseSolver.h"
+
+#include <vector>
+#include <stddef.h>
+
+
+// Procedural rigs for the kernel benchmarks: a quad cylinder standing on y,
+// a joint chain up its middle skinning it, and a pose library on the chain.
+// Everything is seeded, so a size always generates the same rig
+namespace RigGenerator
+{
+    class Mesh
+    {
+    public:
+        Mesh() : numVertices(0)  {}
+
+        unsigned                numVertices;
+        std::vector<int>        faceCounts;
+        std::vector<int>        faceVertices;
+        std::vector<double>     points;         // xyz interleaved
+    };
+
+    // skinCluster weights, vertex v in [weightOffsets[v], weightOffsets[v+1])
+    class Skin
+    {
+    public:
+        std::vector<unsigned>   weightOffsets;
+        std::vector<int>        weightJoints;
+        std::vector<double>     weightValues;
+    };
+
+    class Target
+    {
+    public:
+        std::vector<int>        components;     // Sorted
+        std::vector<double>     deltas;         // xyz interleaved
+    };
+
+    // Poses with one target each
+    class PoseLibrary
+    {
+    public:
+        std::vector<PoseSolver::Pose>   poses;
+        std::vector<Target>             targets;
+
+        size_t  bytes() const;
+    };
+
+    // Cylinder of at least numVertices, rings of quads closed around
+    void    makeMesh(   unsigned        numVertices,
+                        Mesh&           mesh );
+
+    // Joints evenly up the cylinder, each vertex weighted to the influences
+    // closest joints
+    void    makeSkin(   const Mesh&     mesh,
+                        unsigned        numJoints,
+                        unsigned        influences,
+                        Skin&           skin );
+
+    // Skin matrices (4x4 row major) of the chain bent by angle (degrees)
+    // spread over its joints
+    void    makeSkinMatrices(   unsigned                numJoints,
+                                double                  angle,
+                                std::vector<double>&    matrices );
+
+    // Rest frame of a chain joint, primary axis x, up y
+    PoseSolver::JointFrame  restFrame();
+
+    // Poses of one or two chain joints swung off their rest frame. Targets
+    // move density (0-1] of the vertices, a band of them if sparse
+    void    makePoseLibrary(    unsigned        numPoses,
+                                unsigned        numJoints,
+                                unsigned        numVertices,
+                                double          density,
+                                PoseLibrary&    library );
+
+    // Joint frames of an animation frame, near one of the poses
+    void    makeJointFrames(    const PoseLibrary&          library,
+                                unsigned                    numJoints,
+                                unsigned                    frame,
+                                PoseSolver::JointFrameMap&  frames );
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "Deltas.h"
+#include "ThreadPool.h"
+
+
+void Deltas::accumulate(    const int*          targetComponents, 
+                            const double*       targetDeltas, 
+                            unsigned            count, 
+                            double              weight, 
+                            double*             delta, 
+                            char*               touched, 
+                            std::vector<int>&   touchedComponents )
+{
+    for (unsigned k = 0; k < count; ++k)
+    {
+        int c = targetComponents[k];
+        double* d = delta + c * 3;
+        if (!touched[c])
+        {
+            touched[c] = 1;
+            d[0] = d[1] = d[2] = 0;
+            touchedComponents.push_back(c);
+        }
+
+        const double* td = targetDeltas + k * 3;
+        d[0] += td[0] * weight;
+        d[1] += td[1] * weight;
+        d[2] += td[2] * weight;
+    }
+}
+
+void Deltas::toSkinSpace(   const int*          components, 
+                            unsigned            count, 
+                            const unsigned*     weightOffsets, 
+                            unsigned            numWeighted, 
+                            const int*          weightJoints, 
+                            const double*       weightValues, 
+                            const double*       jointMatrices, 
+                            unsigned            numJoints, 
+                            double*             delta )
+{
+    ThreadPool::parallelFor(0, (int)count, [&](int begin, int end)
+    {
+        for (int t = begin; t < end; ++t)
+        {
+            int c = components[t];
+            if ((unsigned)c >= numWeighted)
+                continue;
+
+            // Weighted sum of joint matrices, only the 3x3 part applies to a delta
+            double m[3][3] = { {0, 0, 0}, {0, 0, 0}, {0, 0, 0} };
+            for (unsigned w = weightOffsets[c]; w < weightOffsets[c+1]; ++w)
+            {
+                unsigned jtIdx = weightJoints[w];
+                if (jtIdx >= numJoints)
+                    continue;
+
+                const double* jtMat = jointMatrices + jtIdx * 16;
+                double wt = weightValues[w];
+                for (unsigned r = 0; r < 3; ++r)
+                    for (unsigned k = 0; k < 3; ++k)
+                        m[r][k] += jtMat[r * 4 + k] * wt;
+            }
+
+            double* d = delta + c * 3;
+            const double x = d[0], y = d[1], z = d[2];
+            d[0] = x * m[0][0] + y * m[1][0] + z * m[2][0];
+            d[1] = x * m[0][1] + y * m[1][1] + z * m[2][1];
+            d[2] = x * m[0][2] + y * m[1][2] + z * m[2][2];
+        }
+    });
+}
@@ -0,0 +1,36 @@
+#ifndef DELTAS_H
+#define DELTAS_H
+
+#include <vector>
+
+
+// Pose target delta kernels. Deltas are xyz interleaved doubles, indexed
+// densely by component
+namespace Deltas
+{
+    // delta[c] += weight * targetDeltas[k] for each targetComponents[k] = c.
+    // Components not touched yet are zeroed first and listed in touchedComponents
+    void    accumulate(     const int*          targetComponents, 
+                            const double*       targetDeltas, 
+                            unsigned            count, 
+                            double              weight, 
+                            double*             delta, 
+                            char*               touched, 
+                            std::vector<int>&   touchedComponents );
+
+    // Bind space delta of components to skin space, by the weighted sum of the
+    // 3x3 part of their joint matrices (4x4 row major, row vector convention).
+    // Weights of vertex v are [weightOffsets[v], weightOffsets[v+1]), components
+    // past numWeighted and joints past numJoints are skipped
+    void    toSkinSpace(    const int*          components, 
+                            unsigned            count, 
+                            const unsigned*     weightOffsets, 
+                            unsigned            numWeighted, 
+                            const int*          weightJoints, 
+                            const double*       weightValues, 
+                            const double*       jointMatrices, 
+                            unsigned            numJoints, 
+                            double*             delta );
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include "PoseSolver.h"
+#include "utils.h"
+
+#include <math.h>
+
+#include <Eigen/Dense>
+using namespace Eigen;
+
+
+static double vectorAngle( const Vector3d& v1, const Vector3d& v2 )
+{
+    double lengths = v1.norm() * v2.norm();
+    if (lengths == 0)
+        return 0;
+
+    double cosAngle = v1.dot(v2) / lengths;
+    if (cosAngle > 1)
+        cosAngle = 1;
+    else if (cosAngle < -1)
+        cosAngle = -1;
+
+    return acos(cosAngle);
+}
+
+double PoseSolver::jointAngle( const JointFrame& frame1, const JointFrame& frame2, bool includeTwist )
+{
+    Map<const Vector3d> axis1(frame1.axis), axis2(frame2.axis);
+
+    double axisAngle = vectorAngle(axis1, axis2);
+    double twistAngle = 0;
+
+    if (includeTwist)
+    {
+        // Find rotation to align axis1 to axis2
+        Vector3d orthoAxis = axis1.cross(axis2);
+        if (orthoAxis.norm() > 0)
+            orthoAxis.normalize();
+
+        // Rotate the up axis, get the twist vec
+        Vector3d twistVec = AngleAxisd(axisAngle, orthoAxis) * Map<const Vector3d>(frame1.up);
+        twistAngle = vectorAngle(twistVec, Map<const Vector3d>(frame2.up));
+    }
+
+    return RAD2DEG(axisAngle) + RAD2DEG(twistAngle);
+}
+
+
+void PoseSolver::solvePoseMatrix(   const std::vector<Pose>&    poses, 
+                                    bool                        includeTwist, 
+                                    std::vector<double>&        pose2PoseWeights )
+{
+    const unsigned n = (unsigned)poses.size();
+    pose2PoseWeights.assign(n * n, 0.0);
+
+    // For each pose, check how far its pose joint rotations are from other poses
+    for (unsigned i = 0; i < n; ++i)
+    {
+        // Same pose
+        pose2PoseWeights[i * n + i] = 1;
+
+        // Other poses
+        for (unsigned j = i+1; j < n; ++j)
+        {
+            double weightij = 1;
+            double weightji = 1;
+            for (PoseJointMap::const_iterator iter1 = poses[i].joints.begin(); iter1 != poses[i].joints.end(); ++iter1)
+            {
+                // Distance cannot be found between poses with different pose joints
+                PoseJointMap::const_iterator iter2 = poses[j].joints.find(iter1->first);
+                if (iter2 == poses[j].joints.end() || poses[i].ignore || poses[j].ignore)
+                {
+                    weightij = 0;
+                    weightji = 0;
+                    break;
+                }
+
+                float fallOff1 = iter1->second.fallOff;
+                float fallOff2 = iter2->second.fallOff;
+
+                // axis/twist Angle between poseJoints
+                double angle = jointAngle(iter1->second.frame, iter2->second.frame, includeTwist);
+
+                // Accumulate pose weight using weight of this joint (dist/fallOff)
+                if (angle < fallOff2)
+                    weightij *= 1 - angle / fallOff2;
+                else
+                    weightij = 0;
+
+                if (angle < fallOff1)
+                    weightji *= 1 - angle / fallOff1;
+                else
+                    weightji = 0;
+            }
+
+            pose2PoseWeights[i * n + j] = weightij;
+            pose2PoseWeights[j * n + i] = weightji;
+        }
+    }
+
+    if (n == 0)
+        return;
+
+    // Re-weight pose2PoseWeights using Scattered Data Interpolation (solve Ax = B)
+    MatrixXf a(n, n);
+    MatrixXf b(n, n);
+    for (unsigned i = 0; i < n; ++i)
+        for (unsigned j = 0; j < n; ++j)
+        {
+            a(i, j) = (float)pose2PoseWeights[i * n + j];
+            b(i, j) = i == j;
+        }
+
+    MatrixXf x = a.colPivHouseholderQr().solve(b);
+
+    for (unsigned i = 0; i < n; ++i)
+        for (unsigned j = 0; j < n; ++j)
+            pose2PoseWeights[i * n + j] = x(i, j);
+}
+
+
+void PoseSolver::poseWeights(   const std::vector<Pose>&    poses, 
+                                const std::vector<double>&  pose2PoseWeights, 
+                                const JointFrameMap&        currJointFrames, 
+                                bool                        includeTwist, 
+                                std::vector<double>&        weights )
+{
+    const unsigned n = (unsigned)poses.size();
+
+    // For each pose, check how far pose joint rotations are from current joint rotations
+    std::vector<double> pose2CurrJointWeights(n);
+    for (unsigned i = 0; i < n; ++i)
+    {
+        double weight = 1;
+        for (PoseJointMap::const_iterator iter = poses[i].joints.begin(); iter != poses[i].joints.end(); ++iter)
+        {
+            if (poses[i].ignore)
+            {
+                weight = 0;
+                break;
+            }
+
+            const PoseJoint& poseJt = iter->second;
+
+            JointFrameMap::const_iterator currIter = currJointFrames.find(iter->first);
+            if (currIter == currJointFrames.end())
+            {
+                weight = 0;
+                break;
+            }
+
+            // axis/twist Angle between poseJoints
+            double angle = jointAngle(currIter->second, poseJt.frame, includeTwist);
+
+            if (angle < poseJt.fallOff)
+                weight *= 1 - (angle / poseJt.fallOff);
+            else
+            {
+                weight = 0;
+                break;
+            }
+        }
+
+        pose2CurrJointWeights[i] = weight;
+    }
+
+    // Final weights for each pose, from pose-2-currJoint weights re-weighted by pose2PoseWeights
+    weights.resize(n);
+    for (unsigned i = 0; i < n; ++i)
+    {
+        double weight = 0;
+        for (unsigned j = 0; j < n; ++j)
+            weight += pose2CurrJointWeights[j] * pose2PoseWeights[j * n + i];
+
+        if ( weight < 0 )
+            weight = 0;
+
+        weights[i] = weight;
+    }
+}
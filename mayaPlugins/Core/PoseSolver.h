@@ -0,0 +1,70 @@
+#ifndef POSESOLVER_H
+#define POSESOLVER_H
+
+#include <vector>
+#include <map>
+
+
+// Pose space weights from joint frames. A pose weights in by how close each of
+// its joints is to the pose, relative to the joint's falloff (degrees), and
+// the poses are re-weighted to be exactly 1 at their own pose
+namespace PoseSolver
+{
+    // Primary and up axis of a joint rotation, the vectors pose distances are measured on
+    class JointFrame
+    {
+    public:
+        JointFrame()
+        {
+            axis[0] = axis[1] = axis[2] = 0;
+            up[0] = up[1] = up[2] = 0;
+        }
+
+        double          axis[3];
+        double          up[3];
+    };
+
+    typedef std::map<int, JointFrame>   JointFrameMap;
+
+    class PoseJoint
+    {
+    public:
+        PoseJoint() : fallOff(0)    {}
+
+        JointFrame      frame;
+        float           fallOff;
+    };
+
+    typedef std::map<int, PoseJoint>    PoseJointMap;
+
+    class Pose
+    {
+    public:
+        Pose() : ignore(false)  {}
+
+        PoseJointMap    joints;
+        bool            ignore;
+    };
+
+
+    // Axis angle between the frames, plus the twist angle around the axis, in degrees
+    double  jointAngle(     const JointFrame&           frame1, 
+                            const JointFrame&           frame2, 
+                            bool                        includeTwist );
+
+    // Pose to pose weights, n x n row major, solved so pose i weights only
+    // itself in at its own pose (Scattered Data Interpolation, Ax = I)
+    void    solvePoseMatrix(    const std::vector<Pose>&    poses, 
+                                bool                        includeTwist, 
+                                std::vector<double>&        pose2PoseWeights );
+
+    // Weight of each pose at the current joint frames. A pose with a joint
+    // missing from currJointFrames weights 0, callers fill in rest frames
+    void    poseWeights(    const std::vector<Pose>&    poses, 
+                            const std::vector<double>&  pose2PoseWeights, 
+                            const JointFrameMap&        currJointFrames, 
+                            bool                        includeTwist, 
+                            std::vector<double>&        weights );
+};
+
+#endif
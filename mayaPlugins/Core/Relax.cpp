@@ -0,0 +1,204 @@
+#include "Relax.h"
+#include "ThreadPool.h"
+#include "utils.h"
+
+#include <mutex>
+#include <math.h>
+
+#include <Eigen/Dense>
+using namespace Eigen;
+
+
+// Vertices per task of a pass
+static const int RELAX_GRAIN = 4096;
+
+
+int Relax::smooth(  const Topology&         topology, 
+                    std::vector<double>     buffers[2], 
+                    int                     iterations, 
+                    float                   amount, 
+                    double                  tolerance, 
+                    short                   toleranceMode, 
+                    bool                    seeded )
+{
+    const unsigned numVertices = topology.numVertices();
+    buffers[0].resize(numVertices * 3);
+    buffers[1].resize(numVertices * 3);
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        const double* positions = &buffers[0][0];
+        double* newPositions = &buffers[1][0];
+
+        // Vertices only read the last pass, so chunks run independently
+        std::mutex mutex;
+        double maxMoveSq = 0, sumMoveSq = 0;
+        ThreadPool::parallelFor(0, (int)numVertices, [&](int begin, int end)
+        {
+            double chunkMaxSq = 0, chunkSumSq = 0;
+            for (int index = begin; index < end; ++index)
+            {
+                const int* neighbours = topology.neighbours(index);
+                const unsigned valence = topology.valence(index);
+
+                Map<const Vector3d> position(positions + index * 3);
+
+                Vector3d newPos = position;
+                for (unsigned j = 0; j < valence; ++j)
+                    newPos += Map<const Vector3d>(positions + neighbours[j] * 3);
+
+                newPos *= topology.smoothWeight(index);
+
+                Vector3d move = (newPos - position) * amount;
+                Map<Vector3d>(newPositions + index * 3) = position + move;
+
+                double moveSq = move.squaredNorm();
+                if (moveSq > chunkMaxSq)
+                    chunkMaxSq = moveSq;
+                chunkSumSq += moveSq;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (chunkMaxSq > maxMoveSq)
+                maxMoveSq = chunkMaxSq;
+            sumMoveSq += chunkSumSq;
+        }, RELAX_GRAIN);
+
+        double moved = 0;
+        if (tolerance > 0 && numVertices)
+            moved = toleranceMode == TOLERANCE_RMS ? sqrt(sumMoveSq / numVertices) : sqrt(maxMoveSq);
+
+        // A converged seed gains nothing from another pass but more smoothing
+        if (seeded && i == 0 && tolerance > 0 && moved < tolerance)
+            return 0;
+
+        buffers[0].swap(buffers[1]);
+
+        if (tolerance > 0 && moved < tolerance)
+            return i + 1;
+    }
+
+    return iterations;
+}
+
+int Relax::WarmStart::relax(    const Topology&         topology, 
+                                const float*            points, 
+                                std::vector<double>     buffers[2], 
+                                int                     iterations, 
+                                float                   amount, 
+                                double                  tolerance, 
+                                short                   toleranceMode )
+{
+    const unsigned count = topology.numVertices() * 3;
+
+    bool warm = tolerance > 0 &&
+                _inputPositions.size() == count &&
+                _relaxedPositions.size() == count;
+
+    // Input moved by up to tolerance since the cold start
+    const double toleranceSq = tolerance * tolerance;
+    for (unsigned i = 0; warm && i < count; i += 3)
+    {
+        double dx = points[i] - _inputPositions[i];
+        double dy = points[i+1] - _inputPositions[i+1];
+        double dz = points[i+2] - _inputPositions[i+2];
+        warm = dx * dx + dy * dy + dz * dz <= toleranceSq;
+    }
+
+    buffers[0].resize(count);
+    if (warm)
+    {
+        for (unsigned i = 0; i < count; ++i)
+            buffers[0][i] = _relaxedPositions[i] + (points[i] - _inputPositions[i]);
+
+        return smooth(topology, buffers, iterations, amount, tolerance, toleranceMode, true);
+    }
+
+    buffers[0].assign(points, points + count);
+    int passes = smooth(topology, buffers, iterations, amount, tolerance, toleranceMode);
+
+    // One that ran out of passes cant seed
+    if (tolerance > 0 && passes < iterations)
+    {
+        _inputPositions.assign(points, points + count);
+        _relaxedPositions = buffers[0];
+    }
+    else
+        reset();
+
+    return passes;
+}
+
+void Relax::WarmStart::reset()
+{
+    _inputPositions.clear();
+    _relaxedPositions.clear();
+}
+
+bool Relax::vertexFrame(    const double*       positions, 
+                            const Topology&     topology, 
+                            unsigned            index, 
+                            double              frame[3][3] )
+{
+    if (topology.valence(index) < 2)
+        return false;
+
+    const int* neighbours = topology.neighbours(index);
+    Map<const Vector3d> position(positions + index * 3);
+
+    Vector3d tangent = Map<const Vector3d>(positions + neighbours[0] * 3) - position;
+    Vector3d normal = tangent.cross(Map<const Vector3d>(positions + neighbours[1] * 3) - position);
+    if (tangent.norm() < FLOAT_TOLERANCE || normal.norm() < FLOAT_TOLERANCE)
+        return false;
+
+    Map<Vector3d> t(frame[0]), n(frame[1]), b(frame[2]);
+    t = tangent.normalized();
+    n = normal.normalized();
+    b = n.cross(t);
+
+    return true;
+}
+
+void Relax::encodeDetail(   const Topology&     topology, 
+                            const double*       restPositions, 
+                            const double*       relaxedPositions, 
+                            double*             deltas )
+{
+    const int numVertices = (int)topology.numVertices();
+
+    ThreadPool::parallelFor(0, numVertices, [&](int begin, int end)
+    {
+        for (int v = begin; v < end; ++v)
+        {
+            Vector3d delta = Map<const Vector3d>(restPositions + v * 3) - Map<const Vector3d>(relaxedPositions + v * 3);
+
+            double frame[3][3];
+            if (vertexFrame(relaxedPositions, topology, v, frame))
+                delta = Map<const Matrix<double, 3, 3, RowMajor> >(&frame[0][0]) * delta;
+
+            Map<Vector3d>(deltas + v * 3) = delta;
+        }
+    }, RELAX_GRAIN);
+}
+
+void Relax::decodeDetail(   const Topology&     topology, 
+                            const double*       relaxedPositions, 
+                            const double*       deltas, 
+                            double*             positions )
+{
+    const int numVertices = (int)topology.numVertices();
+
+    ThreadPool::parallelFor(0, numVertices, [&](int begin, int end)
+    {
+        for (int v = begin; v < end; ++v)
+        {
+            Vector3d delta = Map<const Vector3d>(deltas + v * 3);
+
+            double frame[3][3];
+            if (vertexFrame(relaxedPositions, topology, v, frame))
+                delta = Map<const Matrix<double, 3, 3, RowMajor> >(&frame[0][0]).transpose() * delta;
+
+            Map<Vector3d>(positions + v * 3) = Map<const Vector3d>(relaxedPositions + v * 3) + delta;
+        }
+    }, RELAX_GRAIN);
+}
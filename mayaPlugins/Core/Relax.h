@@ -0,0 +1,82 @@
+#ifndef RELAX_H
+#define RELAX_H
+
+#include "Topology.h"
+
+#include <vector>
+
+
+// Laplacian relax of mesh points and the rest detail (delta mush) kernels.
+// Points are xyz interleaved doubles
+namespace Relax
+{
+    enum ToleranceMode
+    {
+        TOLERANCE_MAX,
+        TOLERANCE_RMS,
+    };
+
+    // Move each vertex amount of the way to the average of itself and its
+    // neighbours, iterations times or until a pass moves less than tolerance.
+    // Passes ping-pong between the two buffers, the result ends up in
+    // buffers[0]. Returns the passes run. With seeded, buffers[0] is a relaxed
+    // result already and is returned as is, no pass applied, if the first
+    // pass moves less than tolerance
+    int     smooth(     const Topology&         topology, 
+                        std::vector<double>     buffers[2], 
+                        int                     iterations, 
+                        float                   amount, 
+                        double                  tolerance, 
+                        short                   toleranceMode, 
+                        bool                    seeded = false );
+
+    // Relax of successive frames of one mesh, seeded from the result of the
+    // last cold start moved by the input motion since. Only a cold result
+    // that converged to tolerance seeds, and only while no input point moved
+    // more than tolerance from it, other frames start cold. Warm frames never
+    // seed each other, so smoothing cant pile up over frames and a warm
+    // result stays within a few tolerances of a cold one
+    class WarmStart
+    {
+    public:
+
+        // Relax points, single precision as meshes hold them, into
+        // buffers[0]. Returns the passes run
+        int     relax(  const Topology&         topology, 
+                        const float*            points, 
+                        std::vector<double>     buffers[2], 
+                        int                     iterations, 
+                        float                   amount, 
+                        double                  tolerance, 
+                        short                   toleranceMode );
+
+        // Cold start the next frame
+        void    reset();
+
+    private:
+        std::vector<double>     _inputPositions;        // Of the last cold start
+        std::vector<double>     _relaxedPositions;
+    };
+
+    // Orthonormal frame (rows) of a vertex from its first two neighbours: edge
+    // to the first, normal of the two edges and their cross. False if degenerate
+    bool    vertexFrame(    const double*       positions, 
+                            const Topology&     topology, 
+                            unsigned            index, 
+                            double              frame[3][3] );
+
+    // Detail of rest points relax takes off, in the frames of the relaxed
+    // points. deltas may be restPositions, to encode in place
+    void    encodeDetail(   const Topology&     topology, 
+                            const double*       restPositions, 
+                            const double*       relaxedPositions, 
+                            double*             deltas );
+
+    // Relaxed points plus the detail, put back in their frames
+    void    decodeDetail(   const Topology&     topology, 
+                            const double*       relaxedPositions, 
+                            const double*       deltas, 
+                            double*             positions );
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "Topology.h"
+#include "utils.h"
+
+#include <algorithm>
+
+
+Topology::Topology( uint64_t    key, 
+                    unsigned    numVertices, 
+                    const int*  faceCounts, 
+                    unsigned    numFaces, 
+                    const int*  faceVertices )
+:   _key(key)
+{
+    unsigned numFaceVertices = 0;
+    for( unsigned f=0; f < numFaces; ++f )
+        numFaceVertices += faceCounts[f];
+
+    _faceCounts.assign(faceCounts, faceCounts + numFaces);
+    _faceVertices.assign(faceVertices, faceVertices + numFaceVertices);
+
+    // Walk faces so each vertex first meets the next and previous vertex of
+    // its first face, then any other edge neighbours, without duplicates
+    std::vector< std::vector<int> > adjacency(numVertices);
+
+    unsigned first = 0;
+    for( unsigned f=0; f < numFaces; ++f )
+    {
+        const int count = faceCounts[f];
+        const int* face = faceVertices + first;
+        for( int i=0; i < count; ++i )
+        {
+            std::vector<int>& vertexNeighbours = adjacency[face[i]];
+
+            int next = face[(i + 1) % count];
+            int prev = face[(i + count - 1) % count];
+            if (std::find(vertexNeighbours.begin(), vertexNeighbours.end(), next) == vertexNeighbours.end())
+                vertexNeighbours.push_back(next);
+            if (std::find(vertexNeighbours.begin(), vertexNeighbours.end(), prev) == vertexNeighbours.end())
+                vertexNeighbours.push_back(prev);
+        }
+        first += count;
+    }
+
+    _offsets.resize(numVertices + 1);
+    _offsets[0] = 0;
+    for( unsigned v=0; v < numVertices; ++v )
+        _offsets[v+1] = _offsets[v] + (unsigned)adjacency[v].size();
+
+    _neighbours.resize(_offsets[numVertices]);
+    _smoothWeights.resize(numVertices);
+    for( unsigned v=0; v < numVertices; ++v )
+    {
+        std::copy(adjacency[v].begin(), adjacency[v].end(), _neighbours.begin() + _offsets[v]);
+        _smoothWeights[v] = 1.0 / (adjacency[v].size() + 1);
+    }
+}
+
+bool Topology::matches(    unsigned    numVertices, 
+                            const int*  faceCounts, 
+                            unsigned    numFaces, 
+                            const int*  faceVertices ) const
+{
+    if (numVertices != this->numVertices() || numFaces != _faceCounts.size())
+        return false;
+
+    if (!std::equal(_faceCounts.begin(), _faceCounts.end(), faceCounts))
+        return false;
+
+    return std::equal(_faceVertices.begin(), _faceVertices.end(), faceVertices);
+}
+
+size_t Topology::bytes() const
+{
+    return sizeof(Topology) +
+           _faceCounts.capacity() * sizeof(int) +
+           _faceVertices.capacity() * sizeof(int) +
+           _offsets.capacity() * sizeof(unsigned) +
+           _neighbours.capacity() * sizeof(int) +
+           _smoothWeights.capacity() * sizeof(double);
+}
+
+uint64_t Topology::hash(    unsigned    numVertices, 
+                            const int*  faceCounts, 
+                            unsigned    numFaces, 
+                            const int*  faceVertices )
+{
+    unsigned numFaceVertices = 0;
+    for( unsigned f=0; f < numFaces; ++f )
+        numFaceVertices += faceCounts[f];
+
+    uint64_t key = hashBytes(&numVertices, sizeof(numVertices));
+    key = hashBytes(&numFaces, sizeof(numFaces), key);
+    key = hashBytes(faceCounts, numFaces * sizeof(int), key);
+    key = hashBytes(faceVertices, numFaceVertices * sizeof(int), key);
+    return key;
+}
+
+
+std::mutex                  TopologyCache::_mutex;
+TopologyCache::TopologyMap  TopologyCache::_topologies;
+
+TopologyPtr TopologyCache::acquire( unsigned    numVertices, 
+                                    const int*  faceCounts, 
+                                    unsigned    numFaces, 
+                                    const int*  faceVertices )
+{
+    uint64_t key = Topology::hash(numVertices, faceCounts, numFaces, faceVertices);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::pair<TopologyMap::iterator, TopologyMap::iterator> range = _topologies.equal_range(key);
+    for( TopologyMap::iterator it=range.first; it != range.second; ++it )
+    {
+        TopologyPtr topology = it->second.lock();
+        if (topology && topology->matches(numVertices, faceCounts, numFaces, faceVertices))
+            return topology;
+    }
+
+    purge();
+
+    // Built under the lock, so geometries loading together build it once
+    TopologyPtr topology(new Topology(key, numVertices, faceCounts, numFaces, faceVertices));
+    _topologies.insert(std::make_pair(key, std::weak_ptr<const Topology>(topology)));
+
+    return topology;
+}
+
+unsigned TopologyCache::size()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    purge();
+    return (unsigned)_topologies.size();
+}
+
+size_t TopologyCache::bytes()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    size_t total = 0;
+    TopologyMap::const_iterator it;
+    for( it=_topologies.begin(); it != _topologies.end(); ++it )
+    {
+        TopologyPtr topology = it->second.lock();
+        if (topology)
+            total += topology->bytes();
+    }
+    return total;
+}
+
+// Drop entries of topologies no geometry uses anymore. Call with _mutex locked
+void TopologyCache::purge()
+{
+    TopologyMap::iterator it = _topologies.begin();
+    while (it != _topologies.end())
+    {
+        if (it->second.expired())
+            _topologies.erase(it++);
+        else
+            ++it;
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Vertex adjacency of a polygon mesh in CSR form, with the uniform smoothing
+// operator. Immutable once built, so one copy is shared
+// by every geometry with the same face vertices
+class Topology
+{
+public:
+
+    // Built from per face vertex counts and face vertex indices, as
+    // MFnMesh::getVertices returns them
+    Topology(   uint64_t    key, 
+                unsigned    numVertices, 
+                const int*  faceCounts, 
+                unsigned    numFaces, 
+                const int*  faceVertices );
+
+    uint64_t        key() const                         { return _key; }
+    unsigned        numVertices() const                 { return (unsigned)_offsets.size() - 1; }
+
+    // Edge connected vertices of v. The first two share a face with v, so
+    // they span its tangent plane
+    unsigned        valence( unsigned v ) const         { return _offsets[v+1] - _offsets[v]; }
+    const int*      neighbours( unsigned v ) const      { return &_neighbours[0] + _offsets[v]; }
+
+    // 1 / (valence + 1), the weight of each vertex in the average of v
+    double          smoothWeight( unsigned v ) const    { return _smoothWeights[v]; }
+
+    // True if built from exactly these face vertices, keys can collide
+    bool            matches(    unsigned    numVertices, 
+                                const int*  faceCounts, 
+                                unsigned    numFaces, 
+                                const int*  faceVertices ) const;
+
+    size_t          bytes() const;
+
+    // Key of face vertices, equal for meshes that share topology
+    static uint64_t hash(   unsigned    numVertices, 
+                            const int*  faceCounts, 
+                            unsigned    numFaces, 
+                            const int*  faceVertices );
+
+private:
+    Topology( const Topology& );
+    Topology& operator=( const Topology& );
+
+    uint64_t                _key;
+    std::vector<int>        _faceCounts;
+    std::vector<int>        _faceVertices;
+    std::vector<unsigned>   _offsets;
+    std::vector<int>        _neighbours;
+    std::vector<double>     _smoothWeights;
+};
+
+typedef std::shared_ptr<const Topology>     TopologyPtr;
+
+
+// Plugin wide registry of topologies by key, compared on their face vertices
+// before one is shared. Holds them weakly, a topology lives as long as some
+// node geometry uses it
+class TopologyCache
+{
+public:
+
+    // Topology of the face vertices, built on first use
+    static TopologyPtr  acquire(    unsigned    numVertices, 
+                                    const int*  faceCounts, 
+                                    unsigned    numFaces, 
+                                    const int*  faceVertices );
+
+    // Topologies in use and their memory
+    static unsigned     size();
+    static size_t       bytes();
+
+private:
+    static void         purge();
+
+    static std::mutex                                   _mutex;
+    typedef std::multimap<uint64_t, std::weak_ptr<const Topology> >    TopologyMap;
+
+    static TopologyMap          _topologies;
+};
+
+#endif
@@ -0,0 +1,430 @@
+#include "PoseLibrary.h"
+
+#include <fstream>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+namespace PoseLibrary
+{
+
+static uint64_t align( uint64_t offset )
+{
+    return (offset + BLOCK_ALIGNMENT - 1) & ~(BLOCK_ALIGNMENT - 1);
+}
+
+// Write zeros from pos up to offset
+static void pad( std::ofstream& stream, uint64_t& pos, uint64_t offset )
+{
+    static const char zeros[BLOCK_ALIGNMENT] = { 0 };
+
+    while (pos < offset)
+    {
+        uint64_t count = offset - pos;
+        if (count > BLOCK_ALIGNMENT)
+            count = BLOCK_ALIGNMENT;
+
+        stream.write(zeros, (std::streamsize)count);
+        pos += count;
+    }
+}
+
+static void writeBlock( std::ofstream& stream, uint64_t& pos, const void* data, uint64_t size )
+{
+    if (size == 0)
+        return;
+
+    stream.write((const char*)data, (std::streamsize)size);
+    pos += size;
+}
+
+
+bool write( const std::string& path, const std::vector<PoseData>& poses, std::string& error )
+{
+    // Flatten poses into records
+    std::vector<PoseRecord> poseRecords;
+    std::vector<PoseJointRecord> jointRecords;
+    std::vector<TargetRecord> targetRecords;
+    std::vector<const TargetData*> targetData;
+    std::string strings;
+
+    for( unsigned p=0; p < poses.size(); ++p )
+    {
+        const PoseData& pose = poses[p];
+
+        PoseRecord poseRecord;
+        poseRecord.index = pose.index;
+        poseRecord.nameOffset = (uint32_t)strings.size();
+        poseRecord.ignore = pose.ignore ? 1 : 0;
+        poseRecord.envelope = pose.envelope;
+        poseRecord.firstJoint = (uint32_t)jointRecords.size();
+        poseRecord.numJoints = (uint32_t)pose.joints.size();
+        poseRecord.firstTarget = (uint32_t)targetRecords.size();
+        poseRecord.numTargets = (uint32_t)pose.targets.size();
+        poseRecords.push_back(poseRecord);
+
+        strings += pose.name;
+        strings += '\0';
+
+        for( unsigned j=0; j < pose.joints.size(); ++j )
+        {
+            PoseJointRecord jointRecord;
+            jointRecord.index = pose.joints[j].index;
+            jointRecord.fallOff = pose.joints[j].fallOff;
+            for( unsigned k=0; k < 3; ++k )
+                jointRecord.rotation[k] = pose.joints[j].rotation[k];
+            jointRecords.push_back(jointRecord);
+        }
+
+        for( unsigned t=0; t < pose.targets.size(); ++t )
+        {
+            const TargetData& target = pose.targets[t];
+
+            if (target.deltas.size() != target.components.size() * 3)
+            {
+                error = "Pose target components and deltas differ in length";
+                return false;
+            }
+
+            // Readers reject the file otherwise
+            for( unsigned c=0; c < target.components.size(); ++c )
+            {
+                if (target.components[c] < 0 || target.components[c] > MAX_COMPONENT)
+                {
+                    error = "Pose target component index out of range";
+                    return false;
+                }
+            }
+
+            TargetRecord targetRecord;
+            memset(&targetRecord, 0, sizeof(TargetRecord));
+            targetRecord.index = target.index;
+            targetRecord.nameOffset = (uint32_t)strings.size();
+            targetRecord.geomIndex = target.geomIndex;
+            targetRecord.envelope = target.envelope;
+            targetRecord.numComponents = (uint32_t)target.components.size();
+            targetRecords.push_back(targetRecord);
+            targetData.push_back(&target);
+
+            strings += target.name;
+            strings += '\0';
+        }
+    }
+
+
+    // Layout
+    Header header;
+    memset(&header, 0, sizeof(Header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.numPoses = (uint32_t)poseRecords.size();
+    header.numPoseJoints = (uint32_t)jointRecords.size();
+    header.numTargets = (uint32_t)targetRecords.size();
+
+    uint64_t offset = align(sizeof(Header));
+    header.posesOffset = offset;
+    offset = align(offset + poseRecords.size() * sizeof(PoseRecord));
+    header.poseJointsOffset = offset;
+    offset = align(offset + jointRecords.size() * sizeof(PoseJointRecord));
+    header.targetsOffset = offset;
+    offset = align(offset + targetRecords.size() * sizeof(TargetRecord));
+    header.stringsOffset = offset;
+    offset = align(offset + strings.size());
+    header.dataOffset = offset;
+
+    for( unsigned t=0; t < targetRecords.size(); ++t )
+    {
+        targetRecords[t].componentsOffset = offset;
+        offset = align(offset + targetRecords[t].numComponents * sizeof(int32_t));
+        targetRecords[t].deltasOffset = offset;
+        offset = align(offset + targetRecords[t].numComponents * 3 * sizeof(double));
+    }
+    header.fileSize = offset;
+
+
+    // Write
+    std::ofstream stream(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!stream)
+    {
+        error = "Failed to open pose library for writing: " + path;
+        return false;
+    }
+
+    uint64_t pos = 0;
+    writeBlock(stream, pos, &header, sizeof(Header));
+
+    pad(stream, pos, header.posesOffset);
+    writeBlock(stream, pos, poseRecords.empty() ? 0 : &poseRecords[0], poseRecords.size() * sizeof(PoseRecord));
+
+    pad(stream, pos, header.poseJointsOffset);
+    writeBlock(stream, pos, jointRecords.empty() ? 0 : &jointRecords[0], jointRecords.size() * sizeof(PoseJointRecord));
+
+    pad(stream, pos, header.targetsOffset);
+    writeBlock(stream, pos, targetRecords.empty() ? 0 : &targetRecords[0], targetRecords.size() * sizeof(TargetRecord));
+
+    pad(stream, pos, header.stringsOffset);
+    writeBlock(stream, pos, strings.data(), strings.size());
+
+    for( unsigned t=0; t < targetRecords.size(); ++t )
+    {
+        const TargetData& target = *targetData[t];
+
+        pad(stream, pos, targetRecords[t].componentsOffset);
+        writeBlock(stream, pos, target.components.empty() ? 0 : &target.components[0], target.components.size() * sizeof(int32_t));
+
+        pad(stream, pos, targetRecords[t].deltasOffset);
+        writeBlock(stream, pos, target.deltas.empty() ? 0 : &target.deltas[0], target.deltas.size() * sizeof(double));
+    }
+    pad(stream, pos, header.fileSize);
+
+    if (!stream)
+    {
+        error = "Failed to write pose library: " + path;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+MappedFile::MappedFile()
+:   _data(0),
+    _size(0),
+#ifdef _WIN32
+    _file(INVALID_HANDLE_VALUE),
+    _mapping(0)
+#else
+    _file(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open( const std::string& path )
+{
+    close();
+
+#ifdef _WIN32
+    _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+    {
+        close();
+        return false;
+    }
+    _size = (size_t)size.QuadPart;
+
+    _mapping = CreateFileMappingA(_file, 0, PAGE_READONLY, 0, 0, 0);
+    if (_mapping == 0)
+    {
+        close();
+        return false;
+    }
+
+    _data = (const char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    _file = ::open(path.c_str(), O_RDONLY);
+    if (_file == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(_file, &st) != 0 || st.st_size == 0)
+    {
+        close();
+        return false;
+    }
+    _size = (size_t)st.st_size;
+
+    void* data = mmap(0, _size, PROT_READ, MAP_PRIVATE, _file, 0);
+    if (data != MAP_FAILED)
+        _data = (const char*)data;
+#endif
+
+    if (_data == 0)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (_data)
+        UnmapViewOfFile(_data);
+    if (_mapping)
+        CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE)
+        CloseHandle(_file);
+
+    _mapping = 0;
+    _file = INVALID_HANDLE_VALUE;
+#else
+    if (_data)
+        munmap((void*)_data, _size);
+    if (_file != -1)
+        ::close(_file);
+
+    _file = -1;
+#endif
+
+    _data = 0;
+    _size = 0;
+}
+
+
+
+Reader::Reader()
+:   _header(0),
+    _poses(0),
+    _poseJoints(0),
+    _targets(0)
+{
+}
+
+bool Reader::open( const std::string& path, std::string& error )
+{
+    close();
+
+    if (!_file.open(path))
+    {
+        error = "Failed to open pose library: " + path;
+        return false;
+    }
+
+    if (!validate(error))
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void Reader::close()
+{
+    _file.close();
+
+    _header = 0;
+    _poses = 0;
+    _poseJoints = 0;
+    _targets = 0;
+}
+
+// Check header, that every record points inside the file and that component
+// indices are in [0, MAX_COMPONENT], so records can be used without further bounds checks
+bool Reader::validate( std::string& error )
+{
+    const char* data = _file.data();
+    const uint64_t size = _file.size();
+
+    error = "Invalid or corrupt pose library";
+
+    if (size < sizeof(Header))
+        return false;
+
+    _header = (const Header*)data;
+    if (memcmp(_header->magic, MAGIC, sizeof(MAGIC)) != 0)
+        return false;
+
+    if (_header->version != VERSION)
+    {
+        error = "Unsupported pose library version";
+        return false;
+    }
+
+    if (_header->fileSize != size)
+        return false;
+
+    const uint64_t sections[] = { _header->posesOffset, _header->poseJointsOffset, _header->targetsOffset, _header->stringsOffset, _header->dataOffset };
+    for( unsigned i=0; i < 5; ++i )
+    {
+        if (sections[i] % BLOCK_ALIGNMENT || sections[i] > size)
+            return false;
+        if (i && sections[i] < sections[i-1])
+            return false;
+    }
+
+    if (_header->posesOffset + (uint64_t)_header->numPoses * sizeof(PoseRecord) > _header->poseJointsOffset ||
+        _header->poseJointsOffset + (uint64_t)_header->numPoseJoints * sizeof(PoseJointRecord) > _header->targetsOffset ||
+        _header->targetsOffset + (uint64_t)_header->numTargets * sizeof(TargetRecord) > _header->stringsOffset)
+        return false;
+
+    _poses = (const PoseRecord*)(data + _header->posesOffset);
+    _poseJoints = (const PoseJointRecord*)(data + _header->poseJointsOffset);
+    _targets = (const TargetRecord*)(data + _header->targetsOffset);
+
+    // Last string must be null terminated within the string block
+    const uint64_t stringsSize = _header->dataOffset - _header->stringsOffset;
+    if (stringsSize && data[_header->dataOffset - 1] != '\0')
+        return false;
+
+    for( uint32_t p=0; p < _header->numPoses; ++p )
+    {
+        const PoseRecord& pose = _poses[p];
+        if (pose.nameOffset >= stringsSize ||
+            (uint64_t)pose.firstJoint + pose.numJoints > _header->numPoseJoints ||
+            (uint64_t)pose.firstTarget + pose.numTargets > _header->numTargets)
+            return false;
+    }
+
+    for( uint32_t t=0; t < _header->numTargets; ++t )
+    {
+        const TargetRecord& target = _targets[t];
+        if (target.nameOffset >= stringsSize ||
+            target.componentsOffset % BLOCK_ALIGNMENT || target.deltasOffset % BLOCK_ALIGNMENT ||
+            target.componentsOffset < _header->dataOffset || target.deltasOffset < _header->dataOffset ||
+            target.componentsOffset + (uint64_t)target.numComponents * sizeof(int32_t) > size ||
+            target.deltasOffset + (uint64_t)target.numComponents * 3 * sizeof(double) > size)
+            return false;
+
+        // Components index the dense per geometry arrays targets are loaded into
+        const int32_t* components = (const int32_t*)(data + target.componentsOffset);
+        for( uint32_t c=0; c < target.numComponents; ++c )
+        {
+            if (components[c] < 0 || components[c] > MAX_COMPONENT)
+                return false;
+        }
+    }
+
+    error.clear();
+    return true;
+}
+
+const char* Reader::string( uint32_t offset ) const
+{
+    return _file.data() + _header->stringsOffset + offset;
+}
+
+const int32_t* Reader::components( const TargetRecord& target ) const
+{
+    return (const int32_t*)(_file.data() + target.componentsOffset);
+}
+
+const double* Reader::deltas( const TargetRecord& target ) const
+{
+    return (const double*)(_file.data() + target.deltasOffset);
+}
+
+}
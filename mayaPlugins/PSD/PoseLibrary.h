@@ -0,0 +1,169 @@
+#ifndef POSELIBRARY_H
+#define POSELIBRARY_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Binary pose library file, little endian
+//
+//  Header
+//  PoseRecord          [numPoses]
+//  PoseJointRecord     [numPoseJoints]
+//  TargetRecord        [numTargets]
+//  string block        null terminated pose/target names
+//  data block          target components (int32) and deltas (3 x double)
+//
+// Every section and every components/deltas array starts at a
+// BLOCK_ALIGNMENT aligned offset, so a mapped file can be read in place
+namespace PoseLibrary
+{
+    const char          MAGIC[4]            = { 'P', 'S', 'D', 'L' };
+    const uint32_t      VERSION             = 1;
+    const uint64_t      BLOCK_ALIGNMENT     = 16;
+    const int32_t       MAX_COMPONENT       = (1 << 26) - 1;   // Bounds the dense arrays targets load into
+
+
+    struct Header
+    {
+        char            magic[4];
+        uint32_t        version;
+        uint32_t        numPoses;
+        uint32_t        numPoseJoints;
+        uint32_t        numTargets;
+        uint32_t        reserved;
+        uint64_t        posesOffset;
+        uint64_t        poseJointsOffset;
+        uint64_t        targetsOffset;
+        uint64_t        stringsOffset;
+        uint64_t        dataOffset;
+        uint64_t        fileSize;
+    };
+
+    struct PoseRecord
+    {
+        uint32_t        index;
+        uint32_t        nameOffset;         // Into string block
+        uint32_t        ignore;
+        float           envelope;
+        uint32_t        firstJoint;
+        uint32_t        numJoints;
+        uint32_t        firstTarget;
+        uint32_t        numTargets;
+    };
+
+    struct PoseJointRecord
+    {
+        uint32_t        index;
+        float           fallOff;
+        double          rotation[3];        // Radians
+    };
+
+    // One record per target and geometry
+    struct TargetRecord
+    {
+        uint32_t        index;
+        uint32_t        nameOffset;         // Into string block
+        uint32_t        geomIndex;
+        float           envelope;
+        uint32_t        numComponents;
+        uint32_t        reserved;
+        uint64_t        componentsOffset;   // From start of file
+        uint64_t        deltasOffset;       // From start of file
+    };
+
+
+    // In memory pose data to be written
+    class PoseJointData
+    {
+    public:
+        unsigned                index;
+        float                   fallOff;
+        double                  rotation[3];
+    };
+
+    class TargetData
+    {
+    public:
+        unsigned                index;
+        std::string             name;
+        unsigned                geomIndex;
+        float                   envelope;
+        std::vector<int32_t>    components;
+        std::vector<double>     deltas;     // 3 per component
+    };
+
+    class PoseData
+    {
+    public:
+        unsigned                    index;
+        std::string                 name;
+        bool                        ignore;
+        float                       envelope;
+        std::vector<PoseJointData>  joints;
+        std::vector<TargetData>     targets;
+    };
+
+    bool write( const std::string& path, const std::vector<PoseData>& poses, std::string& error );
+
+
+    // Read only memory mapped file
+    class MappedFile
+    {
+    public:
+        MappedFile();
+        ~MappedFile();
+
+        bool            open( const std::string& path );
+        void            close();
+
+        const char*     data() const        { return _data; }
+        size_t          size() const        { return _size; }
+
+    private:
+        MappedFile( const MappedFile& );
+        MappedFile& operator=( const MappedFile& );
+
+        const char*     _data;
+        size_t          _size;
+#ifdef _WIN32
+        void*           _file;
+        void*           _mapping;
+#else
+        int             _file;
+#endif
+    };
+
+
+    // Validated, in place view of a mapped pose library
+    class Reader
+    {
+    public:
+        Reader();
+
+        bool                    open( const std::string& path, std::string& error );
+        void                    close();
+
+        const Header&           header() const      { return *_header; }
+        const PoseRecord*       poses() const       { return _poses; }
+        const PoseJointRecord*  poseJoints() const  { return _poseJoints; }
+        const TargetRecord*     targets() const     { return _targets; }
+
+        const char*             string( uint32_t offset ) const;
+        const int32_t*          components( const TargetRecord& target ) const;
+        const double*           deltas( const TargetRecord& target ) const;
+
+    private:
+        bool                    validate( std::string& error );
+
+        MappedFile              _file;
+        const Header*           _header;
+        const PoseRecord*       _poses;
+        const PoseJointRecord*  _poseJoints;
+        const TargetRecord*     _targets;
+    };
+}
+
+#endif
@@ -1,8 +1,15 @@
 #include "PoseSpaceCommand.h"
 #include "PoseSpaceDeformer.h"
+#include "PoseLibrary.h"
 #include "utils.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
 
 #include <map>
+#include <set>
+
+#include <Eigen/Dense>
+using namespace Eigen;
 
 #include <maya/MGlobal.h>
 #include <maya/MMatrix.h>
@@ -13,13 +20,19 @@
 #include <maya/MFnMesh.h>
 #include <maya/MFnTransform.h>
 #include <maya/MFnSkinCluster.h>
+#include <maya/MFnSingleIndexedComponent.h>
+#include <maya/MDagPathArray.h>
+#include <maya/MDoubleArray.h>
 #include <maya/MFnGeometryFilter.h>
 #include <maya/MDagPath.h>
 #include <maya/MArgDatabase.h>
 #include <maya/MItDependencyGraph.h>
 #include <maya/MIntArray.h>
+#include <maya/MVectorArray.h>
 #include <maya/MPointArray.h>
 #include <maya/MEulerRotation.h>
+#include <maya/MPlugArray.h>
+#include <maya/MFnDagNode.h>
 
 
 #define SFLAG_HELP                      "h"
@@ -28,6 +41,46 @@
 #define LFLAG_SETPOSETARGET             "setPoseTarget"
 #define SFLAG_UPDATEPOSETARGET          "upt"
 #define LFLAG_UPDATEPOSETARGET          "updatePoseTarget"
+#define SFLAG_BATCHSETPOSETARGET        "bpt"
+#define LFLAG_BATCHSETPOSETARGET        "batchSetPoseTarget"
+#define SFLAG_EXPORTPOSELIBRARY         "epl"
+#define LFLAG_EXPORTPOSELIBRARY         "exportPoseLibrary"
+#define SFLAG_IMPORTPOSELIBRARY         "ipl"
+#define LFLAG_IMPORTPOSELIBRARY         "importPoseLibrary"
+#define SFLAG_COMMITSCULPT              "cms"
+#define LFLAG_COMMITSCULPT              "commitSculpt"
+#define SFLAG_PRUNETARGETS              "prn"
+#define LFLAG_PRUNETARGETS              "pruneTargets"
+#define SFLAG_MERGETOLERANCE            "mtl"
+#define LFLAG_MERGETOLERANCE            "mergeTolerance"
+#define SFLAG_UPDATEPOSEJOINTS          "upj"
+#define LFLAG_UPDATEPOSEJOINTS          "updatePoseJoints"
+#define SFLAG_THREADCAP                 "tcp"
+#define LFLAG_THREADCAP                 "threadCap"
+#define SFLAG_GEOMETRYINDEX             "gi"
+
+// Query flags
+#define SFLAG_POSENAMES                 "pns"
+#define LFLAG_POSENAMES                 "poseNames"
+#define SFLAG_POSEINDICES               "pis"
+#define LFLAG_POSEINDICES               "poseIndices"
+#define SFLAG_POSEWEIGHTS               "pws"
+#define LFLAG_POSEWEIGHTS               "poseWeights"
+#define SFLAG_POSEINDEX                 "pi"
+#define LFLAG_POSEINDEX                 "poseIndex"
+#define SFLAG_POSEJOINTS                "pjs"
+#define LFLAG_POSEJOINTS                "poseJoints"
+#define SFLAG_POSETARGETNAMES           "ptn"
+#define LFLAG_POSETARGETNAMES           "poseTargetNames"
+#define SFLAG_POSETARGETINDICES         "pti"
+#define LFLAG_POSETARGETINDICES         "poseTargetIndices"
+#define SFLAG_POSETARGETINDEX           "ptx"
+#define LFLAG_POSETARGETINDEX           "poseTargetIndex"
+#define SFLAG_JOINTINDICES              "jis"
+#define LFLAG_JOINTINDICES              "jointIndices"
+#define SFLAG_JOINTNAMES                "jns"
+#define LFLAG_JOINTNAMES                "jointNames"
+#define LFLAG_GEOMETRYINDEX             "geometryIndex"
 
 
 #define MATCHARG(str, shortName, longName) \
@@ -38,7 +91,28 @@
 const char * PoseSpaceCommand::name(PluginNames::PoseSpaceCommand);
 
 
-typedef std::map<int, MMatrix>      JointMatrixMap;
+// Bulk read skinCluster data of a deformed geometry
+class SkinData
+{
+public:
+    SkinData() : pruneThreshold(0), inverses(0)    {}
+
+    std::vector<Matrix3d>   jointMatrices;
+
+    // Weights of vertex v in [weightOffsets[v], weightOffsets[v+1])
+    std::vector<unsigned>   weightOffsets;
+    std::vector<unsigned>   weightInfluences;
+    std::vector<double>     weightValues;
+
+    MPointArray             positions;
+
+    // Deltas shorter than pruneThreshold in world space arent kept
+    MMatrix                 worldMatrix;
+    double                  pruneThreshold;
+
+    // Inverse skin matrices on the deformer, keyed by the data above
+    SkinInverseCache*       inverses;
+};
 
 
 void* PoseSpaceCommand::creator()
@@ -66,6 +140,81 @@ void PoseSpaceCommand::usage()
     SPRINTF(buf, "%s -%s <poseIndex> <targetIndex> <psdNode>", cmd, LFLAG_UPDATEPOSETARGET);
     str += buf;
 
+    SPRINTF(buf, "\n//   %-70s : ", "Set/update pose target of the given deformed geometry (default 0)");
+    str += buf;
+    SPRINTF(buf, "%s -%s <poseIndex> <targetIndex> -%s <geomIndex> <psdNode>", cmd, LFLAG_SETPOSETARGET, LFLAG_GEOMETRYINDEX);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Set several existing pose targets from meshes (multi-use)");
+    str += buf;
+    SPRINTF(buf, "%s -%s <poseIndex> <targetIndex> <mesh> -%s ... <psdNode>", cmd, LFLAG_BATCHSETPOSETARGET, LFLAG_BATCHSETPOSETARGET);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Export poses and targets to a binary pose library");
+    str += buf;
+    SPRINTF(buf, "%s -%s <file> <psdNode>", cmd, LFLAG_EXPORTPOSELIBRARY);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Import poses and targets from a binary pose library");
+    str += buf;
+    SPRINTF(buf, "%s -%s <file> <psdNode>", cmd, LFLAG_IMPORTPOSELIBRARY);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Add live sculpt layer to target at sculptPose/sculptTarget");
+    str += buf;
+    SPRINTF(buf, "%s -%s <psdNode>", cmd, LFLAG_COMMITSCULPT);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Drop target deltas shorter than threshold (world space)");
+    str += buf;
+    SPRINTF(buf, "%s -%s <threshold> <psdNode>", cmd, LFLAG_PRUNETARGETS);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Also merge near identical targets of a pose");
+    str += buf;
+    SPRINTF(buf, "%s -%s <threshold> -%s <tolerance> <psdNode>", cmd, LFLAG_PRUNETARGETS, LFLAG_MERGETOLERANCE);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Set pose joint rotations from the current joint rotations");
+    str += buf;
+    SPRINTF(buf, "%s -%s <poseIndex> <psdNode>", cmd, LFLAG_UPDATEPOSEJOINTS);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Cap threads of the plugin thread pool, 0 for all (plugin wide)");
+    str += buf;
+    SPRINTF(buf, "%s -%s <threads>", cmd, LFLAG_THREADCAP);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query the plugin thread pool cap");
+    str += buf;
+    SPRINTF(buf, "%s -q -%s", cmd, LFLAG_THREADCAP);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query all pose names/indices/weights, in pose index order");
+    str += buf;
+    SPRINTF(buf, "%s -q -%s|-%s|-%s <psdNode>", cmd, LFLAG_POSENAMES, LFLAG_POSEINDICES, LFLAG_POSEWEIGHTS);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query pose index of a pose name, -1 if not found");
+    str += buf;
+    SPRINTF(buf, "%s -q -%s <poseName> <psdNode>", cmd, LFLAG_POSEINDEX);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query joint indices/target names/target indices of a pose");
+    str += buf;
+    SPRINTF(buf, "%s -q -%s|-%s|-%s <poseIndex> <psdNode>", cmd, LFLAG_POSEJOINTS, LFLAG_POSETARGETNAMES, LFLAG_POSETARGETINDICES);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query target index of a target name in a pose, -1 if not found");
+    str += buf;
+    SPRINTF(buf, "%s -q -%s <poseIndex> <targetName> <psdNode>", cmd, LFLAG_POSETARGETINDEX);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query joint indices and connected joint names");
+    str += buf;
+    SPRINTF(buf, "%s -q -%s|-%s <psdNode>", cmd, LFLAG_JOINTINDICES, LFLAG_JOINTNAMES);
+    str += buf;
+
     MGlobal::displayInfo( str );
 
 
@@ -82,6 +231,31 @@ void PoseSpaceCommand::usage()
     SPRINTF(buf, "cmds.%s( <psdNode>, %s=[<poseIndex>, <targetIndex>] )", cmd, LFLAG_UPDATEPOSETARGET);
     str += buf;
 
+    SPRINTF(buf, "\n//   %-70s : ", "Set several existing pose targets from meshes");
+    str += buf;
+    SPRINTF(buf, "cmds.%s( <psdNode>, %s=[(<poseIndex>, <targetIndex>, <mesh>), ...] )", cmd, LFLAG_BATCHSETPOSETARGET);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Export poses and targets to a binary pose library");
+    str += buf;
+    SPRINTF(buf, "cmds.%s( <psdNode>, %s=<file> )", cmd, LFLAG_EXPORTPOSELIBRARY);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Import poses and targets from a binary pose library");
+    str += buf;
+    SPRINTF(buf, "cmds.%s( <psdNode>, %s=<file> )", cmd, LFLAG_IMPORTPOSELIBRARY);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query all pose names");
+    str += buf;
+    SPRINTF(buf, "cmds.%s( <psdNode>, q=1, %s=1 )", cmd, LFLAG_POSENAMES);
+    str += buf;
+
+    SPRINTF(buf, "\n//   %-70s : ", "Query target names of a pose");
+    str += buf;
+    SPRINTF(buf, "cmds.%s( <psdNode>, q=1, %s=<poseIndex> )", cmd, LFLAG_POSETARGETNAMES);
+    str += buf;
+
     MGlobal::displayInfo( str );    
 }
 
@@ -96,8 +270,34 @@ MSyntax PoseSpaceCommand::cmdSyntax()
 
     syntax.addFlag(SFLAG_SETPOSETARGET, LFLAG_SETPOSETARGET, MSyntax::kUnsigned, MSyntax::kUnsigned);
     syntax.addFlag(SFLAG_UPDATEPOSETARGET, LFLAG_UPDATEPOSETARGET, MSyntax::kUnsigned, MSyntax::kUnsigned);
-
-    syntax.enableQuery(false);
+    syntax.addFlag(SFLAG_BATCHSETPOSETARGET, LFLAG_BATCHSETPOSETARGET, MSyntax::kUnsigned, MSyntax::kUnsigned, MSyntax::kString);
+    syntax.makeFlagMultiUse(LFLAG_BATCHSETPOSETARGET);
+    syntax.addFlag(SFLAG_EXPORTPOSELIBRARY, LFLAG_EXPORTPOSELIBRARY, MSyntax::kString);
+    syntax.addFlag(SFLAG_IMPORTPOSELIBRARY, LFLAG_IMPORTPOSELIBRARY, MSyntax::kString);
+    syntax.addFlag(SFLAG_COMMITSCULPT, LFLAG_COMMITSCULPT);
+    syntax.addFlag(SFLAG_PRUNETARGETS, LFLAG_PRUNETARGETS, MSyntax::kDouble);
+    syntax.addFlag(SFLAG_MERGETOLERANCE, LFLAG_MERGETOLERANCE, MSyntax::kDouble);
+    syntax.addFlag(SFLAG_UPDATEPOSEJOINTS, LFLAG_UPDATEPOSEJOINTS, MSyntax::kUnsigned);
+    syntax.addFlag(SFLAG_THREADCAP, LFLAG_THREADCAP, MSyntax::kUnsigned);
+    syntax.addFlag(SFLAG_GEOMETRYINDEX, LFLAG_GEOMETRYINDEX, MSyntax::kUnsigned);
+
+    syntax.addFlag(SFLAG_POSENAMES, LFLAG_POSENAMES);
+    syntax.addFlag(SFLAG_POSEINDICES, LFLAG_POSEINDICES);
+    syntax.addFlag(SFLAG_POSEWEIGHTS, LFLAG_POSEWEIGHTS);
+    syntax.addFlag(SFLAG_POSEINDEX, LFLAG_POSEINDEX, MSyntax::kString);
+    syntax.makeFlagQueryWithFullArgs(LFLAG_POSEINDEX, false);
+    syntax.addFlag(SFLAG_POSEJOINTS, LFLAG_POSEJOINTS, MSyntax::kUnsigned);
+    syntax.makeFlagQueryWithFullArgs(LFLAG_POSEJOINTS, false);
+    syntax.addFlag(SFLAG_POSETARGETNAMES, LFLAG_POSETARGETNAMES, MSyntax::kUnsigned);
+    syntax.makeFlagQueryWithFullArgs(LFLAG_POSETARGETNAMES, false);
+    syntax.addFlag(SFLAG_POSETARGETINDICES, LFLAG_POSETARGETINDICES, MSyntax::kUnsigned);
+    syntax.makeFlagQueryWithFullArgs(LFLAG_POSETARGETINDICES, false);
+    syntax.addFlag(SFLAG_POSETARGETINDEX, LFLAG_POSETARGETINDEX, MSyntax::kUnsigned, MSyntax::kString);
+    syntax.makeFlagQueryWithFullArgs(LFLAG_POSETARGETINDEX, false);
+    syntax.addFlag(SFLAG_JOINTINDICES, LFLAG_JOINTINDICES);
+    syntax.addFlag(SFLAG_JOINTNAMES, LFLAG_JOINTNAMES);
+
+    syntax.enableQuery(true);
     syntax.setObjectType(MSyntax::kSelectionList);
 
     return syntax;
@@ -125,6 +325,53 @@ MStatus PoseSpaceCommand::parseArgs( const MArgList& args )
     _poseIndex = -1;
     _targetIndex = -1;
     _updateTarget = false;
+    _geomIndex = 0;
+    _query = false;
+
+    if (argDB.isFlagSet(LFLAG_GEOMETRYINDEX))
+    {
+        stat = argDB.getFlagArgument(LFLAG_GEOMETRYINDEX, 0, _geomIndex);
+        MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+    }
+
+    // Queries
+    if (argDB.isQuery())
+    {
+        const char* queryFlags[] = {    LFLAG_POSENAMES, LFLAG_POSEINDICES, LFLAG_POSEWEIGHTS, LFLAG_POSEINDEX, 
+                                        LFLAG_POSEJOINTS, LFLAG_POSETARGETNAMES, LFLAG_POSETARGETINDICES, 
+                                        LFLAG_POSETARGETINDEX, LFLAG_JOINTINDICES, LFLAG_JOINTNAMES, 
+                                        LFLAG_THREADCAP };
+
+        for( unsigned i=0; i < sizeof(queryFlags) / sizeof(queryFlags[0]); ++i )
+            if (argDB.isFlagSet(queryFlags[i]))
+            {
+                _operation = queryFlags[i];
+                _query = true;
+                break;
+            }
+
+        if (_operation == LFLAG_POSEINDEX)
+        {
+            stat = argDB.getFlagArgument(LFLAG_POSEINDEX, 0, _name);
+            MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+        }
+        else if (_operation == LFLAG_POSEJOINTS ||
+                 _operation == LFLAG_POSETARGETNAMES ||
+                 _operation == LFLAG_POSETARGETINDICES ||
+                 _operation == LFLAG_POSETARGETINDEX)
+        {
+            stat = argDB.getFlagArgument(_operation.asChar(), 0, _poseIndex);
+            MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+
+            if (_operation == LFLAG_POSETARGETINDEX)
+            {
+                stat = argDB.getFlagArgument(LFLAG_POSETARGETINDEX, 1, _name);
+                MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+            }
+        }
+
+        return MS::kSuccess;
+    }
 
     if (argDB.isFlagSet(LFLAG_SETPOSETARGET))
     {
@@ -141,6 +388,94 @@ MStatus PoseSpaceCommand::parseArgs( const MArgList& args )
         stat = argDB.getFlagArgument(LFLAG_UPDATEPOSETARGET, 0, _poseIndex);
         stat = argDB.getFlagArgument(LFLAG_UPDATEPOSETARGET, 1, _targetIndex);
     }
+    else if (argDB.isFlagSet(LFLAG_BATCHSETPOSETARGET))
+    {
+        _operation = LFLAG_BATCHSETPOSETARGET;
+
+        _batchPoseIndices.clear();
+        _batchTargetIndices.clear();
+        _batchMeshes.clear();
+
+        unsigned numUses = argDB.numberOfFlagUses(LFLAG_BATCHSETPOSETARGET);
+        for( unsigned i=0; i < numUses; ++i )
+        {
+            MArgList argList;
+            stat = argDB.getFlagArgumentList(LFLAG_BATCHSETPOSETARGET, i, argList);
+            MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+
+            _batchPoseIndices.push_back(argList.asInt(0, &stat));
+            MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+            _batchTargetIndices.push_back(argList.asInt(1, &stat));
+            MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+            _batchMeshes.append(argList.asString(2, &stat));
+            MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+        }
+
+        // Each target is edited from its state before the batch, so undo can
+        // only restore targets that appear once
+        std::set< std::pair<int, int> > batchTargets;
+        for( unsigned i=0; i < _batchPoseIndices.size(); ++i )
+        {
+            if (!batchTargets.insert(std::make_pair(_batchPoseIndices[i], _batchTargetIndices[i])).second)
+            {
+                char buf[1024];
+                SPRINTF(buf, ErrorStr::PSDDuplicateBatchTarget, _batchPoseIndices[i], _batchTargetIndices[i]);
+                MReturnFailure(buf);
+            }
+        }
+    }
+    else if (argDB.isFlagSet(LFLAG_COMMITSCULPT))
+    {
+        _operation = LFLAG_COMMITSCULPT;
+    }
+    else if (argDB.isFlagSet(LFLAG_PRUNETARGETS))
+    {
+        _operation = LFLAG_PRUNETARGETS;
+
+        stat = argDB.getFlagArgument(LFLAG_PRUNETARGETS, 0, _pruneThreshold);
+        MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+
+        _mergeTolerance = -1;
+        if (argDB.isFlagSet(LFLAG_MERGETOLERANCE))
+        {
+            stat = argDB.getFlagArgument(LFLAG_MERGETOLERANCE, 0, _mergeTolerance);
+            MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+
+            if (_mergeTolerance < 0)
+                MReturnFailure(ErrorStr::PSDInvalidPruneThreshold);
+        }
+
+        if (_pruneThreshold < 0)
+            MReturnFailure(ErrorStr::PSDInvalidPruneThreshold);
+    }
+    else if (argDB.isFlagSet(LFLAG_UPDATEPOSEJOINTS))
+    {
+        _operation = LFLAG_UPDATEPOSEJOINTS;
+
+        stat = argDB.getFlagArgument(LFLAG_UPDATEPOSEJOINTS, 0, _poseIndex);
+        MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+    }
+    else if (argDB.isFlagSet(LFLAG_THREADCAP))
+    {
+        _operation = LFLAG_THREADCAP;
+
+        stat = argDB.getFlagArgument(LFLAG_THREADCAP, 0, _threadCap);
+        MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+    }
+    else if (argDB.isFlagSet(LFLAG_EXPORTPOSELIBRARY))
+    {
+        _operation = LFLAG_EXPORTPOSELIBRARY;
+
+        stat = argDB.getFlagArgument(LFLAG_EXPORTPOSELIBRARY, 0, _file);
+        MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+    }
+    else if (argDB.isFlagSet(LFLAG_IMPORTPOSELIBRARY))
+    {
+        _operation = LFLAG_IMPORTPOSELIBRARY;
+
+        stat = argDB.getFlagArgument(LFLAG_IMPORTPOSELIBRARY, 0, _file);
+        MCheckStatus(stat, ErrorStr::FailedToParseArgs);
+    }
 
     return MS::kSuccess;
 }
@@ -150,17 +485,107 @@ MStatus PoseSpaceCommand::doIt( const MArgList& args )
     MStatus stat;
     MString msg;
 
+    _edits.clear();
+    _dgModified = false;
+
     stat = parseArgs(args);
     MCheckStatus(stat, "");
 
-    if (_operation == LFLAG_SETPOSETARGET)
+    ProfileScope scope(PluginNames::PoseSpaceCommand);
+
+    if (_query)
+    {
+        stat = query();
+    }
+    else if (_operation == LFLAG_SETPOSETARGET)
     {
+        ProfileScope scope(LFLAG_SETPOSETARGET);
         stat = setPoseTarget();
     }
+    else if (_operation == LFLAG_UPDATEPOSEJOINTS)
+    {
+        ProfileScope scope(LFLAG_UPDATEPOSEJOINTS);
+        stat = updatePoseJoints();
+    }
+    else if (_operation == LFLAG_BATCHSETPOSETARGET)
+    {
+        ProfileScope scope(LFLAG_BATCHSETPOSETARGET);
+        stat = batchSetPoseTarget();
+    }
+    else if (_operation == LFLAG_EXPORTPOSELIBRARY)
+    {
+        ProfileScope scope(LFLAG_EXPORTPOSELIBRARY);
+        stat = exportPoseLibrary();
+    }
+    else if (_operation == LFLAG_IMPORTPOSELIBRARY)
+    {
+        ProfileScope scope(LFLAG_IMPORTPOSELIBRARY);
+        stat = importPoseLibrary();
+    }
+    else if (_operation == LFLAG_COMMITSCULPT)
+    {
+        ProfileScope scope(LFLAG_COMMITSCULPT);
+        stat = commitSculpt();
+    }
+    else if (_operation == LFLAG_PRUNETARGETS)
+    {
+        ProfileScope scope(LFLAG_PRUNETARGETS);
+        stat = pruneTargets();
+    }
+    else if (_operation == LFLAG_THREADCAP)
+    {
+        // Plugin wide, no deformer needed
+        ThreadPool::setThreadCap(_threadCap);
+    }
 
     return stat;
 }
 
+// Target edits are undoable, set/update/batchSet of pose targets, and the
+// plug values set through _dgMod
+bool PoseSpaceCommand::isUndoable() const
+{
+    return !_edits.empty() || _dgModified;
+}
+
+MStatus PoseSpaceCommand::redoIt()
+{
+    MStatus stat;
+
+    for( unsigned i=0; i < _edits.size(); ++i )
+    {
+        stat = applyTargetEdit(_edits[i], false);
+        MCheckStatus(stat, "");
+    }
+
+    if (_dgModified)
+    {
+        stat = _dgMod.doIt();
+        MCheckStatus(stat, "");
+    }
+
+    return MS::kSuccess;
+}
+
+MStatus PoseSpaceCommand::undoIt()
+{
+    MStatus stat;
+
+    if (_dgModified)
+    {
+        stat = _dgMod.undoIt();
+        MCheckStatus(stat, "");
+    }
+
+    for( int i=(int)_edits.size()-1; i >= 0; --i )
+    {
+        stat = applyTargetEdit(_edits[i], true);
+        MCheckStatus(stat, "");
+    }
+
+    return MS::kSuccess;
+}
+
 // Get mesh name from selection list
 MStatus PoseSpaceCommand::getMeshFromSelList(MObject& obj)
 {
@@ -219,28 +644,15 @@ MStatus PoseSpaceCommand::getDeformerFromSelList(MObject& obj)
 }
 
 
-MStatus PoseSpaceCommand::setPoseTarget()
+// Get plug of an existing pose
+MStatus PoseSpaceCommand::getPosePlug( MFnDependencyNode& fnDeformer, int poseIndex, MPlug& pPose )
 {
-    MStatus stat;
-    MString msg;
-    MObject obj;
-
-
-    // Get deformer
-    stat = getDeformerFromSelList(obj);
-    MCheckStatus(stat, "");
-    MFnGeometryFilter fnDeformer(obj);
-
-
-
-
-    // Get pose and poseTarget
-    MPlug pPose = fnDeformer.findPlug(PoseSpaceDeformer::aPose);
+    pPose = fnDeformer.findPlug(PoseSpaceDeformer::aPose);
     {        
         // Check if given poseIndex exists
         bool found = false;
         for( unsigned i=0; i < pPose.numElements(); ++i )
-            if (_poseIndex == pPose[i].logicalIndex())
+            if (poseIndex == pPose[i].logicalIndex())
             {
                 found = true;
                 break;
@@ -248,26 +660,40 @@ MStatus PoseSpaceCommand::setPoseTarget()
         if (found == false)
         {
             char buf[1024];
-            SPRINTF(buf, ErrorStr::PSDInvalidPoseIndex, _poseIndex);
+            SPRINTF(buf, ErrorStr::PSDInvalidPoseIndex, poseIndex);
             MReturnFailure(buf);
         }
     }
-    pPose = pPose.elementByLogicalIndex(_poseIndex);
+    pPose = pPose.elementByLogicalIndex(poseIndex);
+
+    return MS::kSuccess;
+}
+
+
+// Get poseTarget plug of the given pose. A new target index is picked when
+// targetIndex is -1, otherwise the target must already exist
+MStatus PoseSpaceCommand::getPoseTargetPlug( MFnDependencyNode& fnDeformer, int poseIndex, int& targetIndex, MPlug& pPoseTarget )
+{
+    MStatus stat;
+
+    MPlug pPose;
+    stat = getPosePlug(fnDeformer, poseIndex, pPose);
+    MCheckStatus(stat, "");
 
     // Get next pose target index
-    MPlug pPoseTarget = pPose.child(PoseSpaceDeformer::aPoseTarget);
-    if ( _targetIndex == -1 )
+    pPoseTarget = pPose.child(PoseSpaceDeformer::aPoseTarget);
+    if ( targetIndex == -1 )
     {
-        _targetIndex = 0;
+        targetIndex = 0;
         if (pPoseTarget.numElements())
-            _targetIndex = pPoseTarget[pPoseTarget.numElements()-1].logicalIndex() + 1;
+            targetIndex = pPoseTarget[pPoseTarget.numElements()-1].logicalIndex() + 1;
     }
     else
     {        
         // Check if given targetIndex exists
         bool found = false;
         for( unsigned i=0; i < pPoseTarget.numElements(); ++i )
-            if (_targetIndex == pPoseTarget[i].logicalIndex())
+            if (targetIndex == pPoseTarget[i].logicalIndex())
             {
                 found = true;
                 break;
@@ -275,24 +701,49 @@ MStatus PoseSpaceCommand::setPoseTarget()
         if (found == false)
         {
             char buf[1024];
-            SPRINTF(buf, ErrorStr::PSDInvalidTargetIndex, _targetIndex);
+            SPRINTF(buf, ErrorStr::PSDInvalidTargetIndex, targetIndex);
             MReturnFailure(buf);
         }
     }
-    pPoseTarget = pPoseTarget.elementByLogicalIndex(_targetIndex);
+    pPoseTarget = pPoseTarget.elementByLogicalIndex(targetIndex);
+
+    return MS::kSuccess;
+}
+
+
+MStatus PoseSpaceCommand::setPoseTarget()
+{
+    MStatus stat;
+    MString msg;
+    MObject obj;
+
+
+    // Get deformer
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnGeometryFilter fnDeformer(obj);
+
 
-    // Set pose components and delta
+
+
+    // Get pose and poseTarget
+    MPlug pPoseTarget;
+    stat = getPoseTargetPlug(fnDeformer, _poseIndex, _targetIndex, pPoseTarget);
+    MCheckStatus(stat, "");
+
+    // Set pose components and delta of the geometry
     MPlug pPoseComp = pPoseTarget.child(PoseSpaceDeformer::aPoseTargetComponents);
+    pPoseComp = pPoseComp.elementByLogicalIndex(_geomIndex);
     MPlug pPoseDelta = pPoseTarget.child(PoseSpaceDeformer::aPoseTargetDelta);
+    pPoseDelta = pPoseDelta.elementByLogicalIndex(_geomIndex);
 
 
 
 
     // Get output mesh from deformer
     MDagPath srcPath;
-    fnDeformer.getPathAtIndex(0, srcPath);
-    obj = fnDeformer.outputShapeAtIndex(0);
-    MFnMesh fnSrcMesh(obj);
+    stat = fnDeformer.getPathAtIndex(_geomIndex, srcPath);
+    MCheckStatus(stat, ErrorStr::PSDInvalidGeomIndex);
 
 
     // Get pose/target mesh from selection list
@@ -301,161 +752,1282 @@ MStatus PoseSpaceCommand::setPoseTarget()
     MFnMesh fnTgtMesh(obj);
 
 
+    // Get skinCluster weights, joint matrices and source positions
+    SkinData skinData;
+    stat = getSkinData(fnDeformer, srcPath, skinData);
+    MCheckStatus(stat, "");
+
+
+    // Get vertices that differ from src and target mesh
+    MPointArray tgtPositions;
+    fnTgtMesh.getPoints(tgtPositions);
 
-    // Get skinCluster weightsPlug and joint matrices
-    MPlug scWtsPlug;
-    JointMatrixMap jtMatrices;
+    if ( skinData.positions.length() != tgtPositions.length() )
     {
-        // Get skinCluster
-        MFnSkinCluster fnSkinCluster;
-        {
-            MPlug plug = fnDeformer.findPlug("input");
-            plug = plug[0];
-            plug = plug.child(0);
-
-            MItDependencyGraph iter(
-                plug,
-                MFn::kSkinClusterFilter,
-                MItDependencyGraph::kUpstream,
-                MItDependencyGraph::kDepthFirst,
-                MItDependencyGraph::kNodeLevel,
-                &stat);
-            MCheckStatus(stat, ErrorStr::PSDSCNotFound);
-
-            if (iter.isDone())
-                MReturnFailure(ErrorStr::PSDSCNotFound);
-
-            stat = fnSkinCluster.setObject(iter.currentItem());
-            MCheckStatus(stat, ErrorStr::PSDSCNotFound);
-#if 0
-            MPlug plug = fnDeformer.findPlug(PoseSpaceDeformer::aSkinClusterWeightList);
-            MPlugArray plugArr;
-            plug.connectedTo(plugArr, 1, 0);
-            obj = plugArr[0].node();
-            fnSkinCluster.setObject(obj);
-#endif
-        }
-        
-        scWtsPlug = fnSkinCluster.findPlug("weightList");
-        MPlug bindPlug = fnSkinCluster.findPlug("bindPreMatrix");
-        MPlug jtMatPlug = fnSkinCluster.findPlug("matrix");
-        MMatrix srcGeomWorldMat = srcPath.inclusiveMatrix();
+        MReturnFailure(ErrorStr::PSDInvalidPoseTarget);
+    }
 
-        MFnMatrixData fnMatrix;
 
-        for( unsigned i=0; i < jtMatPlug.numElements(); ++i )
-        {
-            if ( jtMatPlug[i].logicalIndex() != bindPlug[i].logicalIndex() )
-            {
-                MReturnFailure("Matrix and bindPreMatrix plugs in skincluster doesnt match");
-            }
 
-            fnMatrix.setObject(bindPlug[i].asMObject());
-            MMatrix bindInvMat = fnMatrix.matrix();
+    // Get components with delta (in bind space)
+    std::vector<int> bindComponents;
+    std::vector<MVector> bindDeltas;
+    diffComponents(skinData, tgtPositions, bindComponents);
+    cacheSkinInverses(skinData, bindComponents);
+    calcBindDeltas(skinData, tgtPositions, bindComponents, bindDeltas);
+
 
-            fnMatrix.setObject(jtMatPlug[i].asMObject());
-            MMatrix jtMat = fnMatrix.matrix();
+    // Merge into the existing target, keeping only changed components for undo
+    TargetEdit edit;
+    edit.compPlug = pPoseComp;
+    edit.deltaPlug = pPoseDelta;
 
-            MMatrix scMat = srcGeomWorldMat * bindInvMat * jtMat * srcGeomWorldMat.inverse();
-            jtMatrices[jtMatPlug[i].logicalIndex()] = scMat;
-        }
+    unsigned numComponents = 0;
+    stat = makeTargetEdit(bindComponents, bindDeltas, _updateTarget, edit, numComponents);
+    MCheckStatus(stat, "");
+
+    if (numComponents == 0)
+    {
+        MReturnFailure(ErrorStr::PSDPoseTargetDoesntDiffer);
     }
 
+    _edits.push_back(edit);
 
+    stat = redoIt();
+    MCheckStatus(stat, "");
 
-    // Get vertices that differ from src and target mesh
-    MPointArray srcPositions;
-    MPointArray tgtPositions;
 
-    fnSrcMesh.getPoints(srcPositions);
-    fnTgtMesh.getPoints(tgtPositions);
+    setResult(_targetIndex);
+
+    return MS::kSuccess;
+}
+
+
+// Read the skinCluster of a deformed geometry in bulk: joint matrices densely
+// indexed by influence, all weights in one getWeights call packed as CSR, and
+// the source positions
+MStatus PoseSpaceCommand::getSkinData( MFnGeometryFilter& fnDeformer, const MDagPath& srcPath, SkinData& skinData )
+{
+    MStatus stat;
 
-    if ( srcPositions.length() != tgtPositions.length() )
+    ProfileScope scope("getSkinData");
+
+    // Get skinCluster
+    MFnSkinCluster fnSkinCluster;
     {
-        MReturnFailure(ErrorStr::PSDInvalidPoseTarget);
+        MPlug plug = fnDeformer.findPlug("input");
+        plug = plug.elementByLogicalIndex(_geomIndex);
+        plug = plug.child(0);
+
+        MItDependencyGraph iter(
+            plug,
+            MFn::kSkinClusterFilter,
+            MItDependencyGraph::kUpstream,
+            MItDependencyGraph::kDepthFirst,
+            MItDependencyGraph::kNodeLevel,
+            &stat);
+        MCheckStatus(stat, ErrorStr::PSDSCNotFound);
+
+        if (iter.isDone())
+            MReturnFailure(ErrorStr::PSDSCNotFound);
+
+        stat = fnSkinCluster.setObject(iter.currentItem());
+        MCheckStatus(stat, ErrorStr::PSDSCNotFound);
     }
 
 
+    // Joint matrices (bind to skin space) of each influence
+    MDagPathArray influences;
+    unsigned numInfluences = fnSkinCluster.influenceObjects(influences, &stat);
+    MCheckStatus(stat, ErrorStr::PSDSCNotFound);
 
-    // Get existing delta, if we want to updateTarget
-    std::map<int, MVector> deltaMap;
-    if (_updateTarget)
+    MPlug bindPlug = fnSkinCluster.findPlug("bindPreMatrix");
+    MPlug jtMatPlug = fnSkinCluster.findPlug("matrix");
+    MMatrix srcGeomWorldMat = srcPath.inclusiveMatrix();
+    MMatrix srcGeomWorldInvMat = srcGeomWorldMat.inverse();
+
+    MFnMatrixData fnMatrix;
+    skinData.jointMatrices.resize(numInfluences);
+    for( unsigned i=0; i < numInfluences; ++i )
     {
-        pPoseComp.getValue(obj);
-        MFnIntArrayData fnIntArrData(obj);
-        MIntArray components = fnIntArrData.array();
+        unsigned jtIdx = fnSkinCluster.indexForInfluenceObject(influences[i], &stat);
+        MCheckStatus(stat, ErrorStr::PSDSCMatrixMismatch);
 
-        pPoseDelta.getValue(obj);
-        MFnVectorArrayData fnVectorArrData(obj);
-        MVectorArray deltas = fnVectorArrData.array();
+        stat = fnMatrix.setObject(bindPlug.elementByLogicalIndex(jtIdx).asMObject());
+        MCheckStatus(stat, ErrorStr::PSDSCMatrixMismatch);
+        MMatrix bindInvMat = fnMatrix.matrix();
 
-        if ( components.length() != deltas.length() )
-        {
-            MReturnFailure(ErrorStr::PSDInvalidTargetDelta);
-        }
+        stat = fnMatrix.setObject(jtMatPlug.elementByLogicalIndex(jtIdx).asMObject());
+        MCheckStatus(stat, ErrorStr::PSDSCMatrixMismatch);
+        MMatrix jtMat = fnMatrix.matrix();
 
-        for(unsigned i=0; i < components.length(); ++i)
-            deltaMap[components[i]] = deltas[i];
+        MMatrix scMat = srcGeomWorldMat * bindInvMat * jtMat * srcGeomWorldInvMat;
+        for( unsigned r=0; r < 3; ++r )
+            for( unsigned c=0; c < 3; ++c )
+                skinData.jointMatrices[i](r, c) = scMat(r, c);
     }
 
 
-    // Get components with delta (in bind space)
-    for( unsigned i=0; i < srcPositions.length(); ++i )
-    {
-        // Delta in skin space
-        MVector delta = tgtPositions[i] - srcPositions[i];
+    // Source positions
+    MFnMesh fnSrcMesh(srcPath);
+    stat = fnSrcMesh.getPoints(skinData.positions);
+    MCheckStatus(stat, "");
+    unsigned numVertices = skinData.positions.length();
+
+
+    // All weights in one call, influence-major per vertex
+    MFnSingleIndexedComponent fnComponent;
+    MObject components = fnComponent.create(MFn::kMeshVertComponent);
+    fnComponent.setCompleteData(numVertices);
+
+    MDoubleArray weights;
+    unsigned influenceCount = 0;
+    stat = fnSkinCluster.getWeights(srcPath, components, weights, influenceCount);
+    MCheckStatus(stat, ErrorStr::PSDSCNotFound);
+
+    if (influenceCount != numInfluences || weights.length() != numVertices * influenceCount)
+        MReturnFailure(ErrorStr::PSDSCMatrixMismatch);
+
+    // Pack to CSR, dropping zero weights
+    skinData.weightOffsets.resize(numVertices + 1);
+    skinData.weightInfluences.clear();
+    skinData.weightValues.clear();
+    for( unsigned v=0; v < numVertices; ++v )
+    {
+        skinData.weightOffsets[v] = (unsigned)skinData.weightValues.size();
+
+        for( unsigned j=0; j < influenceCount; ++j )
+        {
+            double wt = weights[v * influenceCount + j];
+            if (wt == 0)
+                continue;
+
+            skinData.weightInfluences.push_back(j);
+            skinData.weightValues.push_back(wt);
+        }
+    }
+    skinData.weightOffsets[numVertices] = (unsigned)skinData.weightValues.size();
+
+
+    // Inverses cached on the deformer stay valid until joint matrices or weights change
+    uint64_t key = hashBytes(&numVertices, sizeof(numVertices));
+    for( unsigned i=0; i < numInfluences; ++i )
+        key = hashBytes(skinData.jointMatrices[i].data(), 9 * sizeof(double), key);
+    key = hashBytes(&skinData.weightOffsets[0], skinData.weightOffsets.size() * sizeof(unsigned), key);
+    if (!skinData.weightValues.empty())
+    {
+        key = hashBytes(&skinData.weightInfluences[0], skinData.weightInfluences.size() * sizeof(unsigned), key);
+        key = hashBytes(&skinData.weightValues[0], skinData.weightValues.size() * sizeof(double), key);
+    }
+
+    PoseSpaceDeformer* psd = (PoseSpaceDeformer*)fnDeformer.userNode();
+    skinData.inverses = &psd->skinInverseCache(_geomIndex);
+    skinData.inverses->reset(key, numVertices);
+
+    skinData.worldMatrix = srcGeomWorldMat;
+    skinData.pruneThreshold = fnDeformer.findPlug(PoseSpaceDeformer::aPruneThreshold).asDouble();
+
+    return MS::kSuccess;
+}
+
+
+// Vertices that differ between source and target, by more than the
+// deformer's pruneThreshold in world space if set
+void PoseSpaceCommand::diffComponents(  const SkinData&         skinData, 
+                                        const MPointArray&      tgtPositions, 
+                                        std::vector<int>&       components )
+{
+    const MPointArray& srcPositions = skinData.positions;
+
+    components.clear();
+    for( unsigned i=0; i < srcPositions.length(); ++i )
+    {
+        MVector delta = tgtPositions[i] - srcPositions[i];
         if ( delta.length() < FLOAT_TOLERANCE )
             continue;
 
-        // Find skinMatrix
-        MMatrix skinMatrix;        
-        MPlug wtsPlug = scWtsPlug[i].child(0);
-        for( unsigned j=0; j < wtsPlug.numElements(); ++j )
+        if ( skinData.pruneThreshold > 0 && (delta * skinData.worldMatrix).length() < skinData.pruneThreshold )
+            continue;
+
+        components.push_back(i);
+    }
+}
+
+
+// Drop bind space deltas shorter than threshold, measured through the
+// geometry's world matrix
+void PoseSpaceCommand::pruneDeltas( const MMatrix&          worldMatrix, 
+                                    double                  threshold, 
+                                    std::vector<int>&       components, 
+                                    std::vector<MVector>&   deltas )
+{
+    unsigned numKept = 0;
+    for( unsigned i=0; i < components.size(); ++i )
+    {
+        if ( deltas[i].length() < FLOAT_TOLERANCE || (deltas[i] * worldMatrix).length() < threshold )
+            continue;
+
+        components[numKept] = components[i];
+        deltas[numKept] = deltas[i];
+        ++numKept;
+    }
+
+    components.resize(numKept);
+    deltas.resize(numKept);
+}
+
+
+// Blend and invert skin matrices (3x3) of components that arent cached yet, in
+// parallel. Targets authored later at the same pose reuse them
+void PoseSpaceCommand::cacheSkinInverses(   const SkinData&         skinData, 
+                                            const std::vector<int>& components )
+{
+    SkinInverseCache& inverses = *skinData.inverses;
+
+    std::vector<int> missing;
+    for( unsigned i=0; i < components.size(); ++i )
+    {
+        if (!inverses.has(components[i]))
+            missing.push_back(components[i]);
+    }
+
+    const int numMissing = (int)missing.size();
+
+    ThreadPool::parallelFor(0, numMissing, [&](int begin, int end)
+    {
+        for( int i=begin; i < end; ++i )
         {
-            int jtIdx = wtsPlug[j].logicalIndex();
-            MMatrix mat = wtsPlug[j].asDouble() * jtMatrices[jtIdx];
+            int c = missing[i];
 
-            if (j)
-                skinMatrix += mat;
-            else
-                skinMatrix = mat;
+            // Skin matrix, weighted sum of joint matrices
+            Matrix3d skinMatrix = Matrix3d::Zero();
+            for( unsigned w=skinData.weightOffsets[c]; w < skinData.weightOffsets[c+1]; ++w )
+                skinMatrix += skinData.weightValues[w] * skinData.jointMatrices[skinData.weightInfluences[w]];
+
+            Matrix<double, 3, 3, RowMajor> skinInvMatrix;
+            bool invertible = false;
+            skinMatrix.computeInverseWithCheck(skinInvMatrix, invertible);
+
+            inverses.set(c, invertible ? skinInvMatrix.data() : 0);
+        }
+    });
+}
+
+
+// Skin space delta (target - source) of components converted to bind space
+// with the cached inverses, a matrix-vector product per component
+void PoseSpaceCommand::calcBindDeltas(  const SkinData&         skinData, 
+                                        const MPointArray&      tgtPositions, 
+                                        const std::vector<int>& components, 
+                                        std::vector<MVector>&   deltas )
+{
+    const MPointArray& srcPositions = skinData.positions;
+    const SkinInverseCache& inverses = *skinData.inverses;
+
+    deltas.resize(components.size());
+
+    const int numComponents = (int)components.size();
+
+    ThreadPool::parallelFor(0, numComponents, [&](int begin, int end)
+    {
+        for( int i=begin; i < end; ++i )
+        {
+            int c = components[i];
+
+            MVector delta = tgtPositions[c] - srcPositions[c];
+
+            // Row vector times inverse, singular skin matrices keep the skin delta
+            const double* m = inverses.inverse(c);
+            if (m)
+                delta = MVector(    delta.x * m[0] + delta.y * m[3] + delta.z * m[6],
+                                    delta.x * m[1] + delta.y * m[4] + delta.z * m[7],
+                                    delta.x * m[2] + delta.y * m[5] + delta.z * m[8] );
+
+            deltas[i] = delta;
         }
+    });
+}
+
+
+// Add the deformer's live sculpt layer, already in bind space, to the
+// sculpted target and start a fresh layer
+MStatus PoseSpaceCommand::commitSculpt()
+{
+    MStatus stat;
+    MObject obj;
+
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnGeometryFilter fnDeformer(obj);
+    PoseSpaceDeformer* psd = (PoseSpaceDeformer*)fnDeformer.userNode();
+
+    MPlug pSculptPose = fnDeformer.findPlug(PoseSpaceDeformer::aSculptPose);
+    MPlug pSculptTarget = fnDeformer.findPlug(PoseSpaceDeformer::aSculptTarget);
+    MPlug pSculptGeom = fnDeformer.findPlug(PoseSpaceDeformer::aSculptGeometry);
+
+    _poseIndex = pSculptPose.asInt();
+    _targetIndex = pSculptTarget.asInt();
+    _geomIndex = (unsigned)pSculptGeom.asInt();
+    if (_poseIndex < 0)
+    {
+        MReturnFailure(ErrorStr::PSDNotSculpting);
+    }
+
+    // Pull the sculpted geometry so the latest strokes are in bind space
+    MPlug pOutputGeom = fnDeformer.findPlug("outputGeom");
+    pOutputGeom.elementByLogicalIndex(_geomIndex).asMObject();
+
+    std::vector<int> components;
+    std::vector<MVector> deltas;
+    if (!psd->sculptLayer(components, deltas))
+    {
+        MReturnFailure(ErrorStr::PSDSculptNotEvaluated);
+    }
 
-        // Convert delta from skin to bind space
-        delta = delta * skinMatrix.inverse();
+    double pruneThreshold = fnDeformer.findPlug(PoseSpaceDeformer::aPruneThreshold).asDouble();
+    if (pruneThreshold > 0)
+    {
+        MDagPath geomPath;
+        stat = fnDeformer.getPathAtIndex(_geomIndex, geomPath);
+        MCheckStatus(stat, ErrorStr::PSDInvalidGeomIndex);
 
-        deltaMap[i] = deltaMap[i] + delta;
+        pruneDeltas(geomPath.inclusiveMatrix(), pruneThreshold, components, deltas);
     }
 
-    if (deltaMap.size() == 0)
+    if (components.empty())
     {
         MReturnFailure(ErrorStr::PSDPoseTargetDoesntDiffer);
     }
 
+    MPlug pPoseTarget;
+    stat = getPoseTargetPlug(fnDeformer, _poseIndex, _targetIndex, pPoseTarget);
+    MCheckStatus(stat, "");
 
-    // Copy components/delta onto plug
-    MIntArray components;
-    MVectorArray deltas;
-    std::map<int,MVector>::const_iterator iter;
-    for(iter=deltaMap.begin(); iter != deltaMap.end(); ++iter)
+    TargetEdit edit;
+    edit.compPlug = pPoseTarget.child(PoseSpaceDeformer::aPoseTargetComponents).elementByLogicalIndex(_geomIndex);
+    edit.deltaPlug = pPoseTarget.child(PoseSpaceDeformer::aPoseTargetDelta).elementByLogicalIndex(_geomIndex);
+
+    unsigned numComponents = 0;
+    stat = makeTargetEdit(components, deltas, true, edit, numComponents);
+    MCheckStatus(stat, "");
+
+    if (numComponents == 0)
     {
-        components.append(iter->first);
-        deltas.append(iter->second);
+        MReturnFailure(ErrorStr::PSDPoseTargetDoesntDiffer);
     }
 
+    _edits.push_back(edit);
 
+    // Strokes are in the target now, keep sculpting on an empty layer. Reset
+    // through the modifier so undo brings the strokes back with the target
     MFnIntArrayData fnIntArrData;
-    obj = fnIntArrData.create();
-    fnIntArrData.set(components);
-    pPoseComp.setValue(obj);
-
+    MObject compObj = fnIntArrData.create();
     MFnVectorArrayData fnVectorArrData;
-    obj = fnVectorArrData.create();
-    fnVectorArrData.set(deltas);
-    pPoseDelta.setValue(obj);
+    MObject deltaObj = fnVectorArrData.create();
 
+    _dgMod.newPlugValueInt(pSculptTarget, _targetIndex);
+    _dgMod.newPlugValue(fnDeformer.findPlug(PoseSpaceDeformer::aSculptComponents), compObj);
+    _dgMod.newPlugValue(fnDeformer.findPlug(PoseSpaceDeformer::aSculptDelta), deltaObj);
+    _dgModified = true;
+
+    stat = redoIt();
+    MCheckStatus(stat, "");
 
     setResult(_targetIndex);
 
     return MS::kSuccess;
 }
+
+// Prune deltas of every target on every geometry and optionally merge targets
+// of a pose that are near identical on a geometry, the first one takes the sum
+// and the others are emptied. Undoable, reports savings per target
+MStatus PoseSpaceCommand::pruneTargets()
+{
+    MStatus stat;
+    MObject obj;
+    char buf[1024];
+
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnGeometryFilter fnDeformer(obj);
+
+    const double componentKB = (sizeof(int) + 3 * sizeof(double)) / 1024.0;
+
+    // Target of one geometry, pruned but not edited yet
+    class Pruned
+    {
+    public:
+        MString                 name;
+        TargetEdit              edit;
+        float                   envelope;
+        unsigned                numBefore;
+        std::vector<int>        components;
+        std::vector<MVector>    deltas;
+        bool                    merged;
+    };
+
+    std::map<unsigned, MMatrix> worldMatrices;
+    MStringArray report;
+    unsigned totalBefore = 0, totalAfter = 0;
+
+    MPlug pPoseArray = fnDeformer.findPlug(PoseSpaceDeformer::aPose);
+    for( unsigned p=0; p < pPoseArray.numElements(); ++p )
+    {
+        MPlug pPose = pPoseArray.elementByPhysicalIndex(p);
+        MPlug pTargetArray = pPose.child(PoseSpaceDeformer::aPoseTarget);
+
+        // Targets of the pose by geometry
+        std::map<unsigned, std::vector<Pruned> > geomTargets;
+        for( unsigned t=0; t < pTargetArray.numElements(); ++t )
+        {
+            MPlug pTarget = pTargetArray.elementByPhysicalIndex(t);
+            MPlug pCompArray = pTarget.child(PoseSpaceDeformer::aPoseTargetComponents);
+            MPlug pDeltaArray = pTarget.child(PoseSpaceDeformer::aPoseTargetDelta);
+
+            for( unsigned g=0; g < pCompArray.numElements(); ++g )
+            {
+                MPlug pComp = pCompArray.elementByPhysicalIndex(g);
+                unsigned geomIndex = pComp.logicalIndex();
+
+                if (worldMatrices.find(geomIndex) == worldMatrices.end())
+                {
+                    MDagPath geomPath;
+                    if (fnDeformer.getPathAtIndex(geomIndex, geomPath) == MS::kSuccess)
+                        worldMatrices[geomIndex] = geomPath.inclusiveMatrix();
+                    else
+                        worldMatrices[geomIndex] = MMatrix::identity;
+                }
+
+                Pruned pruned;
+                SPRINTF(buf, "pose[%d].poseTarget[%d] %s, geometry %d", pPose.logicalIndex(), pTarget.logicalIndex(),
+                        pTarget.child(PoseSpaceDeformer::aPoseTargetName).asString().asChar(), geomIndex);
+                pruned.name = buf;
+                pruned.edit.compPlug = pComp;
+                pruned.edit.deltaPlug = pDeltaArray.elementByLogicalIndex(geomIndex);
+                pruned.envelope = pTarget.child(PoseSpaceDeformer::aPoseTargetEnvelope).asFloat();
+                pruned.merged = false;
+
+                stat = getTargetDeltas(pruned.edit, pruned.components, pruned.deltas);
+                MCheckStatus(stat, "");
+
+                pruned.numBefore = (unsigned)pruned.components.size();
+                pruneDeltas(worldMatrices[geomIndex], _pruneThreshold, pruned.components, pruned.deltas);
+
+                geomTargets[geomIndex].push_back(pruned);
+            }
+        }
+
+        for( std::map<unsigned, std::vector<Pruned> >::iterator iter=geomTargets.begin(); iter != geomTargets.end(); ++iter )
+        {
+            std::vector<Pruned>& targets = iter->second;
+            const MMatrix& worldMatrix = worldMatrices[iter->first];
+
+            // Same envelope, deltas within tolerance in world space over the
+            // union of components, a component missing from a target has a
+            // zero delta there. Pruning may drop a component from one target
+            // only, so their components need not match
+            for( unsigned a=0; _mergeTolerance >= 0 && a < targets.size(); ++a )
+            {
+                if (targets[a].merged || targets[a].components.empty())
+                    continue;
+
+                const std::vector<int>& components = targets[a].components;
+                const std::vector<MVector>& deltas = targets[a].deltas;
+
+                std::vector<int> sumComponents = components;
+                std::vector<MVector> sumDeltas = deltas;
+                for( unsigned b=a+1; b < targets.size(); ++b )
+                {
+                    Pruned& other = targets[b];
+                    if (other.merged || other.envelope != targets[a].envelope)
+                        continue;
+
+                    bool similar = true;
+                    unsigned i = 0, j = 0;
+                    while ((i < components.size() || j < other.components.size()) && similar)
+                    {
+                        bool hasA = i < components.size() && (j == other.components.size() || components[i] <= other.components[j]);
+                        bool hasB = j < other.components.size() && (i == components.size() || other.components[j] <= components[i]);
+
+                        MVector delta = (hasA ? deltas[i] : MVector::zero) - (hasB ? other.deltas[j] : MVector::zero);
+                        similar = (delta * worldMatrix).length() <= _mergeTolerance;
+
+                        if (hasA) ++i;
+                        if (hasB) ++j;
+                    }
+                    if (!similar)
+                        continue;
+
+                    std::vector<int> mergedComponents;
+                    std::vector<MVector> mergedDeltas;
+                    mergedComponents.reserve(sumComponents.size() + other.components.size());
+                    mergedDeltas.reserve(sumComponents.size() + other.components.size());
+
+                    i = 0;
+                    j = 0;
+                    while (i < sumComponents.size() || j < other.components.size())
+                    {
+                        bool hasSum = i < sumComponents.size() && (j == other.components.size() || sumComponents[i] <= other.components[j]);
+                        bool hasB = j < other.components.size() && (i == sumComponents.size() || other.components[j] <= sumComponents[i]);
+
+                        mergedComponents.push_back(hasSum ? sumComponents[i] : other.components[j]);
+                        mergedDeltas.push_back((hasSum ? sumDeltas[i] : MVector::zero) + (hasB ? other.deltas[j] : MVector::zero));
+
+                        if (hasSum) ++i;
+                        if (hasB) ++j;
+                    }
+                    sumComponents.swap(mergedComponents);
+                    sumDeltas.swap(mergedDeltas);
+
+                    other.components.clear();
+                    other.deltas.clear();
+                    other.merged = true;
+
+                    report.append(other.name + " merged into " + targets[a].name);
+                }
+                targets[a].components.swap(sumComponents);
+                targets[a].deltas.swap(sumDeltas);
+            }
+
+            for( unsigned i=0; i < targets.size(); ++i )
+            {
+                Pruned& target = targets[i];
+
+                unsigned numComponents = 0;
+                stat = makeTargetEdit(target.components, target.deltas, false, target.edit, numComponents);
+                MCheckStatus(stat, "");
+
+                totalBefore += target.numBefore;
+                totalAfter += numComponents;
+
+                if (target.edit.components.empty())
+                    continue;
+                _edits.push_back(target.edit);
+
+                SPRINTF(buf, ": %d -> %d vertices, %.1f -> %.1f KB", target.numBefore, numComponents,
+                        target.numBefore * componentKB, numComponents * componentKB);
+                report.append(target.name + buf);
+            }
+        }
+    }
+
+    stat = redoIt();
+    MCheckStatus(stat, "");
+
+    SPRINTF(buf, "Pruned targets: %d -> %d vertices, %.1f -> %.1f KB", totalBefore, totalAfter,
+            totalBefore * componentKB, totalAfter * componentKB);
+    report.append(buf);
+
+    for( unsigned i=0; i < report.length(); ++i )
+        MGlobal::displayInfo(report[i]);
+
+    setResult(report);
+
+    return MS::kSuccess;
+}
+
+
+// Set components/delta of existing pose targets from several meshes at once.
+// Skin data of the deformed geometry is read once and deltas of all targets
+// are computed in parallel, plugs are then set serially
+MStatus PoseSpaceCommand::batchSetPoseTarget()
+{
+    MStatus stat;
+    MObject obj;
+
+
+    // Get deformer
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnGeometryFilter fnDeformer(obj);
+
+
+    // Get output mesh from deformer
+    MDagPath srcPath;
+    stat = fnDeformer.getPathAtIndex(_geomIndex, srcPath);
+    MCheckStatus(stat, ErrorStr::PSDInvalidGeomIndex);
+
+
+    // Validate all targets and read target positions before doing any work
+    const unsigned numTargets = _batchMeshes.length();
+
+    std::vector<MPlug> targetPlugs(numTargets);
+    std::vector<MPointArray> tgtPositions(numTargets);
+    for( unsigned i=0; i < numTargets; ++i )
+    {
+        if (_batchTargetIndices[i] < 0)
+        {
+            char buf[1024];
+            SPRINTF(buf, ErrorStr::PSDInvalidTargetIndex, _batchTargetIndices[i]);
+            MReturnFailure(buf);
+        }
+
+        stat = getPoseTargetPlug(fnDeformer, _batchPoseIndices[i], _batchTargetIndices[i], targetPlugs[i]);
+        MCheckStatus(stat, "");
+
+        MSelectionList selList;
+        stat = selList.add(_batchMeshes[i]);
+        MCheckStatus(stat, ErrorStr::PSDMeshNotSelected);
+
+        MDagPath tgtPath;
+        stat = selList.getDagPath(0, tgtPath);
+        MCheckStatus(stat, ErrorStr::PSDMeshNotSelected);
+        tgtPath.extendToShape();
+
+        MFnMesh fnTgtMesh(tgtPath, &stat);
+        MCheckStatus(stat, ErrorStr::PSDMeshNotSelected);
+        fnTgtMesh.getPoints(tgtPositions[i]);
+    }
+
+
+    // Get skinCluster weights, joint matrices and source positions once
+    SkinData skinData;
+    stat = getSkinData(fnDeformer, srcPath, skinData);
+    MCheckStatus(stat, "");
+
+    for( unsigned i=0; i < numTargets; ++i )
+    {
+        if ( skinData.positions.length() != tgtPositions[i].length() )
+        {
+            MReturnFailure(ErrorStr::PSDInvalidPoseTarget);
+        }
+    }
+
+
+    // Get components with delta (in bind space) of every target
+    std::vector< std::vector<int> > components(numTargets);
+    std::vector< std::vector<MVector> > deltas(numTargets);
+
+    {
+        ProfileScope scope("diffComponents");
+        ThreadPool::parallelFor(0, (int)numTargets, [&](int begin, int end)
+        {
+            for( int i=begin; i < end; ++i )
+                diffComponents(skinData, tgtPositions[i], components[i]);
+        }, 1);
+    }
+
+    // Inverses of vertices any target moves, each computed once
+    {
+        ProfileScope scope("cacheSkinInverses");
+        for( unsigned i=0; i < numTargets; ++i )
+            cacheSkinInverses(skinData, components[i]);
+    }
+
+    {
+        ProfileScope scope("calcBindDeltas");
+        ThreadPool::parallelFor(0, (int)numTargets, [&](int begin, int end)
+        {
+            for( int i=begin; i < end; ++i )
+                calcBindDeltas(skinData, tgtPositions[i], components[i], deltas[i]);
+        }, 1);
+    }
+
+
+    // Edits of changed components, then set them onto plugs
+    MIntArray targetIndices;
+    for( unsigned i=0; i < numTargets; ++i )
+    {
+        if (components[i].size() == 0)
+        {
+            MString msg = _batchMeshes[i];
+            msg += ": ";
+            msg += ErrorStr::PSDPoseTargetDoesntDiffer;
+            MGlobal::displayWarning(msg);
+            continue;
+        }
+
+        TargetEdit edit;
+        edit.compPlug = targetPlugs[i].child(PoseSpaceDeformer::aPoseTargetComponents);
+        edit.compPlug = edit.compPlug.elementByLogicalIndex(_geomIndex);
+        edit.deltaPlug = targetPlugs[i].child(PoseSpaceDeformer::aPoseTargetDelta);
+        edit.deltaPlug = edit.deltaPlug.elementByLogicalIndex(_geomIndex);
+
+        unsigned numComponents = 0;
+        stat = makeTargetEdit(components[i], deltas[i], false, edit, numComponents);
+        MCheckStatus(stat, "");
+
+        _edits.push_back(edit);
+        targetIndices.append(_batchTargetIndices[i]);
+    }
+
+    stat = redoIt();
+    MCheckStatus(stat, "");
+
+
+    setResult(targetIndices);
+
+    return MS::kSuccess;
+}
+
+
+MStatus PoseSpaceCommand::setPoseTargetPlugs( MPlug& pPoseComp, MPlug& pPoseDelta, const MIntArray& components, const MVectorArray& deltas )
+{
+    MStatus stat;
+    MObject obj;
+
+    MFnIntArrayData fnIntArrData;
+    obj = fnIntArrData.create(components, &stat);
+    MCheckStatus(stat, "");
+    stat = pPoseComp.setValue(obj);
+    MCheckStatus(stat, "");
+
+    MFnVectorArrayData fnVectorArrData;
+    obj = fnVectorArrData.create(deltas, &stat);
+    MCheckStatus(stat, "");
+    stat = pPoseDelta.setValue(obj);
+    MCheckStatus(stat, "");
+
+    return MS::kSuccess;
+}
+
+
+// Write all poses, pose joints and targets of the deformer to a pose library.
+// Each array attribute is read with a single plug getValue
+MStatus PoseSpaceCommand::exportPoseLibrary()
+{
+    MStatus stat;
+    MObject obj;
+
+
+    // Get deformer
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnDependencyNode fnDeformer(obj);
+
+
+    std::vector<PoseLibrary::PoseData> poses;
+    unsigned numTargets = 0;
+
+    MPlug pPoseArray = fnDeformer.findPlug(PoseSpaceDeformer::aPose);
+    poses.resize(pPoseArray.numElements());
+    for( unsigned p=0; p < pPoseArray.numElements(); ++p )
+    {
+        MPlug pPose = pPoseArray.elementByPhysicalIndex(p);
+        PoseLibrary::PoseData& pose = poses[p];
+
+        pose.index = pPose.logicalIndex();
+        pose.name = pPose.child(PoseSpaceDeformer::aPoseName).asString().asChar();
+        pose.ignore = pPose.child(PoseSpaceDeformer::aPoseIgnore).asBool();
+        pose.envelope = pPose.child(PoseSpaceDeformer::aPoseEnvelope).asFloat();
+
+        // Pose joints
+        MPlug pPoseJoint = pPose.child(PoseSpaceDeformer::aPoseJoint);
+        pose.joints.resize(pPoseJoint.numElements());
+        for( unsigned j=0; j < pPoseJoint.numElements(); ++j )
+        {
+            MPlug pJoint = pPoseJoint.elementByPhysicalIndex(j);
+            MPlug pRot = pJoint.child(PoseSpaceDeformer::aPoseJointRot);
+
+            PoseLibrary::PoseJointData& joint = pose.joints[j];
+            joint.index = pJoint.logicalIndex();
+            joint.fallOff = pJoint.child(PoseSpaceDeformer::aPoseJointFallOff).asFloat();
+            for( unsigned k=0; k < 3; ++k )
+                joint.rotation[k] = pRot.child(k).asDouble();
+        }
+
+        // Targets, one entry per geometry
+        MPlug pPoseTarget = pPose.child(PoseSpaceDeformer::aPoseTarget);
+        for( unsigned t=0; t < pPoseTarget.numElements(); ++t )
+        {
+            MPlug pTarget = pPoseTarget.elementByPhysicalIndex(t);
+            MPlug pComp = pTarget.child(PoseSpaceDeformer::aPoseTargetComponents);
+            MPlug pDelta = pTarget.child(PoseSpaceDeformer::aPoseTargetDelta);
+
+            for( unsigned g=0; g < pComp.numElements(); ++g )
+            {
+                MPlug pGeomComp = pComp.elementByPhysicalIndex(g);
+                unsigned geomIndex = pGeomComp.logicalIndex();
+
+                pGeomComp.getValue(obj);
+                MFnIntArrayData fnIntArrData(obj);
+                MIntArray components = fnIntArrData.array();
+
+                pDelta.elementByLogicalIndex(geomIndex).getValue(obj);
+                MFnVectorArrayData fnVectorArrData(obj);
+                MVectorArray deltas = fnVectorArrData.array();
+
+                if ( components.length() != deltas.length() )
+                {
+                    MReturnFailure(ErrorStr::PSDInvalidTargetDelta);
+                }
+
+                pose.targets.push_back(PoseLibrary::TargetData());
+                PoseLibrary::TargetData& target = pose.targets.back();
+
+                target.index = pTarget.logicalIndex();
+                target.name = pTarget.child(PoseSpaceDeformer::aPoseTargetName).asString().asChar();
+                target.geomIndex = geomIndex;
+                target.envelope = pTarget.child(PoseSpaceDeformer::aPoseTargetEnvelope).asFloat();
+
+                target.components.resize(components.length());
+                target.deltas.resize(deltas.length() * 3);
+                if (components.length())
+                {
+                    components.get(&target.components[0]);
+                    deltas.get((double (*)[3])&target.deltas[0]);
+                }
+
+                ++numTargets;
+            }
+        }
+    }
+
+
+    std::string error;
+    if (!PoseLibrary::write(_file.asChar(), poses, error))
+    {
+        MReturnFailure(error.c_str());
+    }
+
+    setResult((int)numTargets);
+
+    return MS::kSuccess;
+}
+
+
+// Set poses, pose joints and targets from a memory mapped pose library. Poses
+// and targets are set at their stored indices, replacing existing data there.
+// Target arrays are built straight from the mapped blocks. All values go
+// through one MDGModifier, so the import undoes as a whole
+MStatus PoseSpaceCommand::importPoseLibrary()
+{
+    MStatus stat;
+    MObject obj;
+
+
+    // Get deformer
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnDependencyNode fnDeformer(obj);
+
+
+    PoseLibrary::Reader reader;
+    std::string error;
+    if (!reader.open(_file.asChar(), error))
+    {
+        MReturnFailure(error.c_str());
+    }
+
+    const PoseLibrary::Header& header = reader.header();
+
+    MPlug pPoseArray = fnDeformer.findPlug(PoseSpaceDeformer::aPose);
+    for( uint32_t p=0; p < header.numPoses; ++p )
+    {
+        const PoseLibrary::PoseRecord& pose = reader.poses()[p];
+        MPlug pPose = pPoseArray.elementByLogicalIndex(pose.index);
+
+        _dgMod.newPlugValueString(pPose.child(PoseSpaceDeformer::aPoseName), MString(reader.string(pose.nameOffset)));
+        _dgMod.newPlugValueBool(pPose.child(PoseSpaceDeformer::aPoseIgnore), pose.ignore != 0);
+        _dgMod.newPlugValueFloat(pPose.child(PoseSpaceDeformer::aPoseEnvelope), pose.envelope);
+
+        // Pose joints
+        MPlug pPoseJoint = pPose.child(PoseSpaceDeformer::aPoseJoint);
+        for( uint32_t j=pose.firstJoint; j < pose.firstJoint + pose.numJoints; ++j )
+        {
+            const PoseLibrary::PoseJointRecord& joint = reader.poseJoints()[j];
+            MPlug pJoint = pPoseJoint.elementByLogicalIndex(joint.index);
+            MPlug pRot = pJoint.child(PoseSpaceDeformer::aPoseJointRot);
+
+            for( unsigned k=0; k < 3; ++k )
+                _dgMod.newPlugValueDouble(pRot.child(k), joint.rotation[k]);
+            _dgMod.newPlugValueFloat(pJoint.child(PoseSpaceDeformer::aPoseJointFallOff), joint.fallOff);
+        }
+
+        // Targets
+        MPlug pPoseTarget = pPose.child(PoseSpaceDeformer::aPoseTarget);
+        for( uint32_t t=pose.firstTarget; t < pose.firstTarget + pose.numTargets; ++t )
+        {
+            const PoseLibrary::TargetRecord& target = reader.targets()[t];
+            MPlug pTarget = pPoseTarget.elementByLogicalIndex(target.index);
+
+            _dgMod.newPlugValueString(pTarget.child(PoseSpaceDeformer::aPoseTargetName), MString(reader.string(target.nameOffset)));
+            _dgMod.newPlugValueFloat(pTarget.child(PoseSpaceDeformer::aPoseTargetEnvelope), target.envelope);
+
+            MPlug pPoseComp = pTarget.child(PoseSpaceDeformer::aPoseTargetComponents);
+            pPoseComp = pPoseComp.elementByLogicalIndex(target.geomIndex);
+            MPlug pPoseDelta = pTarget.child(PoseSpaceDeformer::aPoseTargetDelta);
+            pPoseDelta = pPoseDelta.elementByLogicalIndex(target.geomIndex);
+
+            MFnIntArrayData fnIntArrData;
+            obj = fnIntArrData.create(MIntArray(reader.components(target), target.numComponents), &stat);
+            MCheckStatus(stat, "");
+            _dgMod.newPlugValue(pPoseComp, obj);
+
+            MFnVectorArrayData fnVectorArrData;
+            obj = fnVectorArrData.create(MVectorArray((const double (*)[3])reader.deltas(target), target.numComponents), &stat);
+            MCheckStatus(stat, "");
+            _dgMod.newPlugValue(pPoseDelta, obj);
+        }
+    }
+
+    stat = _dgMod.doIt();
+    MCheckStatus(stat, "");
+    _dgModified = true;
+
+    setResult((int)header.numPoses);
+
+    return MS::kSuccess;
+}
+
+
+// Name of the joint driving a joint element, from its jointRot, jointMatrix or
+// jointRestOrient connection. Empty if not connected
+static MString jointName( const MPlug& pJoint )
+{
+    MObject attrs[] = { PoseSpaceDeformer::aJointRot, PoseSpaceDeformer::aJointMatrix, PoseSpaceDeformer::aJointRestOrient };
+    for( unsigned i=0; i < 3; ++i )
+    {
+        MPlugArray conns;
+        pJoint.child(attrs[i]).connectedTo(conns, true, false);
+        if (conns.length() == 0)
+            continue;
+
+        MObject node = conns[0].node();
+        if (node.hasFn(MFn::kDagNode))
+            return MFnDagNode(node).partialPathName();
+        return MFnDependencyNode(node).name();
+    }
+
+    return MString();
+}
+
+
+// Answer a query flag with all the values in one result
+MStatus PoseSpaceCommand::query()
+{
+    MStatus stat;
+    MObject obj;
+
+    if (_operation == LFLAG_THREADCAP)
+    {
+        setResult((int)ThreadPool::threadCap());
+        return MS::kSuccess;
+    }
+
+    // Get deformer
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnDependencyNode fnDeformer(obj);
+    PoseSpaceDeformer* psd = (PoseSpaceDeformer*)fnDeformer.userNode();
+
+
+    MPlug pPoseArray = fnDeformer.findPlug(PoseSpaceDeformer::aPose);
+
+    // Whole pose list
+    if (_operation == LFLAG_POSENAMES ||
+        _operation == LFLAG_POSEINDICES ||
+        _operation == LFLAG_POSEWEIGHTS)
+    {
+        MStringArray names;
+        MIntArray indices;
+        MDoubleArray weights;
+
+        MPlug pPoseWeights = fnDeformer.findPlug(PoseSpaceDeformer::aPoseWeights);
+
+        for( unsigned i=0; i < pPoseArray.numElements(); ++i )
+        {
+            MPlug pPose = pPoseArray.elementByPhysicalIndex(i);
+            int poseIndex = pPose.logicalIndex();
+
+            if (_operation == LFLAG_POSENAMES)
+                names.append(pPose.child(PoseSpaceDeformer::aPoseName).asString());
+            else if (_operation == LFLAG_POSEINDICES)
+                indices.append(poseIndex);
+            else
+                weights.append(pPoseWeights.elementByLogicalIndex(poseIndex).asDouble());
+        }
+
+        if (_operation == LFLAG_POSENAMES)
+            setResult(names);
+        else if (_operation == LFLAG_POSEINDICES)
+            setResult(indices);
+        else
+            setResult(weights);
+
+        return MS::kSuccess;
+    }
+
+    if (_operation == LFLAG_POSEINDEX)
+    {
+        setResult(psd->poseIndex(_name));
+        return MS::kSuccess;
+    }
+
+    // Joints
+    if (_operation == LFLAG_JOINTINDICES ||
+        _operation == LFLAG_JOINTNAMES)
+    {
+        MStringArray names;
+        MIntArray indices;
+
+        MPlug pJointArray = fnDeformer.findPlug(PoseSpaceDeformer::aJoint);
+        for( unsigned i=0; i < pJointArray.numElements(); ++i )
+        {
+            MPlug pJoint = pJointArray.elementByPhysicalIndex(i);
+
+            if (_operation == LFLAG_JOINTINDICES)
+                indices.append(pJoint.logicalIndex());
+            else
+                names.append(jointName(pJoint));
+        }
+
+        if (_operation == LFLAG_JOINTINDICES)
+            setResult(indices);
+        else
+            setResult(names);
+
+        return MS::kSuccess;
+    }
+
+
+    // Per pose
+    MPlug pPose;
+    stat = getPosePlug(fnDeformer, _poseIndex, pPose);
+    MCheckStatus(stat, "");
+
+    if (_operation == LFLAG_POSETARGETINDEX)
+    {
+        setResult(psd->poseTargetIndex(_poseIndex, _name));
+        return MS::kSuccess;
+    }
+
+    MStringArray names;
+    MIntArray indices;
+
+    if (_operation == LFLAG_POSEJOINTS)
+    {
+        MPlug pPoseJoint = pPose.child(PoseSpaceDeformer::aPoseJoint);
+        for( unsigned i=0; i < pPoseJoint.numElements(); ++i )
+            indices.append(pPoseJoint.elementByPhysicalIndex(i).logicalIndex());
+
+        setResult(indices);
+        return MS::kSuccess;
+    }
+
+    MPlug pPoseTarget = pPose.child(PoseSpaceDeformer::aPoseTarget);
+    for( unsigned i=0; i < pPoseTarget.numElements(); ++i )
+    {
+        MPlug pTarget = pPoseTarget.elementByPhysicalIndex(i);
+
+        if (_operation == LFLAG_POSETARGETNAMES)
+            names.append(pTarget.child(PoseSpaceDeformer::aPoseTargetName).asString());
+        else
+            indices.append(pTarget.logicalIndex());
+    }
+
+    if (_operation == LFLAG_POSETARGETNAMES)
+        setResult(names);
+    else
+        setResult(indices);
+
+    return MS::kSuccess;
+}
+
+
+// Copy the rotate of the joints connected to a pose's joints onto poseJointRot
+MStatus PoseSpaceCommand::updatePoseJoints()
+{
+    MStatus stat;
+    MObject obj;
+
+
+    // Get deformer
+    stat = getDeformerFromSelList(obj);
+    MCheckStatus(stat, "");
+    MFnDependencyNode fnDeformer(obj);
+
+    MPlug pPose;
+    stat = getPosePlug(fnDeformer, _poseIndex, pPose);
+    MCheckStatus(stat, "");
+
+    MPlug pJointArray = fnDeformer.findPlug(PoseSpaceDeformer::aJoint);
+
+    MPlug pPoseJoint = pPose.child(PoseSpaceDeformer::aPoseJoint);
+    for( unsigned i=0; i < pPoseJoint.numElements(); ++i )
+    {
+        MPlug pJoint = pPoseJoint.elementByPhysicalIndex(i);
+        MString joint = jointName(pJointArray.elementByLogicalIndex(pJoint.logicalIndex()));
+        if (joint.length() == 0)
+            continue;
+
+        MSelectionList selList;
+        selList.add(joint);
+        selList.getDependNode(0, obj);
+        MPlug pRotate = MFnDependencyNode(obj).findPlug("rotate", &stat);
+        MCheckStatus(stat, "");
+
+        // Through the modifier, undoable like setAttr
+        MPlug pRot = pJoint.child(PoseSpaceDeformer::aPoseJointRot);
+        for( unsigned k=0; k < 3; ++k )
+            _dgMod.newPlugValueDouble(pRot.child(k), pRotate.child(k).asDouble());
+        _dgModified = true;
+    }
+
+    if (_dgModified)
+    {
+        stat = _dgMod.doIt();
+        MCheckStatus(stat, "");
+    }
+
+    return MS::kSuccess;
+}
+
+
+// Components/deltas of a target, sorted by component
+MStatus PoseSpaceCommand::getTargetDeltas( const TargetEdit& edit, std::vector<int>& components, std::vector<MVector>& deltas )
+{
+    MObject obj;
+
+    components.clear();
+    deltas.clear();
+
+    // New target, no data yet
+    edit.compPlug.getValue(obj);
+    if (obj.isNull())
+        return MS::kSuccess;
+    MFnIntArrayData fnIntArrData(obj);
+    MIntArray compArray = fnIntArrData.array();
+
+    edit.deltaPlug.getValue(obj);
+    if (obj.isNull())
+        return MS::kSuccess;
+    MFnVectorArrayData fnVectorArrData(obj);
+    MVectorArray deltaArray = fnVectorArrData.array();
+
+    if ( compArray.length() != deltaArray.length() )
+    {
+        MReturnFailure(ErrorStr::PSDInvalidTargetDelta);
+    }
+
+    const unsigned count = compArray.length();
+    components.resize(count);
+    deltas.resize(count);
+    if (count == 0)
+        return MS::kSuccess;
+
+    compArray.get(&components[0]);
+    deltaArray.get((double (*)[3])&deltas[0]);
+
+    // Targets set by this command are sorted already, others get sorted once
+    bool sorted = true;
+    for( unsigned i=1; i < count && sorted; ++i )
+        sorted = components[i-1] < components[i];
+
+    if (!sorted)
+    {
+        std::map<int, MVector> deltaMap;
+        for( unsigned i=0; i < count; ++i )
+            deltaMap[components[i]] = deltas[i];
+
+        components.clear();
+        deltas.clear();
+        for( std::map<int, MVector>::const_iterator iter=deltaMap.begin(); iter != deltaMap.end(); ++iter )
+        {
+            components.push_back(iter->first);
+            deltas.push_back(iter->second);
+        }
+    }
+
+    return MS::kSuccess;
+}
+
+
+// Linear merge of new sorted deltas with the existing target, recording only
+// components whose delta changes. Without add the new deltas replace the target
+MStatus PoseSpaceCommand::makeTargetEdit(   const std::vector<int>&     components, 
+                                            const std::vector<MVector>& deltas, 
+                                            bool                        add, 
+                                            TargetEdit&                 edit, 
+                                            unsigned&                   numComponents )
+{
+    MStatus stat;
+
+    std::vector<int> oldComponents;
+    std::vector<MVector> oldDeltas;
+    stat = getTargetDeltas(edit, oldComponents, oldDeltas);
+    MCheckStatus(stat, "");
+
+    numComponents = 0;
+
+    unsigned i = 0, j = 0;
+    while (i < oldComponents.size() || j < components.size())
+    {
+        bool hasOld = i < oldComponents.size() && (j == components.size() || oldComponents[i] <= components[j]);
+        bool hasNew = j < components.size() && (i == oldComponents.size() || components[j] <= oldComponents[i]);
+
+        int c = hasOld ? oldComponents[i] : components[j];
+        MVector before = hasOld ? oldDeltas[i] : MVector::zero;
+
+        bool hasAfter = hasNew || (hasOld && add);
+        MVector after = before;
+        if (hasNew)
+            after = add ? before + deltas[j] : deltas[j];
+
+        if (hasAfter)
+            ++numComponents;
+
+        if (hasOld != hasAfter || (hasAfter && !(before == after)))
+        {
+            edit.components.push_back(c);
+            edit.before.push_back(before);
+            edit.hadBefore.push_back(hasOld);
+            edit.after.push_back(after);
+            edit.hasAfter.push_back(hasAfter);
+        }
+
+        if (hasOld) ++i;
+        if (hasNew) ++j;
+    }
+
+    return MS::kSuccess;
+}
+
+
+// Set the before (undo) or after (redo) deltas of an edit onto its target,
+// merging them linearly into the current sorted components
+MStatus PoseSpaceCommand::applyTargetEdit( const TargetEdit& edit, bool undo )
+{
+    MStatus stat;
+
+    std::vector<int> oldComponents;
+    std::vector<MVector> oldDeltas;
+    stat = getTargetDeltas(edit, oldComponents, oldDeltas);
+    MCheckStatus(stat, "");
+
+    const std::vector<MVector>& editDeltas = undo ? edit.before : edit.after;
+    const std::vector<char>& editExists = undo ? edit.hadBefore : edit.hasAfter;
+
+    MIntArray components;
+    MVectorArray deltas;
+    components.setSizeIncrement((unsigned)(oldComponents.size() + edit.components.size()));
+    deltas.setSizeIncrement((unsigned)(oldComponents.size() + edit.components.size()));
+
+    unsigned i = 0, j = 0;
+    while (i < oldComponents.size() || j < edit.components.size())
+    {
+        bool hasOld = i < oldComponents.size() && (j == edit.components.size() || oldComponents[i] <= edit.components[j]);
+        bool hasEdit = j < edit.components.size() && (i == oldComponents.size() || edit.components[j] <= oldComponents[i]);
+
+        if (hasEdit)
+        {
+            if (editExists[j])
+            {
+                components.append(edit.components[j]);
+                deltas.append(editDeltas[j]);
+            }
+        }
+        else
+        {
+            components.append(oldComponents[i]);
+            deltas.append(oldDeltas[i]);
+        }
+
+        if (hasOld) ++i;
+        if (hasEdit) ++j;
+    }
+
+    MPlug compPlug = edit.compPlug;
+    MPlug deltaPlug = edit.deltaPlug;
+    return setPoseTargetPlugs(compPlug, deltaPlug, components, deltas);
+}
@@ -7,6 +7,21 @@
 #include <maya/MSyntax.h>
 #include <maya/MStringArray.h>
 #include <maya/MObjectArray.h>
+#include <maya/MFnDependencyNode.h>
+#include <maya/MFnGeometryFilter.h>
+#include <maya/MDagPath.h>
+#include <maya/MPointArray.h>
+#include <maya/MVector.h>
+#include <maya/MMatrix.h>
+#include <maya/MIntArray.h>
+#include <maya/MVectorArray.h>
+#include <maya/MPlug.h>
+#include <maya/MDGModifier.h>
+
+#include <vector>
+
+
+class SkinData;
 
 
 class PoseSpaceCommand : public MPxCommand 
@@ -18,8 +33,9 @@ public:
     static MSyntax      cmdSyntax();
 
     MStatus             doIt(const MArgList& args);
-    //MStatus             redoIt();
-    //MStatus             undoIt();
+    MStatus             redoIt();
+    MStatus             undoIt();
+    bool                isUndoable() const;
 
 public:
     static  const char*     name;
@@ -33,6 +49,75 @@ private:
     MStatus             getDeformerFromSelList(MObject& obj);
 
     MStatus             setPoseTarget();
+    MStatus             batchSetPoseTarget();
+    MStatus             exportPoseLibrary();
+    MStatus             importPoseLibrary();
+    MStatus             commitSculpt();
+    MStatus             pruneTargets();
+
+    MStatus             query();
+    MStatus             updatePoseJoints();
+
+    MStatus             getPosePlug(        MFnDependencyNode&  fnDeformer, 
+                                            int                 poseIndex, 
+                                            MPlug&              pPose );
+
+    MStatus             getPoseTargetPlug(  MFnDependencyNode&  fnDeformer, 
+                                            int                 poseIndex, 
+                                            int&                targetIndex, 
+                                            MPlug&              pPoseTarget );
+
+    // Changed components of one target, sorted, with their delta before/after
+    class TargetEdit
+    {
+    public:
+        MPlug                   compPlug;
+        MPlug                   deltaPlug;
+        std::vector<int>        components;
+        std::vector<MVector>    before;
+        std::vector<char>       hadBefore;
+        std::vector<MVector>    after;
+        std::vector<char>       hasAfter;
+    };
+
+    MStatus             getTargetDeltas(    const TargetEdit&           edit, 
+                                            std::vector<int>&           components, 
+                                            std::vector<MVector>&       deltas );
+
+    MStatus             makeTargetEdit(     const std::vector<int>&     components, 
+                                            const std::vector<MVector>& deltas, 
+                                            bool                        add, 
+                                            TargetEdit&                 edit, 
+                                            unsigned&                   numComponents );
+
+    MStatus             applyTargetEdit(    const TargetEdit&           edit, 
+                                            bool                        undo );
+
+    MStatus             setPoseTargetPlugs( MPlug&              pPoseComp, 
+                                            MPlug&              pPoseDelta, 
+                                            const MIntArray&    components, 
+                                            const MVectorArray& deltas );
+
+    MStatus             getSkinData(    MFnGeometryFilter&      fnDeformer, 
+                                        const MDagPath&         srcPath, 
+                                        SkinData&               skinData );
+
+    void                pruneDeltas(    const MMatrix&          worldMatrix, 
+                                        double                  threshold, 
+                                        std::vector<int>&       components, 
+                                        std::vector<MVector>&   deltas );
+
+    void                diffComponents( const SkinData&         skinData, 
+                                        const MPointArray&      tgtPositions, 
+                                        std::vector<int>&       components );
+
+    void                cacheSkinInverses(  const SkinData&         skinData, 
+                                            const std::vector<int>& components );
+
+    void                calcBindDeltas( const SkinData&         skinData, 
+                                        const MPointArray&      tgtPositions, 
+                                        const std::vector<int>& components, 
+                                        std::vector<MVector>&   deltas );
 
 
 private:
@@ -44,7 +129,29 @@ private:
     MString             _poseSpaceDeformer;
     int                 _poseIndex;
     int                 _targetIndex;
+    unsigned            _geomIndex;
     bool                _updateTarget;
+
+    std::vector<int>    _batchPoseIndices;
+    std::vector<int>    _batchTargetIndices;
+    MStringArray        _batchMeshes;
+
+    MString             _file;
+
+    double              _pruneThreshold;
+    double              _mergeTolerance;
+
+    unsigned            _threadCap;
+
+    bool                _query;
+
+    std::vector<TargetEdit> _edits;
+
+    // Plug values set by importPoseLibrary, commitSculpt and updatePoseJoints,
+    // undone as one
+    MDGModifier         _dgMod;
+    bool                _dgModified;
+    MString             _name;
 };
 
 
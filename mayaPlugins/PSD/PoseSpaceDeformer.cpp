@@ -1,7 +1,10 @@
 #include "PoseSpaceDeformer.h"
 #include "utils.h"
+#include "Profiler.h"
+#include "Core/Deltas.h"
 
 #include <iostream>
+#include <algorithm>
 
 #include <Eigen/Dense>
 using namespace Eigen;
@@ -18,13 +21,16 @@ using namespace Eigen;
 #include <maya/MFnMatrixAttribute.h>
 #include <maya/MFnUnitAttribute.h>
 #include <maya/MFnIntArrayData.h>
+#include <maya/MFnDoubleArrayData.h>
 #include <maya/MFnVectorArrayData.h>
-#include <maya/MFnMatrixData.h>
-#include <maya/MFnSkinCluster.h>
-#include <maya/MFnDependencyNode.h>
-#include <maya/MItDependencyGraph.h>
 #include <maya/MItGeometry.h>
+#include <maya/MArrayDataBuilder.h>
 #include <maya/MVectorArray.h>
+#include <maya/MFnDependencyNode.h>
+#include <maya/MItDependencyNodes.h>
+#include <maya/MSceneMessage.h>
+#include <maya/MDGModifier.h>
+#include <maya/MPlugArray.h>
 
 
 MTypeId PoseSpaceDeformer::id( PluginIDs::PoseSpaceDeformer );
@@ -40,6 +46,17 @@ MObject PoseSpaceDeformer::aJointRot;
 MObject PoseSpaceDeformer::aJointRotX;
 MObject PoseSpaceDeformer::aJointRotY;
 MObject PoseSpaceDeformer::aJointRotZ;
+MObject PoseSpaceDeformer::aJointMatrix;
+MObject PoseSpaceDeformer::aJointQuat;
+MObject PoseSpaceDeformer::aJointQuatX;
+MObject PoseSpaceDeformer::aJointQuatY;
+MObject PoseSpaceDeformer::aJointQuatZ;
+MObject PoseSpaceDeformer::aJointQuatW;
+MObject PoseSpaceDeformer::aJointRestOrient;
+MObject PoseSpaceDeformer::aJointRestOrientX;
+MObject PoseSpaceDeformer::aJointRestOrientY;
+MObject PoseSpaceDeformer::aJointRestOrientZ;
+MObject PoseSpaceDeformer::aJointInputMode;
 MObject PoseSpaceDeformer::aPose;
 MObject PoseSpaceDeformer::aPoseName;
 MObject PoseSpaceDeformer::aPoseIgnore;
@@ -56,14 +73,50 @@ MObject PoseSpaceDeformer::aPoseTargetName;
 MObject PoseSpaceDeformer::aPoseTargetEnvelope;
 MObject PoseSpaceDeformer::aPoseTargetComponents;
 MObject PoseSpaceDeformer::aPoseTargetDelta;
+MObject PoseSpaceDeformer::aLegacyPoseTargetComponents;
+MObject PoseSpaceDeformer::aLegacyPoseTargetDelta;
 
 MObject PoseSpaceDeformer::aIncludeTwist;
 
+MObject PoseSpaceDeformer::aSkinCluster;
 MObject PoseSpaceDeformer::aSkinClusterWeightList;
 MObject PoseSpaceDeformer::aSkinClusterWeights;
-
-std::map<short, MVector>  PoseSpaceDeformer::AxisVec;
-std::map<short, MVector>  PoseSpaceDeformer::UpVec;
+MObject PoseSpaceDeformer::aSkinClusterMatrix;
+MObject PoseSpaceDeformer::aSkinClusterBindPreMatrix;
+MObject PoseSpaceDeformer::aLegacySkinClusterWeightList;
+MObject PoseSpaceDeformer::aLegacySkinClusterWeights;
+
+MObject PoseSpaceDeformer::aPoseLibraryFile;
+MObject PoseSpaceDeformer::aStreamTargets;
+MObject PoseSpaceDeformer::aTargetMemoryBudget;
+MObject PoseSpaceDeformer::aPruneThreshold;
+MObject PoseSpaceDeformer::aCompressionMode;
+MObject PoseSpaceDeformer::aCompressionError;
+MObject PoseSpaceDeformer::aCompressionRank;
+
+MObject PoseSpaceDeformer::aSculptPose;
+MObject PoseSpaceDeformer::aSculptTarget;
+MObject PoseSpaceDeformer::aSculptGeometry;
+MObject PoseSpaceDeformer::aSculptComponents;
+MObject PoseSpaceDeformer::aSculptDelta;
+
+MObject PoseSpaceDeformer::aStatsEvaluationTime;
+MObject PoseSpaceDeformer::aStatsSolveTime;
+MObject PoseSpaceDeformer::aStatsAccumulateTime;
+MObject PoseSpaceDeformer::aStatsSkinTime;
+MObject PoseSpaceDeformer::aStatsWriteTime;
+MObject PoseSpaceDeformer::aStatsActivePoses;
+MObject PoseSpaceDeformer::aStatsTouchedVertices;
+MObject PoseSpaceDeformer::aStatsCacheHitRate;
+
+MObject PoseSpaceDeformer::aPoseWeights;
+MObject PoseSpaceDeformer::aActivePoseIndices;
+MObject PoseSpaceDeformer::aActivePoseWeights;
+
+MVector  PoseSpaceDeformer::AxisVec[6];
+MVector  PoseSpaceDeformer::UpVec[6];
+
+MCallbackIdArray PoseSpaceDeformer::_callbacks;
 
 
 enum Axis
@@ -76,11 +129,57 @@ enum Axis
     AXIS_NEG_Z,
 };
 
+enum JointInputMode
+{
+    JOINT_INPUT_EULER,
+    JOINT_INPUT_MATRIX,
+    JOINT_INPUT_QUATERNION,
+};
+
+enum CompressionMode
+{
+    COMPRESSION_NONE,
+    COMPRESSION_PCA,
+};
+
+// Target weight changes up to this are left out of the incremental update,
+// which is redone from scratch every FULL_REBUILD_INTERVAL evaluations
+static const double     WEIGHT_EPSILON          = 1e-5;
+static const unsigned   FULL_REBUILD_INTERVAL   = 100;
+
+// Deltas and skin matrices are handed to the Core kernels as plain doubles,
+// input points are hashed as such
+static_assert(sizeof(MVector) == 3 * sizeof(double), "MVector is not 3 packed doubles");
+static_assert(sizeof(MMatrix) == 16 * sizeof(double), "MMatrix is not 16 packed doubles");
+static_assert(sizeof(MPoint) == 4 * sizeof(double), "MPoint is not 4 packed doubles");
+
+
+// Primary and up axis of the joint, rotated
+PoseSolver::JointFrame PoseSpaceDeformer::jointFrame( const MMatrix& rotMat, short primeAxis )
+{
+    MVector axis = AxisVec[primeAxis] * rotMat;
+    MVector up = UpVec[primeAxis] * rotMat;
+
+    PoseSolver::JointFrame frame;
+    axis.get(frame.axis);
+    up.get(frame.up);
+    return frame;
+}
+
 
 
 PoseSpaceDeformer::PoseSpaceDeformer()
 {
     _posesDirty = true;
+    _targetsDirty = true;
+    _namesDirty = true;
+    _generation = 0;
+    _sculptDirty = true;
+    _sculptPose = -1;
+    _sculptTarget = -1;
+    _sculptGeometry = -1;
+    _deforms = 0;
+    _replays = 0;
 }
 
 void* PoseSpaceDeformer::creator()
@@ -130,6 +229,25 @@ MStatus PoseSpaceDeformer::initialize()
     aJointRotZ = uAttr.create("jointRotZ", "jrz", MFnUnitAttribute::kAngle);
     aJointRot = nAttr.create("jointRot", "jr", aJointRotX, aJointRotY, aJointRotZ);
 
+    // Matrix/quaternion driven joints, used instead of jointRot by jointInputMode
+    aJointMatrix = mAttr.create("jointMatrix", "jm");
+
+    aJointQuatX = nAttr.create("jointQuatX", "jqx", MFnNumericData::kDouble, 0.0);
+    aJointQuatY = nAttr.create("jointQuatY", "jqy", MFnNumericData::kDouble, 0.0);
+    aJointQuatZ = nAttr.create("jointQuatZ", "jqz", MFnNumericData::kDouble, 0.0);
+    aJointQuatW = nAttr.create("jointQuatW", "jqw", MFnNumericData::kDouble, 1.0);
+    aJointQuat = cAttr.create("jointQuat", "jq");
+    cAttr.addChild(aJointQuatX);
+    cAttr.addChild(aJointQuatY);
+    cAttr.addChild(aJointQuatZ);
+    cAttr.addChild(aJointQuatW);
+
+    // Joint orient baked into jointMatrix/jointQuat, removed to get back to jointRot space
+    aJointRestOrientX = uAttr.create("jointRestOrientX", "jrox", MFnUnitAttribute::kAngle);
+    aJointRestOrientY = uAttr.create("jointRestOrientY", "jroy", MFnUnitAttribute::kAngle);
+    aJointRestOrientZ = uAttr.create("jointRestOrientZ", "jroz", MFnUnitAttribute::kAngle);
+    aJointRestOrient = nAttr.create("jointRestOrient", "jro", aJointRestOrientX, aJointRestOrientY, aJointRestOrientZ);
+
     aJointAxis = eAttr.create("jointAxis", "ja", AXIS_X );
     eAttr.addField( "X", AXIS_X );
     eAttr.addField( "Y", AXIS_Y );
@@ -143,8 +261,18 @@ MStatus PoseSpaceDeformer::initialize()
     cAttr.setArray(true);
     cAttr.addChild(aJointRot);
     cAttr.addChild(aJointAxis);
+    cAttr.addChild(aJointMatrix);
+    cAttr.addChild(aJointQuat);
+    cAttr.addChild(aJointRestOrient);
     addAttribute(aJoint);
 
+    aJointInputMode = eAttr.create("jointInputMode", "jim", JOINT_INPUT_EULER);
+    eAttr.addField( "Euler", JOINT_INPUT_EULER );
+    eAttr.addField( "Matrix", JOINT_INPUT_MATRIX );
+    eAttr.addField( "Quaternion", JOINT_INPUT_QUATERNION );
+    eAttr.setChannelBox(true);
+    addAttribute(aJointInputMode);
+
     aPoseName = tAttr.create("poseName", "pn", MFnData::kString);
 
     aPoseIgnore = nAttr.create("poseIgnore", "pi", MFnNumericData::kBoolean, false);
@@ -168,9 +296,17 @@ MStatus PoseSpaceDeformer::initialize()
     aPoseTargetName = tAttr.create("poseTargetName", "ptn", MFnData::kString);
     aPoseTargetEnvelope = nAttr.create("poseTargetEnvelope", "pte", MFnNumericData::kFloat, 1.f);
     nAttr.setKeyable(true);
-    aPoseTargetComponents = tAttr.create("poseTargetComponents", "ptc", MFnData::kIntArray);
+    // Components/delta are indexed by geometry (input) index
+    aPoseTargetComponents = tAttr.create("poseTargetGeomComponents", "ptgc", MFnData::kIntArray);
+    tAttr.setArray(true);
+    tAttr.setHidden(true);
+    aPoseTargetDelta = tAttr.create("poseTargetGeomDelta", "ptgd", MFnData::kVectorArray);
+    tAttr.setArray(true);
+    tAttr.setHidden(true);
+    // Single geometry components/delta of older scenes, only read to upgrade them
+    aLegacyPoseTargetComponents = tAttr.create("poseTargetComponents", "ptc", MFnData::kIntArray);
     tAttr.setHidden(true);
-    aPoseTargetDelta = tAttr.create("poseTargetDelta", "ptd", MFnData::kVectorArray);
+    aLegacyPoseTargetDelta = tAttr.create("poseTargetDelta", "ptd", MFnData::kVectorArray);
     tAttr.setHidden(true);
     aPoseTarget = cAttr.create("poseTarget", "pt");
     cAttr.setArray(true);
@@ -178,6 +314,8 @@ MStatus PoseSpaceDeformer::initialize()
     cAttr.addChild(aPoseTargetEnvelope);
     cAttr.addChild(aPoseTargetComponents);
     cAttr.addChild(aPoseTargetDelta);
+    cAttr.addChild(aLegacyPoseTargetComponents);
+    cAttr.addChild(aLegacyPoseTargetDelta);
 
     aPose = cAttr.create("pose", "p");
     cAttr.setArray(true);
@@ -190,31 +328,248 @@ MStatus PoseSpaceDeformer::initialize()
     cAttr.setHidden(true);
     addAttribute(aPose);
 
-    aSkinClusterWeights = nAttr.create("skinClusterWeights", "scw", MFnNumericData::kDouble);
+    aSkinClusterWeights = nAttr.create("geomWeights", "gw", MFnNumericData::kDouble);
     nAttr.setArray(true);
     nAttr.setHidden(true);
 
-    aSkinClusterWeightList = cAttr.create("skinClusterWeightList", "scwl");
+    aSkinClusterWeightList = cAttr.create("geomWeightList", "gwl");
     cAttr.setArray(true);
     cAttr.addChild(aSkinClusterWeights);
     cAttr.setHidden(true);
-    addAttribute(aSkinClusterWeightList);
+
+    // skinCluster matrix/bindPreMatrix, connected so deform never walks the graph
+    aSkinClusterMatrix = mAttr.create("geomMatrix", "gm");
+    mAttr.setArray(true);
+    mAttr.setHidden(true);
+
+    aSkinClusterBindPreMatrix = mAttr.create("geomBindPreMatrix", "gbpm");
+    mAttr.setArray(true);
+    mAttr.setHidden(true);
+
+    // One skinCluster per geometry, indexed by geometry (input) index
+    aSkinCluster = cAttr.create("skinCluster", "sc");
+    cAttr.setArray(true);
+    cAttr.addChild(aSkinClusterWeightList);
+    cAttr.addChild(aSkinClusterMatrix);
+    cAttr.addChild(aSkinClusterBindPreMatrix);
+    cAttr.setHidden(true);
+    addAttribute(aSkinCluster);
+
+    // Single skinCluster weightList connection of older scenes, only read to
+    // upgrade them
+    aLegacySkinClusterWeights = nAttr.create("skinClusterWeights", "scw", MFnNumericData::kDouble);
+    nAttr.setArray(true);
+    nAttr.setHidden(true);
+
+    aLegacySkinClusterWeightList = cAttr.create("skinClusterWeightList", "scwl");
+    cAttr.setArray(true);
+    cAttr.addChild(aLegacySkinClusterWeights);
+    cAttr.setHidden(true);
+    addAttribute(aLegacySkinClusterWeightList);
+
+    // Pose library to page targets in from when streamTargets is on, poseTarget
+    // components/delta attributes are ignored then
+    aPoseLibraryFile = tAttr.create("poseLibraryFile", "plf", MFnData::kString);
+    tAttr.setUsedAsFilename(true);
+    addAttribute(aPoseLibraryFile);
+
+    aStreamTargets = nAttr.create("streamTargets", "stt", MFnNumericData::kBoolean, false);
+    addAttribute(aStreamTargets);
+
+    // Megabytes of streamed targets kept resident
+    aTargetMemoryBudget = nAttr.create("targetMemoryBudget", "tmb", MFnNumericData::kInt, 1024);
+    nAttr.setMin(0);
+    addAttribute(aTargetMemoryBudget);
+
+    // World space length under which target deltas are dropped when
+    // poseSpaceCommand sets targets. Authoring only, doesnt affect deform
+    aPruneThreshold = nAttr.create("pruneThreshold", "prt", MFnNumericData::kDouble, 0.0);
+    nAttr.setMin(0.0);
+    addAttribute(aPruneThreshold);
+
+    // Factor all targets of a geometry into rank basis shapes, keeping the
+    // relative (Frobenius) error under compressionError. Not used when streaming
+    aCompressionMode = eAttr.create("compressionMode", "cpm", COMPRESSION_NONE);
+    eAttr.addField( "None", COMPRESSION_NONE );
+    eAttr.addField( "PCA", COMPRESSION_PCA );
+    addAttribute(aCompressionMode);
+
+    aCompressionError = nAttr.create("compressionError", "cpe", MFnNumericData::kDouble, 0.01);
+    nAttr.setMin(0.0);
+    nAttr.setMax(1.0);
+    addAttribute(aCompressionError);
+
+    // Highest rank over the compressed geometries
+    aCompressionRank = nAttr.create("compressionRank", "cpr", MFnNumericData::kInt, 0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aCompressionRank);
+
+    // Live sculpt of a pose target. sculptDelta is the current skin space
+    // offset of each of sculptComponents (touched vertices only), components
+    // left out keep their last offset. Changing pose/target/geometry clears it
+    aSculptPose = nAttr.create("sculptPose", "scp", MFnNumericData::kInt, -1);
+    nAttr.setStorable(false);
+    addAttribute(aSculptPose);
+
+    aSculptTarget = nAttr.create("sculptTarget", "sct", MFnNumericData::kInt, -1);
+    nAttr.setStorable(false);
+    addAttribute(aSculptTarget);
+
+    aSculptGeometry = nAttr.create("sculptGeometry", "scg", MFnNumericData::kInt, 0);
+    nAttr.setStorable(false);
+    addAttribute(aSculptGeometry);
+
+    aSculptComponents = tAttr.create("sculptComponents", "scc", MFnData::kIntArray);
+    tAttr.setStorable(false);
+    tAttr.setHidden(true);
+    addAttribute(aSculptComponents);
+
+    aSculptDelta = tAttr.create("sculptDelta", "scd", MFnData::kVectorArray);
+    tAttr.setStorable(false);
+    tAttr.setHidden(true);
+    addAttribute(aSculptDelta);
+
+    // Stats of the last evaluation, times in milliseconds. Written along
+    // with outputGeom and dirtied with it, reading one evaluates outputGeom.
+    // The cache hit rate is the share of deforms replayed since the node was
+    // created
+    aStatsEvaluationTime = nAttr.create("statsEvaluationTime", "sev", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsEvaluationTime);
+
+    aStatsSolveTime = nAttr.create("statsSolveTime", "sso", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsSolveTime);
+
+    aStatsAccumulateTime = nAttr.create("statsAccumulateTime", "sat", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsAccumulateTime);
+
+    aStatsSkinTime = nAttr.create("statsSkinTime", "ssk", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsSkinTime);
+
+    aStatsWriteTime = nAttr.create("statsWriteTime", "swt", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsWriteTime);
+
+    aStatsActivePoses = nAttr.create("statsActivePoses", "sap", MFnNumericData::kInt, 0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsActivePoses);
+
+    aStatsTouchedVertices = nAttr.create("statsTouchedVertices", "stv", MFnNumericData::kInt, 0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsTouchedVertices);
+
+    aStatsCacheHitRate = nAttr.create("statsCacheHitRate", "shr", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsCacheHitRate);
+
+    // Solved pose weights, indexed by pose logical index. Deform and the
+    // poseWeight plugs read the solve from here
+    aPoseWeights = nAttr.create("poseWeights", "pws", MFnNumericData::kDouble, 0.0);
+    nAttr.setArray(true);
+    nAttr.setUsesArrayDataBuilder(true);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    nAttr.setHidden(true);
+    addAttribute(aPoseWeights);
+
+    // Sparse list of poses with non-zero weight * poseEnvelope, solved along
+    // with poseWeights. Deform only walks these
+    aActivePoseIndices = tAttr.create("activePoseIndices", "api", MFnData::kIntArray);
+    tAttr.setWritable(false);
+    tAttr.setStorable(false);
+    tAttr.setHidden(true);
+    addAttribute(aActivePoseIndices);
+
+    aActivePoseWeights = tAttr.create("activePoseWeights", "apw", MFnData::kDoubleArray);
+    tAttr.setWritable(false);
+    tAttr.setStorable(false);
+    tAttr.setHidden(true);
+    addAttribute(aActivePoseWeights);
 
 
+    attributeAffects(aIncludeTwist, aPoseWeights);
+    attributeAffects(aJointInputMode, aPoseWeights);
+    attributeAffects(aJoint, aPoseWeights);
+    attributeAffects(aPose, aPoseWeights);
+
+    attributeAffects(aIncludeTwist, aActivePoseIndices);
+    attributeAffects(aJointInputMode, aActivePoseIndices);
+    attributeAffects(aJoint, aActivePoseIndices);
+    attributeAffects(aPose, aActivePoseIndices);
+
+    attributeAffects(aIncludeTwist, aActivePoseWeights);
+    attributeAffects(aJointInputMode, aActivePoseWeights);
+    attributeAffects(aJoint, aActivePoseWeights);
+    attributeAffects(aPose, aActivePoseWeights);
+
     attributeAffects(aIncludeTwist, outputGeom);
+    attributeAffects(aJointInputMode, outputGeom);
     attributeAffects(aJoint, outputGeom);
     attributeAffects(aPose, outputGeom);
-    attributeAffects(aSkinClusterWeightList, outputGeom);
+    attributeAffects(aSkinCluster, outputGeom);
+    attributeAffects(aPoseLibraryFile, outputGeom);
+    attributeAffects(aStreamTargets, outputGeom);
+    attributeAffects(aTargetMemoryBudget, outputGeom);
+    attributeAffects(aCompressionMode, outputGeom);
+    attributeAffects(aCompressionError, outputGeom);
+    attributeAffects(aSculptPose, outputGeom);
+    attributeAffects(aSculptTarget, outputGeom);
+    attributeAffects(aSculptGeometry, outputGeom);
+    attributeAffects(aSculptComponents, outputGeom);
+    attributeAffects(aSculptDelta, outputGeom);
+
+    attributeAffects(outputGeom, aStatsEvaluationTime);
+    attributeAffects(outputGeom, aStatsSolveTime);
+    attributeAffects(outputGeom, aStatsAccumulateTime);
+    attributeAffects(outputGeom, aStatsSkinTime);
+    attributeAffects(outputGeom, aStatsWriteTime);
+    attributeAffects(outputGeom, aStatsActivePoses);
+    attributeAffects(outputGeom, aStatsTouchedVertices);
+    attributeAffects(outputGeom, aStatsCacheHitRate);
 
     attributeAffects(aIncludeTwist, aPoseWeight);
+    attributeAffects(aJointInputMode, aPoseWeight);
     attributeAffects(aJoint, aPoseWeight);
     attributeAffects(aPoseJoint, aPoseWeight);
+    attributeAffects(aPoseWeights, aPoseWeight);
 
     return MStatus::kSuccess;
 
 }
 
 
+// Inputs of deform that the output fingerprint doesnt hash, any edit of them
+// bumps _generation instead. Points, joint matrices and envelope are hashed,
+// active poses compared as is
+const MObject* const PoseSpaceDeformer::GenerationPlugs[] = {
+    &aPose, &aPoseTarget, &aPoseTargetEnvelope, &aPoseTargetComponents, &aPoseTargetDelta,
+    &aSkinClusterWeightList, &aSkinClusterWeights, &weightList, &weights,
+    &aStreamTargets, &aPoseLibraryFile, &aTargetMemoryBudget, &aCompressionMode, &aCompressionError,
+    &aSculptPose, &aSculptTarget, &aSculptGeometry, &aSculptComponents, &aSculptDelta };
+
+bool PoseSpaceDeformer::isGenerationPlug( const MPlug& plug )
+{
+    for (unsigned i = 0; i < GENERATION_PLUG_COUNT; ++i)
+    {
+        if (plug == *GenerationPlugs[i])
+            return true;
+    }
+    return false;
+}
+
+
 MStatus PoseSpaceDeformer::setDependentsDirty(  const MPlug& plugBeingDirtied, 
                                                 MPlugArray& affectedPlugs )
 {
@@ -238,520 +593,1101 @@ MStatus PoseSpaceDeformer::setDependentsDirty(  const MPlug& plugBeingDirtied,
         plugBeingDirtied == aPoseJointFallOff )
         _posesDirty = true;
 
+    if (plugBeingDirtied == aPose ||
+        plugBeingDirtied == aPoseTarget ||
+        plugBeingDirtied == aPoseTargetComponents ||
+        plugBeingDirtied == aPoseTargetDelta ||
+        plugBeingDirtied == aCompressionMode ||
+        plugBeingDirtied == aCompressionError )
+        _targetsDirty = true;
+
+    if (plugBeingDirtied == aSkinCluster ||
+        plugBeingDirtied == aSkinClusterWeightList ||
+        plugBeingDirtied == aSkinClusterWeights )
+    {
+        for (GeomCacheMap::iterator iter = _geomCaches.begin(); iter != _geomCaches.end(); ++iter)
+            iter->second.weightsDirty = true;
+    }
+
+    if (plugBeingDirtied == aSculptComponents ||
+        plugBeingDirtied == aSculptDelta )
+        _sculptDirty = true;
+
+    if (isGenerationPlug(plugBeingDirtied))
+        ++_generation;
+
+    if (plugBeingDirtied == aPose ||
+        plugBeingDirtied == aPoseName ||
+        plugBeingDirtied == aPoseTarget ||
+        plugBeingDirtied == aPoseTargetName )
+        _namesDirty = true;
+
     return MPxDeformerNode::setDependentsDirty(plugBeingDirtied, affectedPlugs);
 }
 
-MStatus PoseSpaceDeformer::compute(const MPlug& plug, MDataBlock& block)
+
+#if MAYA_API_VERSION >= 201600
+// setDependentsDirty isnt called under the evaluation manager, flag the
+// pose/target/name caches from the dirty plugs of this evaluation instead,
+// with the same plugs as setDependentsDirty
+MStatus PoseSpaceDeformer::preEvaluation(   const MDGContext& context, 
+                                            const MEvaluationNode& evaluationNode )
 {
-    MStatus stat = calcPoseWeights(block);
-    MCheckStatus(stat, "");
+    if (!context.isNormal())
+        return MS::kSuccess;
 
-    return MPxDeformerNode::compute(plug, block);
-}
+    if (evaluationNode.dirtyPlugExists(aIncludeTwist) ||
+        evaluationNode.dirtyPlugExists(aJointAxis) ||
+        evaluationNode.dirtyPlugExists(aPose) ||
+        evaluationNode.dirtyPlugExists(aPoseIgnore) ||
+        evaluationNode.dirtyPlugExists(aPoseJoint) ||
+        evaluationNode.dirtyPlugExists(aPoseJointRot) ||
+        evaluationNode.dirtyPlugExists(aPoseJointRotX) ||
+        evaluationNode.dirtyPlugExists(aPoseJointRotY) ||
+        evaluationNode.dirtyPlugExists(aPoseJointRotZ) ||
+        evaluationNode.dirtyPlugExists(aPoseJointFallOff) )
+        _posesDirty = true;
+
+    if (evaluationNode.dirtyPlugExists(aPose) ||
+        evaluationNode.dirtyPlugExists(aPoseTarget) ||
+        evaluationNode.dirtyPlugExists(aPoseTargetComponents) ||
+        evaluationNode.dirtyPlugExists(aPoseTargetDelta) ||
+        evaluationNode.dirtyPlugExists(aCompressionMode) ||
+        evaluationNode.dirtyPlugExists(aCompressionError) )
+        _targetsDirty = true;
+
+    if (evaluationNode.dirtyPlugExists(aSkinCluster) ||
+        evaluationNode.dirtyPlugExists(aSkinClusterWeightList) ||
+        evaluationNode.dirtyPlugExists(aSkinClusterWeights) )
+    {
+        for (GeomCacheMap::iterator iter = _geomCaches.begin(); iter != _geomCaches.end(); ++iter)
+            iter->second.weightsDirty = true;
+    }
 
+    if (evaluationNode.dirtyPlugExists(aSculptComponents) ||
+        evaluationNode.dirtyPlugExists(aSculptDelta) )
+        _sculptDirty = true;
 
-MStatus PoseSpaceDeformer::calcPoseWeights( MDataBlock& block )
-{
-    MStatus stat;
-    MString msg;
-    MDataHandle handle;
-    MObject obj;
+    for (unsigned i = 0; i < GENERATION_PLUG_COUNT; ++i)
+    {
+        if (evaluationNode.dirtyPlugExists(*GenerationPlugs[i]))
+        {
+            ++_generation;
+            break;
+        }
+    }
 
-#ifdef _DEBUG
-    handle = block.inputValue(aDebug);
-    bool debug = handle.asBool();
+    if (evaluationNode.dirtyPlugExists(aPose) ||
+        evaluationNode.dirtyPlugExists(aPoseName) ||
+        evaluationNode.dirtyPlugExists(aPoseTarget) ||
+        evaluationNode.dirtyPlugExists(aPoseTargetName) )
+        _namesDirty = true;
+
+    return MS::kSuccess;
+}
+
+// All inputs arrive through the datablock and the caches are per node
+MPxNode::SchedulingType PoseSpaceDeformer::schedulingType() const
+{
+    return kParallel;
+}
 #endif
 
-    handle = block.inputValue(aIncludeTwist);
-    bool includeTwist = handle.asBool();
+MStatus PoseSpaceDeformer::compute(const MPlug& plug, MDataBlock& block)
+{
+    MStatus stat;
 
-    // Get current joint rotations and axis
-    RotationMap currJointRot;
-    std::map<int, short> jointAxis;
-    MArrayDataHandle jtArrHnd = block.inputArrayValue(aJoint);
-    for (unsigned i = 0; i < jtArrHnd.elementCount(); ++i, jtArrHnd.next())
+    // Solve pose weights only when poseWeights is pulled, deform and the
+    // per pose poseWeight plugs read the cached result from the datablock
+    if (plug == aPoseWeights ||
+        plug == aActivePoseIndices ||
+        plug == aActivePoseWeights)
     {
-        int jtIdx = jtArrHnd.elementIndex();
-        MDataHandle jtHnd = jtArrHnd.inputValue();
+        ProfileScope scope("calcPoseWeights", &_stats.solveTime);
 
-        handle = jtHnd.child(aJointAxis);
-        jointAxis[jtIdx] = handle.asShort();
+        stat = calcPoseWeights(block);
+        MCheckStatus(stat, "");
 
-        handle = jtHnd.child(aJointRot);
-        double3& data = handle.asDouble3();
-        MEulerRotation rot(data[0], data[1], data[2]);
+        return setPoseWeights(block);
+    }
 
-        currJointRot[jtIdx] = rot;
+    if (plug == aPoseWeight)
+    {
+        return setPoseWeightPlugs(block);
+    }
 
-#ifdef _DEBUG
-        if (debug)
+    // Stats are written by the outputGeom evaluation, run it through the
+    // datablock for the dirty geometries if a stat is read first
+    if (plug == aStatsEvaluationTime ||
+        plug == aStatsSolveTime ||
+        plug == aStatsAccumulateTime ||
+        plug == aStatsSkinTime ||
+        plug == aStatsWriteTime ||
+        plug == aStatsActivePoses ||
+        plug == aStatsTouchedVertices ||
+        plug == aStatsCacheHitRate )
+    {
+        MPlug pOutputGeom(thisMObject(), outputGeom);
+        MArrayDataHandle outputArrHnd = block.outputArrayValue(outputGeom);
+        for (unsigned i = 0; i < outputArrHnd.elementCount(); ++i, outputArrHnd.next())
         {
-            MString msg = "CurJoints: jtIdx: ";
-            msg += jtIdx;
-            MDebugPrint(msg);
+            MPlug pElement = pOutputGeom.elementByLogicalIndex(outputArrHnd.elementIndex());
+            if (block.isClean(pElement))
+                continue;
+
+            stat = compute(pElement, block);
+            MCheckStatus(stat, "");
         }
-#endif
-    }
 
+        return block.setClean(plug);
+    }
 
+    if (plug != outputGeom)
+        return MPxDeformerNode::compute(plug, block);
 
-    // If poses are dirty, recalculate pose2Pose weights
-    if (_posesDirty)
+    // Deform all geometries, then report the stages of this evaluation. The
+    // pose weight solve is pulled from within deform, if it runs at all
+    _stats = Stats();
+    double evaluationTime = 0;
     {
-        _posesDirty = false;
+        ProfileScope scope("poseSpaceDeformer", &evaluationTime);
 
-        // Collect all pose joint rotations values
-        _poses.clear();
-        MArrayDataHandle arrHnd = block.inputArrayValue(aPose);
-        for (unsigned i = 0; i < arrHnd.elementCount(); ++i, arrHnd.next())
-        {
-            handle = arrHnd.inputValue();
+        stat = MPxDeformerNode::compute(plug, block);
+        MCheckStatus(stat, "");
+    }
 
-            bool ignore = handle.child(aPoseIgnore).asBool();
+    MDataHandle handle = block.outputValue(aStatsEvaluationTime);
+    handle.setDouble(evaluationTime);
+    handle.setClean();
 
-            handle = handle.child(aPoseJoint);
-            MArrayDataHandle jtArrHnd(handle);
+    handle = block.outputValue(aStatsSolveTime);
+    handle.setDouble(_stats.solveTime);
+    handle.setClean();
 
-            PoseJointMap jtMap;
-            for (unsigned j = 0; j < jtArrHnd.elementCount(); ++j, jtArrHnd.next())
-            {
-                handle = jtArrHnd.inputValue();
-                handle = handle.child(aPoseJointRot);
-                double3& data = handle.asDouble3();
-                MEulerRotation rot(data[0], data[1], data[2]);
+    handle = block.outputValue(aStatsAccumulateTime);
+    handle.setDouble(_stats.accumulateTime);
+    handle.setClean();
 
-                handle = jtArrHnd.inputValue();
-                handle = handle.child(aPoseJointFallOff);
-                float fallOff = handle.asFloat();
+    handle = block.outputValue(aStatsSkinTime);
+    handle.setDouble(_stats.skinTime);
+    handle.setClean();
 
-                jtMap[jtArrHnd.elementIndex()] = PoseJoint(rot, fallOff);
+    handle = block.outputValue(aStatsWriteTime);
+    handle.setDouble(_stats.writeTime);
+    handle.setClean();
 
-#ifdef _DEBUG
-                if (debug)
-                {
-                    MString msg = "Collect posesJts: pose: ";
-                    msg += i;
-                    msg += ", joint: ";
-                    msg += jtArrHnd.elementIndex();
-                    msg += ", rot: ";
-                    msg += MVector2Str(rot);
-                    msg += ", fallOff: ";
-                    msg += fallOff;
-                    MDebugPrint(msg);
-                }
-#endif
-            }
+    handle = block.outputValue(aStatsActivePoses);
+    handle.setInt(_stats.activePoses);
+    handle.setClean();
 
-            PoseInfo pi;
-            pi.jtMap = jtMap;
-            pi.ignore = ignore;
-            _poses.push_back(pi);
-        }
+    handle = block.outputValue(aStatsTouchedVertices);
+    handle.setInt(_stats.touchedVertices);
+    handle.setClean();
 
-        // pose-2-pose weights: For each pose, check how far is its poseJointRotations are from other poses
-        if (_poses.size() == 0)
-            return MS::kSuccess;
+    handle = block.outputValue(aStatsCacheHitRate);
+    handle.setDouble(_deforms ? (double)_replays / _deforms : 0.0);
+    handle.setClean();
 
+    return MS::kSuccess;
+}
 
-        _pose2PoseWeights.clear();
-        _pose2PoseWeights.resize(_poses.size());
-        for (unsigned i = 0; i < _poses.size(); ++i)
-        {
-            _pose2PoseWeights[i].setLength((unsigned)_poses.size());
 
-            // Same pose
-            _pose2PoseWeights[i][i] = 1;
+// Write solved weights onto poseWeights, keyed by pose logical index, and the
+// (poseIndex, weight * poseEnvelope) pairs of firing poses onto activePose*
+MStatus PoseSpaceDeformer::setPoseWeights( MDataBlock& block )
+{
+    MStatus stat;
 
-#ifdef _DEBUG
-            if (debug)
-            {
-                MString msg = "Pose2PoseWts: posei: ";
-                msg += i;
-                MDebugPrint(msg);
-            }
-#endif
+    MIntArray& activeIndices = _solveIndices;
+    MDoubleArray& activeWeights = _solveWeights;
 
-            if (i+1 == _poses.size())
-                break;
+    MArrayDataHandle wtArrHnd = block.outputArrayValue(aPoseWeights);
+    MArrayDataBuilder builder(&block, aPoseWeights, (unsigned)_poses.size(), &stat);
+    MCheckStatus(stat, "");
 
-            // Other poses
-            for (unsigned j = i+1; j < _poses.size(); ++j)
-            {
-                _pose2PoseWeights[j].setLength((unsigned)_poses.size());
+    for (unsigned i = 0; i < _poses.size(); ++i)
+    {
+        MDataHandle wtHnd = builder.addElement(_poseIndices[i], &stat);
+        MCheckStatus(stat, "");
+        wtHnd.setDouble(_poseWeights[i]);
 
-#ifdef _DEBUG
-                if (debug)
-                {
-                    MString msg = "Pose2PoseWts: posei: ";
-                    msg += i;
-                    msg += ", posej: ";
-                    msg += j;
-                    MDebugPrint(msg);
-                }
-#endif
+        // Start paging in targets of poses on the way in
+        if (_streamer.isOpen())
+        {
+            double& prevWeight = _prevPoseWeights[_poseIndices[i]];
+            if (_poseWeights[i] > prevWeight)
+                _streamer.prefetch(_poseIndices[i]);
+            prevWeight = _poseWeights[i];
+        }
 
-                double weightij = 1;
-                double weightji = 1;                
-                for (PoseJointMap::const_iterator iter1 = _poses[i].jtMap.begin(); iter1 != _poses[i].jtMap.end(); ++iter1)
-                {
-                    // If joint in pose[i] matches pose[j], calc distance, else return distance as -1
-                    int jtIdx = iter1->first;
-                    PoseJointMap::const_iterator iter2 = _poses[j].jtMap.find(jtIdx);
+    }
 
-                    if (iter2 == _poses[j].jtMap.end() || _poses[i].ignore || _poses[j].ignore)
-                    {
-                        // Distance cannot be found between poses because of different poseJoints between them
-                        weightij = 0;
-                        weightji = 0;
-                        break;
-                    }
-                    else
-                    {
-                        // PoseJoint of ith pose
-                        MEulerRotation rot1 = iter1->second.rotation;
-                        float fallOff1 = iter1->second.fallOff;
-
-                        // PoseJoint of jth pose
-                        MEulerRotation rot2 = iter2->second.rotation;
-                        float fallOff2 = iter2->second.fallOff;
-
-                        // axis/twist Angle between poseJoints
-                        double angle, axisAngle, twistAngle = 0;
-                        {
-                            // Axis angle
-                            short primeAxis = jointAxis[jtIdx];
-                            MVector axis = AxisVec[primeAxis];
-                            MVector axis1 = axis * rot1.asMatrix();
-                            MVector axis2 = axis * rot2.asMatrix();
-                            axisAngle = axis1.angle(axis2);
-
-                            if (includeTwist)
-                            {
-                                // Twist angle
-                                MVector up = UpVec[primeAxis];
-                                MVector up1 = up * rot1.asMatrix();
-                                MVector up2 = up * rot2.asMatrix();
-
-                                // Find rotation to align axis1 to axis2
-                                MVector orthoAxis = axis1 ^ axis2;
-                                orthoAxis.normalize();
-
-                                // Rotate the z axis, get the twist vec
-                                MQuaternion qr( axisAngle, orthoAxis );
-                                MVector twistVec = up1.rotateBy( qr );
-                                twistAngle = twistVec.angle( up2 );
-                            }
-
-                            axisAngle = RAD2DEG(axisAngle);
-                            twistAngle = RAD2DEG(twistAngle);
-                            angle = axisAngle + twistAngle;
-                        }
+    stat = wtArrHnd.set(builder);
+    MCheckStatus(stat, "");
+    wtArrHnd.setAllClean();
 
+    activePoses(block, activeIndices, activeWeights);
 
-#ifdef _DEBUG
-                        if (debug)
-                        {
-                            MString msg = "Pose2PoseWts: posei: ";
-                            msg += i;
-                            msg += ", posej: ";
-                            msg += j;
-                            msg += ", jtIdx: ";
-                            msg += jtIdx;
-                            msg += ", rot1: ";
-                            msg += MVector2Str(rot1);
-                            msg += ", fallOff1: ";
-                            msg += fallOff1;
-                            msg += ", rot2: ";
-                            msg += MVector2Str(rot2);
-                            msg += ", fallOff2: ";
-                            msg += fallOff2;
-                            msg += ", axisAngle: ";
-                            msg += axisAngle;
-                            msg += ", twistAngle: ";
-                            msg += twistAngle;
-                            msg += ", angle: ";
-                            msg += angle;
-                            MDebugPrint(msg);
-                        }
-#endif
-                        // Accumulate pose weight using weight of this joint (dist/fallOff)
-                        if (angle < fallOff2)
-                            weightij *= 1 - angle / fallOff2;
-                        else
-                            weightij = 0;
-
-                        if (angle < fallOff1)
-                            weightji *= 1 - angle / fallOff1;
-                        else
-                            weightji = 0;
-                    }
-                }
+    MFnIntArrayData fnIntArrData;
+    MObject obj = fnIntArrData.create(activeIndices);
+    MDataHandle handle = block.outputValue(aActivePoseIndices);
+    handle.set(obj);
+    handle.setClean();
 
+    MFnDoubleArrayData fnDoubleArrData;
+    obj = fnDoubleArrData.create(activeWeights);
+    handle = block.outputValue(aActivePoseWeights);
+    handle.set(obj);
+    handle.setClean();
 
-#ifdef _DEBUG
-                if (debug)
-                {
-                    MString msg = "Pose2PoseWts: posei: ";
-                    msg += i;
-                    msg += ", posej: ";
-                    msg += j;
-                    msg += ", weightij: ";
-                    msg += weightij;
-                    msg += ", weightji: ";
-                    msg += weightji;
-                    MDebugPrint(msg);
-                }
-#endif
-                _pose2PoseWeights[i][j] = weightij;
-                _pose2PoseWeights[j][i] = weightji;
-            }
-        }
+    return MS::kSuccess;
+}
 
-#ifdef _DEBUG
-        if (debug)
-        {
-            char buf[1024] = "";
-            MDebugPrint("Pose2PoseWts:================");
-            for (unsigned i = 0; i < _pose2PoseWeights.size(); ++i)
-                SPRINTF(buf, "%s%8d", buf, i);
-            MDebugPrint(buf);
-            for (unsigned i = 0; i < _pose2PoseWeights.size(); ++i)
-            {
-                SPRINTF(buf, "%2d", i);
-                for (unsigned j = 0; j < _pose2PoseWeights.size(); ++j)
-                    SPRINTF(buf, "%s%8.3f", buf, _pose2PoseWeights[i][j]);
-                MDebugPrint(buf);
-            }
-            MDebugPrint("=============================");
-        }
-#endif
 
-        // Re-weight pose2PoseWeights using Scattered Data Interpolation (solve Ax = B)
-        {
-            unsigned n = (unsigned)_pose2PoseWeights.size();
+// (poseIndex, weight * poseEnvelope) pairs of the poses firing at the solved
+// _poseWeights
+void PoseSpaceDeformer::activePoses( MDataBlock& block, MIntArray& activeIndices, MDoubleArray& activeWeights )
+{
+    activeIndices.clear();
+    activeWeights.clear();
 
-            MatrixXf a(n, n);
-            MatrixXf b(n, n);
-            for (unsigned i = 0; i < n; ++i)
-                for (unsigned j = 0; j < n; ++j)
-                {
-                    a(i, j) = (float)_pose2PoseWeights[i][j];
-                    b(i, j) = i == j;
-                }
+    MArrayDataHandle poseArrHnd = block.inputArrayValue(aPose);
+    for (unsigned i = 0; i < _poseWeights.size(); ++i)
+    {
+        if (_poseWeights[i] < FLOAT_TOLERANCE)
+            continue;
 
-            cerr << "Num poses:\n" << n << endl;
-            cerr << "Here is the matrix a:\n" << a << endl;
-            cerr << "Here is the right hand side b:\n" << b << endl;
+        if (poseArrHnd.jumpToElement(_poseIndices[i]) != MS::kSuccess)
+            continue;
 
-            MatrixXf x = a.colPivHouseholderQr().solve(b);
+        float poseEnv = poseArrHnd.inputValue().child(aPoseEnvelope).asFloat();
+        if (fabs(poseEnv) < FLOAT_TOLERANCE)
+            continue;
 
-            cerr << "The solution is:\n" << x << endl;
+        activeIndices.append(_poseIndices[i]);
+        activeWeights.append(_poseWeights[i] * poseEnv);
+    }
+}
 
 
-            for (unsigned i = 0; i < n; ++i)
-                for (unsigned j = 0; j < n; ++j)
-                    _pose2PoseWeights[i][j] = x(i, j);
-        }
+// Copy the cached poseWeights onto each pose's poseWeight plug
+MStatus PoseSpaceDeformer::setPoseWeightPlugs( MDataBlock& block )
+{
+    MArrayDataHandle wtArrHnd = block.inputArrayValue(aPoseWeights);
 
+    MArrayDataHandle poseArrHnd = block.outputArrayValue(aPose);
+    for(unsigned i = 0; i < poseArrHnd.elementCount(); ++i, poseArrHnd.next())
+    {
+        double weight = 0;
+        if (wtArrHnd.jumpToElement(poseArrHnd.elementIndex()) == MS::kSuccess)
+            weight = wtArrHnd.inputValue().asDouble();
 
+        MDataHandle poseHnd = poseArrHnd.outputValue();
+        MDataHandle wtHnd = poseHnd.child(aPoseWeight);
 
-#ifdef _DEBUG
-        if (debug)
-        {
-            char buf[1024] = "";
-            MDebugPrint("Pose2PoseWts:================");
-            for (unsigned i = 0; i < _pose2PoseWeights.size(); ++i)
-                SPRINTF(buf, "%s%8d", buf, i);
-            MDebugPrint(buf);
-            for (unsigned i = 0; i < _pose2PoseWeights.size(); ++i)
-            {
-                SPRINTF(buf, "%2d", i);
-                for (unsigned j = 0; j < _pose2PoseWeights.size(); ++j)
-                    SPRINTF(buf, "%s%8.3f", buf, _pose2PoseWeights[i][j]);
-                MDebugPrint(buf);
-            }
-            MDebugPrint("=============================");
-        }
-#endif
+        wtHnd.setFloat((float)weight);
+        wtHnd.setClean();
     }
 
-    _poseWeights.setLength((unsigned)_poses.size());
+    return MS::kSuccess;
+}
 
-    // No poses, return
-    if (_poses.size() == 0)
-        return MS::kSuccess;
 
+// Copy pose target components/deltas off the datablock into each geometry's
+// packed cache, so deform can go straight to the targets of an active pose
+MStatus PoseSpaceDeformer::cachePoseTargets( MDataBlock& block )
+{
+    MDataHandle handle;
+    MObject obj;
 
+    for (GeomCacheMap::iterator iter = _geomCaches.begin(); iter != _geomCaches.end(); ++iter)
+    {
+        GeomCache& cache = iter->second;
+        cache.poseTargets.clear();
+        cache.components.clear();
+        cache.deltas.clear();
+        cache.numComponents = 0;
+        cache.numTargets = 0;
+        cache.columns.clear();
+        cache.compressed = false;
+    }
 
-    // pose-2-currJoints weights: For each pose, check how far is poseJointRotations are from current jointRotations
-    MDoubleArray pose2CurrJointWeights((unsigned)_poses.size());
-    for (unsigned i = 0; i < _poses.size(); ++i)
+    MArrayDataHandle poseArrHnd = block.inputArrayValue(aPose);
+    for(unsigned i = 0; i < poseArrHnd.elementCount(); ++i, poseArrHnd.next())
     {
-        double weight = 1;
-        for (PoseJointMap::const_iterator iter = _poses[i].jtMap.begin(); iter != _poses[i].jtMap.end(); ++iter)
+        int poseIndex = poseArrHnd.elementIndex();
+        MDataHandle poseHnd = poseArrHnd.inputValue();
+
+        MArrayDataHandle poseTargetArrHnd(poseHnd.child(aPoseTarget));
+        for(unsigned j = 0; j < poseTargetArrHnd.elementCount(); ++j, poseTargetArrHnd.next())
         {
-            if (_poses[i].ignore)
+            MDataHandle poseTargetHnd = poseTargetArrHnd.inputValue();
+
+            MArrayDataHandle compArrHnd(poseTargetHnd.child(aPoseTargetComponents));
+            MArrayDataHandle deltaArrHnd(poseTargetHnd.child(aPoseTargetDelta));
+            for(unsigned k = 0; k < compArrHnd.elementCount(); ++k, compArrHnd.next())
             {
-                weight = 0;
-                break;
-            }
+                unsigned geomIndex = compArrHnd.elementIndex();
+                if (deltaArrHnd.jumpToElement(geomIndex) != MS::kSuccess)
+                    continue;
 
-            int jtIdx = iter->first;
-            const PoseJoint& poseJt = iter->second;
+                obj = compArrHnd.inputValue().data();
+                MIntArray& components = _componentBuffer;
+                MFnIntArrayData(obj).copyTo(components);
 
-            // axis/twist Angle between poseJoints
-            double angle, axisAngle, twistAngle = 0;
-            {
-                // Axis angle
-                short primeAxis = jointAxis[jtIdx];
-                MVector axis = AxisVec[primeAxis];
-                MVector axis1 = axis * currJointRot[jtIdx].asMatrix();
-                MVector axis2 = axis * poseJt.rotation.asMatrix();
-                axisAngle = axis1.angle(axis2);
-
-                if (includeTwist)
-                {
-                    // Twist angle
-                    MVector up = UpVec[primeAxis];
-                    MVector up1 = up * currJointRot[jtIdx].asMatrix();
-                    MVector up2 = up * poseJt.rotation.asMatrix();
-
-                    // Find rotation to align axis1 to axis2
-                    axis1.normalize();
-                    axis2.normalize();
-                    MVector orthoAxis = axis1 ^ axis2;
-                    orthoAxis.normalize();
-
-                    // Rotate the up axis, get the twist vec
-                    MQuaternion qr( axisAngle, orthoAxis );
-                    MVector twistVec = up1.rotateBy( qr );
-                    twistAngle = twistVec.angle( up2 );
-                }
+                obj = deltaArrHnd.inputValue().data();
+                MVectorArray& deltas = _deltaBuffer;
+                MFnVectorArrayData(obj).copyTo(deltas);
 
-                axisAngle = RAD2DEG(axisAngle);
-                twistAngle = RAD2DEG(twistAngle);
-                angle = axisAngle + twistAngle;
-            }
+                if (components.length() == 0 ||
+                    components.length() != deltas.length())
+                    continue;
 
-#ifdef _DEBUG
-            if (debug && angle < poseJt.fallOff)
-            {
-                MString msg = "Pose2CurrJointWts: pose: ";
-                msg += i;
-                msg += ", joint: ";
-                msg += jtIdx;
-
-                msg += ", currRot: ";
-                msg += MVector2Str(currJointRot[jtIdx]);
-                msg += ", poseRot: ";
-                msg += MVector2Str(poseJt.rotation);
-                msg += ", fallOff: ";
-                msg += poseJt.fallOff;
-                msg += ", axisAngle: ";
-                msg += axisAngle;
-                msg += ", twistAngle: ";
-                msg += twistAngle;                
-                msg += ", angle: ";
-                msg += angle;
-                msg += ", fallOff: ";
-                msg += poseJt.fallOff;
-                MDebugPrint(msg);
-            }
+                GeomCache& cache = _geomCaches[geomIndex];
+                if (cache.numTargets == 0)
+                    cache.numVertices = inputVertexCount(block, geomIndex);
 
-  
-#endif
-            if (angle < poseJt.fallOff)
-            {
-                double jtWeight = 1 - (angle / poseJt.fallOff);
-                weight *= jtWeight;
+                PoseTarget target;
+                target.index = poseTargetArrHnd.elementIndex();
+                target.begin = (unsigned)cache.components.size();
 
-#ifdef _DEBUG                
-                if (debug && fabs(weight) > 0.00001)
+                for (unsigned c = 0; c < components.length(); ++c)
                 {
-                    MString msg = "Pose2CurrJointWts: pose: ";
-                    msg += i;
-                    msg += ", joint: ";
-                    msg += jtIdx;
-                    msg += ", jtWeight: ";
-                    msg += jtWeight;                    
-                    msg += ", weight: ";
-                    msg += weight;
-                    MDebugPrint(msg);
+                    // Deltas are accumulated densely by component, targets
+                    // edited on another topology may hold vertices past this one
+                    if (components[c] < 0 || (unsigned)components[c] >= cache.numVertices)
+                        continue;
+
+                    cache.components.push_back(components[c]);
+                    cache.deltas.push_back(deltas[c]);
+
+                    if ((unsigned)components[c] >= cache.numComponents)
+                        cache.numComponents = components[c] + 1;
                 }
-#endif
+
+                target.end = (unsigned)cache.components.size();
+                target.column = cache.numTargets++;
+                cache.poseTargets[poseIndex].push_back(target);
+                cache.columns.push_back(target);
             }
+        }
+    }
+
+    for (GeomCacheMap::iterator iter = _geomCaches.begin(); iter != _geomCaches.end(); ++iter)
+    {
+        GeomCache& cache = iter->second;
+        cache.targetWeights.assign(cache.numTargets, 0.0);
+        cache.resetBase();
+    }
+
+    // Replace targets by their low rank form
+    int rank = 0;
+    if (block.inputValue(aCompressionMode).asShort() == COMPRESSION_PCA)
+    {
+        double maxError = block.inputValue(aCompressionError).asDouble();
+        for (GeomCacheMap::iterator iter = _geomCaches.begin(); iter != _geomCaches.end(); ++iter)
+        {
+            GeomCache& cache = iter->second;
+            cache.compress(maxError);
+
+            if (cache.compressed && (int)cache.rank > rank)
+                rank = cache.rank;
+        }
+    }
+
+    MDataHandle rankHnd = block.outputValue(aCompressionRank);
+    rankHnd.setInt(rank);
+    rankHnd.setClean();
+
+    _targetsDirty = false;
+
+    return MS::kSuccess;
+}
+
+
+// Number of vertices of an input geometry, not only the ones deformed
+unsigned PoseSpaceDeformer::inputVertexCount( MDataBlock& block, unsigned geomIndex )
+{
+    MArrayDataHandle inputArrHnd = block.inputArrayValue(input);
+    if (inputArrHnd.jumpToElement(geomIndex) != MS::kSuccess)
+        return 0;
+
+    MDataHandle geomHnd = inputArrHnd.inputValue().child(inputGeom);
+    MItGeometry itGeo(geomHnd, true);
+    return (unsigned)itGeo.count();
+}
+
+
+// Pack the skinCluster weightList of a geometry into CSR arrays
+MStatus PoseSpaceDeformer::cacheSkinWeights( MDataBlock& block, unsigned geomIndex )
+{
+    GeomCache& cache = _geomCaches[geomIndex];
+
+    cache.weightOffsets.clear();
+    cache.weightJoints.clear();
+    cache.weightValues.clear();
+
+    MArrayDataHandle scArrHnd = block.inputArrayValue(aSkinCluster);
+    if (scArrHnd.jumpToElement(geomIndex) != MS::kSuccess)
+        MReturnFailure(ErrorStr::PSDSCNotConnected);
+
+    MArrayDataHandle wtListArrHnd(scArrHnd.inputValue().child(aSkinClusterWeightList));
+    for (unsigned i = 0; i < wtListArrHnd.elementCount(); ++i, wtListArrHnd.next())
+    {
+        // weightList elements come in vertex order, vertices without weights get an empty range
+        unsigned c = wtListArrHnd.elementIndex();
+        while (cache.weightOffsets.size() <= c)
+            cache.weightOffsets.push_back((unsigned)cache.weightJoints.size());
+
+        MArrayDataHandle wtArrHnd(wtListArrHnd.inputValue().child(aSkinClusterWeights));
+        for (unsigned j = 0; j < wtArrHnd.elementCount(); ++j, wtArrHnd.next())
+        {
+            double wt = wtArrHnd.inputValue().asDouble();
+            if (wt == 0)
+                continue;
+
+            cache.weightJoints.push_back(wtArrHnd.elementIndex());
+            cache.weightValues.push_back(wt);
+        }
+    }
+    cache.weightOffsets.push_back((unsigned)cache.weightJoints.size());
+
+    cache.weightsDirty = false;
+
+    return MS::kSuccess;
+}
+
+
+// Joint matrices of a geometry's skinCluster, bind to skin space, indexed by joint index
+MStatus PoseSpaceDeformer::getSkinMatrices( MDataBlock& block, unsigned geomIndex, const MMatrix& world, std::vector<MMatrix>& skinMatrices )
+{
+    MArrayDataHandle scArrHnd = block.inputArrayValue(aSkinCluster);
+    if (scArrHnd.jumpToElement(geomIndex) != MS::kSuccess)
+        MReturnFailure(ErrorStr::PSDSCNotConnected);
+
+    MDataHandle scHnd = scArrHnd.inputValue();
+    MArrayDataHandle jtMatArrHnd(scHnd.child(aSkinClusterMatrix));
+    MArrayDataHandle bindArrHnd(scHnd.child(aSkinClusterBindPreMatrix));
+    if (jtMatArrHnd.elementCount() == 0)
+        MReturnFailure(ErrorStr::PSDSCNotConnected);
+
+    skinMatrices.clear();
+
+    MMatrix worldInv = world.inverse();
+    for (unsigned i = 0; i < jtMatArrHnd.elementCount(); ++i, jtMatArrHnd.next())
+    {
+        unsigned jtIdx = jtMatArrHnd.elementIndex();
+        if (bindArrHnd.jumpToElement(jtIdx) != MS::kSuccess)
+            MReturnFailure(ErrorStr::PSDSCMatrixMismatch);
+
+        const MMatrix& bindInvMat = bindArrHnd.inputValue().asMatrix();
+        const MMatrix& jtMat = jtMatArrHnd.inputValue().asMatrix();
+
+        if (skinMatrices.size() <= jtIdx)
+            skinMatrices.resize(jtIdx + 1);
+        skinMatrices[jtIdx] = world * bindInvMat * jtMat * worldInv;
+    }
+
+    return MS::kSuccess;
+}
+
+
+// Index pose and target names off the plugs, used by the command only
+void PoseSpaceDeformer::buildNameIndex()
+{
+    _poseNameIndex.clear();
+    _targetNameIndex.clear();
+
+    MPlug pPoseArray(thisMObject(), aPose);
+    for (unsigned i = 0; i < pPoseArray.numElements(); ++i)
+    {
+        MPlug pPose = pPoseArray.elementByPhysicalIndex(i);
+        int poseIndex = pPose.logicalIndex();
+
+        _poseNameIndex[pPose.child(aPoseName).asString().asChar()] = poseIndex;
+
+        NameIndexMap& targetNames = _targetNameIndex[poseIndex];
+        MPlug pPoseTarget = pPose.child(aPoseTarget);
+        for (unsigned j = 0; j < pPoseTarget.numElements(); ++j)
+        {
+            MPlug pTarget = pPoseTarget.elementByPhysicalIndex(j);
+            targetNames[pTarget.child(aPoseTargetName).asString().asChar()] = pTarget.logicalIndex();
+        }
+    }
+
+    _namesDirty = false;
+}
+
+// Names edited without dirtying the node (e.g. under the evaluation manager)
+// are caught by rebuilding once on a miss
+int PoseSpaceDeformer::poseIndex( const MString& poseName )
+{
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        if (_namesDirty || i)
+            buildNameIndex();
+
+        NameIndexMap::const_iterator iter = _poseNameIndex.find(poseName.asChar());
+        if (iter != _poseNameIndex.end())
+            return iter->second;
+    }
+
+    return -1;
+}
+
+int PoseSpaceDeformer::poseTargetIndex( int poseIndex, const MString& targetName )
+{
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        if (_namesDirty || i)
+            buildNameIndex();
+
+        std::map<int, NameIndexMap>::const_iterator poseIter = _targetNameIndex.find(poseIndex);
+        if (poseIter == _targetNameIndex.end())
+            continue;
+
+        NameIndexMap::const_iterator iter = poseIter->second.find(targetName.asChar());
+        if (iter != poseIter->second.end())
+            return iter->second;
+    }
+
+    return -1;
+}
+
+
+bool PoseSpaceDeformer::sculptLayer( std::vector<int>& components, std::vector<MVector>& deltas ) const
+{
+    components = _sculptComponents;
+    deltas = _sculptDeltas;
+
+    return !_sculptDirty;
+}
+
+void PoseSpaceDeformer::clearSculpt()
+{
+    _sculpt.clear();
+    _sculptComponents.clear();
+    _sculptDeltas.clear();
+}
+
+
+// Convert sculpt input to bind space, only for components whose skin space
+// offset changed since the last evaluation. The input is the whole layer,
+// components it no longer has are dropped, so undo/redo of its plugs restore it
+MStatus PoseSpaceDeformer::updateSculpt( MDataBlock& block, unsigned geomIndex, const MMatrix& world, bool& skinReady )
+{
+    MStatus stat;
+    MObject obj;
+
+    int sculptPose = block.inputValue(aSculptPose).asInt();
+    int sculptTarget = block.inputValue(aSculptTarget).asInt();
+    int sculptGeometry = block.inputValue(aSculptGeometry).asInt();
+
+    if (sculptPose != _sculptPose || sculptTarget != _sculptTarget || sculptGeometry != _sculptGeometry)
+    {
+        clearSculpt();
+        _sculptPose = sculptPose;
+        _sculptTarget = sculptTarget;
+        _sculptGeometry = sculptGeometry;
+        _sculptDirty = true;
+    }
+
+    if (sculptPose < 0 || (int)geomIndex != sculptGeometry || !_sculptDirty)
+        return MS::kSuccess;
+
+    obj = block.inputValue(aSculptComponents).data();
+    MIntArray& components = _componentBuffer;
+    MFnIntArrayData(obj).copyTo(components);
+
+    obj = block.inputValue(aSculptDelta).data();
+    MVectorArray& deltas = _deltaBuffer;
+    MFnVectorArrayData(obj).copyTo(deltas);
+
+    _sculptDirty = false;
+
+    if (components.length() != deltas.length())
+        return MS::kSuccess;
+
+    if (components.length() == 0)
+    {
+        clearSculpt();
+        return MS::kSuccess;
+    }
+
+    GeomCache& cache = _geomCaches[geomIndex];
+    if (cache.weightsDirty)
+    {
+        stat = cacheSkinWeights(block, geomIndex);
+        MCheckStatus(stat, "");
+    }
+
+    stat = getSkinMatrices(block, geomIndex, world, cache.skinMatrices);
+    MCheckStatus(stat, "");
+    skinReady = true;
+
+    const unsigned numWeighted = (unsigned)cache.weightOffsets.size() - 1;
+    const unsigned numSkinMatrices = (unsigned)cache.skinMatrices.size();
+
+    bool changed = false;
+    for (unsigned i = 0; i < components.length(); ++i)
+    {
+        int c = components[i];
+        if (c < 0)
+            continue;
+
+        SculptMap::iterator iter = _sculpt.find(c);
+        if (iter != _sculpt.end() && iter->second.skinDelta == deltas[i])
+            continue;
+
+        SculptVertex& vertex = _sculpt[c];
+        vertex.skinDelta = deltas[i];
+        vertex.bindDelta = deltas[i];
+        changed = true;
+
+        if ((unsigned)c >= numWeighted)
+            continue;
+
+        // Skin matrix of the component, inverted to take the offset to bind space
+        Matrix3d skinMatrix = Matrix3d::Zero();
+        for (unsigned w = cache.weightOffsets[c]; w < cache.weightOffsets[c+1]; ++w)
+        {
+            unsigned jtIdx = cache.weightJoints[w];
+            if (jtIdx >= numSkinMatrices)
+                continue;
+
+            const MMatrix& jtMat = cache.skinMatrices[jtIdx];
+            double wt = cache.weightValues[w];
+            for (unsigned r = 0; r < 3; ++r)
+                for (unsigned k = 0; k < 3; ++k)
+                    skinMatrix(r, k) += jtMat(r, k) * wt;
+        }
+
+        Matrix3d skinInvMatrix;
+        bool invertible = false;
+        skinMatrix.computeInverseWithCheck(skinInvMatrix, invertible);
+        if (!invertible)
+            continue;
+
+        RowVector3d delta(deltas[i].x, deltas[i].y, deltas[i].z);
+        delta = delta * skinInvMatrix;
+        vertex.bindDelta = MVector(delta(0), delta(1), delta(2));
+    }
+
+    // Sorted copy only when components may have gone or repeat
+    if (_sculpt.size() != components.length())
+    {
+        std::vector<int> inputComponents(&components[0], &components[0] + components.length());
+        std::sort(inputComponents.begin(), inputComponents.end());
+
+        for (SculptMap::iterator iter = _sculpt.begin(); iter != _sculpt.end(); )
+        {
+            if (std::binary_search(inputComponents.begin(), inputComponents.end(), iter->first))
+                ++iter;
             else
             {
-                weight = 0;
-                break;
+                _sculpt.erase(iter++);
+                changed = true;
             }
         }
+    }
 
-#ifdef _DEBUG
-        if (debug && fabs(weight) > 0.00001)
+    if (!changed)
+        return MS::kSuccess;
+
+    _sculptComponents.clear();
+    _sculptDeltas.clear();
+    for (SculptMap::const_iterator iter = _sculpt.begin(); iter != _sculpt.end(); ++iter)
+    {
+        _sculptComponents.push_back(iter->first);
+        _sculptDeltas.push_back(iter->second.bindDelta);
+    }
+
+    return MS::kSuccess;
+}
+
+
+// Open poseLibraryFile for streaming if it changed, and apply the memory budget
+MStatus PoseSpaceDeformer::updateStreamer( MDataBlock& block )
+{
+    MString file = block.inputValue(aPoseLibraryFile).asString();
+    int budget = block.inputValue(aTargetMemoryBudget).asInt();
+
+    if (!_streamer.isOpen() || _streamer.path() != file.asChar())
+    {
+        std::string error;
+        if (!_streamer.open(file.asChar(), error))
+            MReturnFailure(error.c_str());
+
+        _prevPoseWeights.clear();
+    }
+
+    _streamer.setMemoryBudget((size_t)budget * 1024 * 1024);
+
+    return MS::kSuccess;
+}
+
+
+// Whether the active poses differ from the ones of the last deform
+bool PoseSpaceDeformer::GeomCache::activeChanged( const MIntArray& indices, const MDoubleArray& weights ) const
+{
+    if (indices.length() != activeIndices.length() || weights.length() != activeWeights.length())
+        return true;
+
+    for (unsigned i = 0; i < indices.length(); ++i)
+    {
+        if (indices[i] != activeIndices[i] || weights[i] != activeWeights[i])
+            return true;
+    }
+    return false;
+}
+
+// Add weighted target deltas into the dense delta, tracking touched components
+void PoseSpaceDeformer::GeomCache::accumulate( const int* targetComponents, const MVector* targetDeltas, unsigned count, double weight )
+{
+    if (count == 0)
+        return;
+
+    Deltas::accumulate(targetComponents, (const double*)targetDeltas, count, weight, (double*)&delta[0], &touched[0], touchedComponents);
+}
+
+void PoseSpaceDeformer::GeomCache::accumulateBase( const int* targetComponents, const MVector* targetDeltas, unsigned count, double weight )
+{
+    if (count == 0)
+        return;
+
+    Deltas::accumulate(targetComponents, (const double*)targetDeltas, count, weight, (double*)&baseDelta[0], &baseTouched[0], baseComponents);
+}
+
+void PoseSpaceDeformer::GeomCache::resetBase()
+{
+    for (unsigned i = 0; i < baseComponents.size(); ++i)
+        baseTouched[baseComponents[i]] = 0;
+    baseComponents.clear();
+
+    appliedWeights.assign(numTargets, 0.0);
+    evaluations = 0;
+}
+
+// Add (new - applied weight) x target for targets whose weight moved, from the
+// targetWeights of this evaluation. Periodically rebuilt to bound drift
+void PoseSpaceDeformer::GeomCache::updateBase()
+{
+    if (++evaluations > FULL_REBUILD_INTERVAL)
+        resetBase();
+
+    if (baseDelta.size() < numComponents)
+    {
+        baseDelta.resize(numComponents);
+        baseTouched.resize(numComponents, 0);
+    }
+
+    for (unsigned t = 0; t < numTargets; ++t)
+    {
+        double weight = targetWeights[t];
+        double change = weight - appliedWeights[t];
+
+        targetWeights[t] = 0;
+        if (fabs(change) <= WEIGHT_EPSILON && (weight != 0 || appliedWeights[t] == 0))
+            continue;
+
+        appliedWeights[t] = weight;
+        if (compressed)
         {
-            MString msg = "Pose2CurrJointWts: pose: ";
-            msg += i;
-            msg += ", weight: ";
-            msg += weight;
-            MDebugPrint(msg);
+            targetWeights[t] = change;
+            continue;
         }
-#endif
 
-        pose2CurrJointWeights[i] = weight;
+        const PoseTarget& target = columns[t];
+        accumulateBase(&components[target.begin], &deltas[target.begin], target.end - target.begin, change);
     }
 
+    if (compressed)
+        reconstruct();
+}
 
-    // Calculate final weights for each pose, from pose-2-currJoint weights re-weighted by pose2PoseWeights    
-    for (unsigned i = 0; i < _poses.size(); ++i)
+
+// Truncated SVD of the dense (3 x components) x targets delta matrix. Rank is
+// the smallest whose dropped singular values keep the relative error under
+// maxError, targets are then reconstructed from rank basis shapes
+void PoseSpaceDeformer::GeomCache::compress( double maxError )
+{
+    compressed = false;
+    basisComponents.clear();
+    basis.clear();
+    coefficients.clear();
+    rank = 0;
+
+    if (numTargets == 0)
+        return;
+
+    // Rows of the components any target moves
+    std::vector<int> rowOf(numComponents, -1);
+    for (unsigned k = 0; k < components.size(); ++k)
+        rowOf[components[k]] = 0;
+    for (unsigned c = 0; c < numComponents; ++c)
     {
-        double weight = 0;
-        for (unsigned j = 0; j < _poses.size(); ++j)
+        if (rowOf[c] == -1)
+            continue;
+        rowOf[c] = (int)basisComponents.size();
+        basisComponents.push_back(c);
+    }
+
+    const unsigned numRows = (unsigned)basisComponents.size() * 3;
+
+    MatrixXd targetMatrix = MatrixXd::Zero(numRows, numTargets);
+    for (PoseTargetMap::const_iterator iter = poseTargets.begin(); iter != poseTargets.end(); ++iter)
+    {
+        const std::vector<PoseTarget>& targets = iter->second;
+        for (unsigned j = 0; j < targets.size(); ++j)
         {
-            double wt = pose2CurrJointWeights[j] * _pose2PoseWeights[j][i];
+            const PoseTarget& target = targets[j];
+            for (unsigned k = target.begin; k < target.end; ++k)
+            {
+                int row = rowOf[components[k]] * 3;
+                targetMatrix(row, target.column) = deltas[k].x;
+                targetMatrix(row+1, target.column) = deltas[k].y;
+                targetMatrix(row+2, target.column) = deltas[k].z;
+            }
+        }
+    }
+
+    BDCSVD<MatrixXd> svd(targetMatrix, ComputeThinU | ComputeThinV);
+    const VectorXd& singularValues = svd.singularValues();
+
+    const double maxDropped = maxError * maxError * singularValues.squaredNorm();
+    double dropped = 0;
+    unsigned k = (unsigned)singularValues.size();
+    while (k > 1 && dropped + singularValues(k-1) * singularValues(k-1) <= maxDropped)
+    {
+        dropped += singularValues(k-1) * singularValues(k-1);
+        --k;
+    }
+    rank = k;
+
+    basis.resize(numRows * rank);
+    Map<MatrixXd>(&basis[0], numRows, rank) = svd.matrixU().leftCols(rank) * singularValues.head(rank).asDiagonal();
+
+    coefficients.resize(rank * numTargets);
+    Map<MatrixXd>(&coefficients[0], rank, numTargets) = svd.matrixV().leftCols(rank).transpose();
+
+    basisDelta.resize(basisComponents.size());
+
+    // Memory goes with rank from here on
+    std::vector<int>().swap(components);
+    std::vector<MVector>().swap(deltas);
+    compressed = true;
+}
+
+// Target weight changes to rank coefficients to one basis mat-vec, added to
+// the base delta. Clears targetWeights for the next evaluation
+void PoseSpaceDeformer::GeomCache::reconstruct()
+{
+    const unsigned numRows = (unsigned)basisComponents.size() * 3;
+
+    Map<VectorXd> weights(&targetWeights[0], numTargets);
+    VectorXd basisWeights = Map<const MatrixXd>(&coefficients[0], rank, numTargets) * weights;
+    weights.setZero();
+
+    if (basisWeights.isZero(0.0))
+        return;
+
+    Map<VectorXd>(&basisDelta[0].x, numRows) = Map<const MatrixXd>(&basis[0], numRows, rank) * basisWeights;
+
+    accumulateBase(&basisComponents[0], &basisDelta[0], (unsigned)basisComponents.size(), 1.0);
+}
+
+
+// Rotation of a joint element in jointRot space, read as per jointInputMode.
+// Matrix/quaternion inputs skip the euler to matrix conversion and only pay
+// for the rest orient, once per joint
+MMatrix PoseSpaceDeformer::jointRotation( MDataHandle& jtHnd, short inputMode ) const
+{
+    MMatrix rotMat;
+
+    if (inputMode == JOINT_INPUT_EULER)
+    {
+        double3& data = jtHnd.child(aJointRot).asDouble3();
+        return MEulerRotation(data[0], data[1], data[2]).asMatrix();
+    }
+
+    if (inputMode == JOINT_INPUT_MATRIX)
+    {
+        // Drop scale/translate, keep the normalized rotation rows
+        const MMatrix& mat = jtHnd.child(aJointMatrix).asMatrix();
+        for (unsigned r = 0; r < 3; ++r)
+        {
+            MVector row(mat(r, 0), mat(r, 1), mat(r, 2));
+            row.normalize();
+            rotMat(r, 0) = row.x;
+            rotMat(r, 1) = row.y;
+            rotMat(r, 2) = row.z;
+        }
+    }
+    else
+    {
+        MDataHandle quatHnd = jtHnd.child(aJointQuat);
+        MQuaternion quat(   quatHnd.child(aJointQuatX).asDouble(),
+                            quatHnd.child(aJointQuatY).asDouble(),
+                            quatHnd.child(aJointQuatZ).asDouble(),
+                            quatHnd.child(aJointQuatW).asDouble() );
+        quat.normalizeIt();
+        rotMat = quat.asMatrix();
+    }
+
+    // Remove joint orient, rotation = jointRot * jointOrient
+    double3& orient = jtHnd.child(aJointRestOrient).asDouble3();
+    if (orient[0] != 0 || orient[1] != 0 || orient[2] != 0)
+    {
+        MMatrix orientMat = MEulerRotation(orient[0], orient[1], orient[2]).asMatrix();
+        rotMat = rotMat * orientMat.transpose();
+    }
+
+    return rotMat;
+}
+
+
+MStatus PoseSpaceDeformer::calcPoseWeights( MDataBlock& block )
+{
+    MStatus stat;
+    MString msg;
+    MDataHandle handle;
+    MObject obj;
 
 #ifdef _DEBUG
-            if (debug && fabs(wt) > 0.00001)
+    handle = block.inputValue(aDebug);
+    bool debug = handle.asBool();
+#endif
+
+    handle = block.inputValue(aIncludeTwist);
+    bool includeTwist = handle.asBool();
+
+    handle = block.inputValue(aJointInputMode);
+    short inputMode = handle.asShort();
+
+    // Get current joint frames and axis, one rotation matrix per joint
+    PoseSolver::JointFrameMap currJointFrames;
+    std::map<int, short> jointAxis;
+    MArrayDataHandle jtArrHnd = block.inputArrayValue(aJoint);
+    for (unsigned i = 0; i < jtArrHnd.elementCount(); ++i, jtArrHnd.next())
+    {
+        int jtIdx = jtArrHnd.elementIndex();
+        MDataHandle jtHnd = jtArrHnd.inputValue();
+
+        handle = jtHnd.child(aJointAxis);
+        short primeAxis = handle.asShort();
+        jointAxis[jtIdx] = primeAxis;
+
+        currJointFrames[jtIdx] = jointFrame(jointRotation(jtHnd, inputMode), primeAxis);
+    }
+
+
+
+    // If poses are dirty, recalculate pose2Pose weights
+    if (_posesDirty)
+    {
+        _posesDirty = false;
+
+        // Collect all pose joint rotations values
+        _poses.clear();
+        _poseIndices.clear();
+        MArrayDataHandle arrHnd = block.inputArrayValue(aPose);
+        for (unsigned i = 0; i < arrHnd.elementCount(); ++i, arrHnd.next())
+        {
+            handle = arrHnd.inputValue();
+
+            PoseSolver::Pose pose;
+            pose.ignore = handle.child(aPoseIgnore).asBool();
+
+            handle = handle.child(aPoseJoint);
+            MArrayDataHandle jtArrHnd(handle);
+            for (unsigned j = 0; j < jtArrHnd.elementCount(); ++j, jtArrHnd.next())
             {
-                MString msg = "FinalPoseWts: posei: ";
-                msg += i;
-                msg += ", posej: ";
-                msg += j;
-                msg += ", weight: ";
-                msg += wt;
-                MDebugPrint(msg);
+                handle = jtArrHnd.inputValue();
+                double3& data = handle.child(aPoseJointRot).asDouble3();
+                MEulerRotation rot(data[0], data[1], data[2]);
+
+                // Pose rotations only change with the pose, convert them once here
+                int jtIdx = jtArrHnd.elementIndex();
+                PoseSolver::PoseJoint& poseJt = pose.joints[jtIdx];
+                poseJt.fallOff = handle.child(aPoseJointFallOff).asFloat();
+                poseJt.frame = jointFrame(rot.asMatrix(), jointAxis[jtIdx]);
             }
-#endif
-            weight += wt;
+
+            _poses.push_back(pose);
+            _poseIndices.push_back(arrHnd.elementIndex());
         }
 
-        if ( weight < 0 )
-            weight = 0;
+        // pose-2-pose weights: For each pose, check how far is its poseJointRotations are from other poses
+        if (_poses.size() == 0)
+        {
+            _poseWeights.clear();
+            return MS::kSuccess;
+        }
+
+        {
+            ProfileScope scope("solvePoseMatrix");
+            PoseSolver::solvePoseMatrix(_poses, includeTwist, _pose2PoseWeights);
+        }
 
 #ifdef _DEBUG
-        if (debug && fabs(weight) > 0.00001)
+        if (debug)
         {
-            MString msg = "FinalPoseWts: posei: ";
-            msg += i;
-            msg += ", weight: ";
-            msg += weight;
-            MDebugPrint(msg);
+            const unsigned n = (unsigned)_poses.size();
+
+            char buf[1024] = "";
+            MDebugPrint("Pose2PoseWts:================");
+            for (unsigned i = 0; i < n; ++i)
+                SPRINTF(buf, "%s%8d", buf, i);
+            MDebugPrint(buf);
+            for (unsigned i = 0; i < n; ++i)
+            {
+                SPRINTF(buf, "%2d", i);
+                for (unsigned j = 0; j < n; ++j)
+                    SPRINTF(buf, "%s%8.3f", buf, _pose2PoseWeights[i * n + j]);
+                MDebugPrint(buf);
+            }
+            MDebugPrint("=============================");
         }
 #endif
-        _poseWeights[i] = weight;
     }
 
+    // No poses, return
+    if (_poses.size() == 0)
+    {
+        _poseWeights.clear();
+        return MS::kSuccess;
+    }
 
-    // Save final pose weights in plug
-    MArrayDataHandle poseArrHnd = block.outputArrayValue(aPose);
-    for(unsigned i = 0; i < poseArrHnd.elementCount(); ++i, poseArrHnd.next())
+    // Pose joints without a joint element are at the identity rotation
+    for (unsigned i = 0; i < _poses.size(); ++i)
     {
-        MDataHandle poseHnd = poseArrHnd.outputValue();
-        MDataHandle wtHnd = poseHnd.child(aPoseWeight);
+        const PoseSolver::PoseJointMap& joints = _poses[i].joints;
+        for (PoseSolver::PoseJointMap::const_iterator iter = joints.begin(); iter != joints.end(); ++iter)
+        {
+            if (currJointFrames.find(iter->first) == currJointFrames.end())
+                currJointFrames[iter->first] = jointFrame(MMatrix::identity, jointAxis[iter->first]);
+        }
+    }
 
-        wtHnd.setFloat((float)_poseWeights[i]);
-        wtHnd.setClean();
+    // Weight of each pose at the current joint rotations
+    PoseSolver::poseWeights(_poses, _pose2PoseWeights, currJointFrames, includeTwist, _poseWeights);
+
+#ifdef _DEBUG
+    if (debug)
+    {
+        for (unsigned i = 0; i < _poseWeights.size(); ++i)
+        {
+            if (fabs(_poseWeights[i]) <= 0.00001)
+                continue;
+
+            MString msg = "FinalPoseWts: posei: ";
+            msg += i;
+            msg += ", weight: ";
+            msg += _poseWeights[i];
+            MDebugPrint(msg);
+        }
     }
+#endif
 
     return MS::kSuccess;
 }
@@ -777,183 +1713,436 @@ MStatus PoseSpaceDeformer::deform(  MDataBlock&     block,
     if (env < FLOAT_TOLERANCE)
         return MS::kSuccess;
 
+    // Take in new sculpt strokes of this geometry
+    bool skinReady = false;
+    stat = updateSculpt(block, geomIndex, world, skinReady);
+    MCheckStatus(stat, "");
 
+    bool sculpting = _sculptPose >= 0 && (int)geomIndex == _sculptGeometry && !_sculptComponents.empty();
 
-    MArrayDataHandle poseArrHnd = block.inputArrayValue(aPose);
 
-#ifdef _DEBUG
-        if (debug)
+
+    // Pulls activePose*, which only re-solves if joints or poses changed
+    handle = block.inputValue(aActivePoseIndices);
+    obj = handle.data();
+    MIntArray& activeIndices = _activeIndices;
+    MFnIntArrayData(obj).copyTo(activeIndices);
+
+    handle = block.inputValue(aActivePoseWeights);
+    obj = handle.data();
+    MDoubleArray& activeWeights = _activeWeights;
+    MFnDoubleArrayData(obj).copyTo(activeWeights);
+
+    if (activeIndices.length() == 0 || activeIndices.length() != activeWeights.length())
+        return MS::kSuccess;
+
+    _stats.activePoses = activeIndices.length();
+
+    // Streamed targets are paged in per active pose, otherwise all targets
+    // are cached off the datablock
+    handle = block.inputValue(aStreamTargets);
+    bool stream = handle.asBool();
+
+    // Components past the vertex count of the input geometry are dropped
+    unsigned numVertices = inputVertexCount(block, geomIndex);
+
+    if (stream)
+    {
+        stat = updateStreamer(block);
+        MCheckStatus(stat, "");
+    }
+    else
+    {
+        if (_streamer.isOpen())
+            _streamer.close();
+
+        // Cached targets were clamped to the vertex count at the time
+        GeomCacheMap::iterator cacheIter = _geomCaches.find(geomIndex);
+        if (cacheIter != _geomCaches.end() && cacheIter->second.numTargets > 0 && cacheIter->second.numVertices != numVertices)
+            _targetsDirty = true;
+
+        if (_targetsDirty)
         {
-            msg += "NumPoses: ";
-            msg += poseArrHnd.elementCount();
-            msg += ", NumWeights: ";
-            msg += _poseWeights.length();
-            MDebugPrint(msg);
+            stat = cachePoseTargets(block);
+            MCheckStatus(stat, "");
+            cacheIter = _geomCaches.find(geomIndex);
         }
-#endif
 
-    VectorMap deltaMap;
-    for(unsigned i = 0; i < poseArrHnd.elementCount(); ++i, poseArrHnd.next())
+        // Targets are cached for geometries that have any
+        if ((cacheIter == _geomCaches.end() || cacheIter->second.poseTargets.empty()) && !sculpting)
+            return MS::kSuccess;
+    }
+    GeomCache& cache = _geomCaches[geomIndex];
+    cache.numVertices = numVertices;
+
+    // Get skin weights and joint matrices of this geometry's skinCluster
+    if (cache.weightsDirty)
     {
-        int poseIndex = poseArrHnd.elementIndex();
-        MDataHandle poseHnd = poseArrHnd.inputValue();
+        stat = cacheSkinWeights(block, geomIndex);
+        MCheckStatus(stat, "");
+    }
+
+    if (!skinReady)
+    {
+        stat = getSkinMatrices(block, geomIndex, world, cache.skinMatrices);
+        MCheckStatus(stat, "");
+    }
 
-        handle = poseHnd.child(aPoseEnvelope);
-        float poseEnv = handle.asFloat();
+    MArrayDataHandle poseArrHnd = block.inputArrayValue(aPose);
 
-        if (i >= _poseWeights.length() || _poseWeights[i] < FLOAT_TOLERANCE || fabs(poseEnv) < FLOAT_TOLERANCE)
-            continue;
+    // Replay the last output if the active poses are the ones it was deformed
+    // with and nothing else it depends on changed since. Joints dirty the
+    // geometry on every change, most of which leave the active poses as is.
+    // Input is read into the back buffer, which becomes the front one on a miss
+    uint64_t key = cache.outputKey;
+    bool activeChanged = cache.activeChanged(activeIndices, activeWeights);
+    {
+        const MPointArray& outputPositions = cache.positionBuffers[cache.frontBuffer];
+        MPointArray& inputPositions = cache.positionBuffers[1 - cache.frontBuffer];
+        itGeo.allPositions(inputPositions);
+
+        // Hashed in place, MPointArray holds its points packed
+        const unsigned numPoints = inputPositions.length();
+        uint64_t inputKey = hashBytes(numPoints ? &inputPositions[0] : 0, numPoints * sizeof(MPoint));
+        inputKey = hashBytes(&env, sizeof(env), inputKey);
+        if (!cache.skinMatrices.empty())
+            inputKey = hashBytes(&cache.skinMatrices[0], cache.skinMatrices.size() * sizeof(MMatrix), inputKey);
+        inputKey = hashBytes(&_generation, sizeof(_generation), inputKey);
+        inputKey = hashBytes(&stream, sizeof(stream), inputKey);
+
+        ++_deforms;
+        if (!activeChanged && inputKey == key && outputPositions.length() == inputPositions.length())
+        {
+            ++_replays;
+            return itGeo.setAllPositions(outputPositions);
+        }
+
+        key = inputKey;
+        cache.frontBuffer = 1 - cache.frontBuffer;
+    }
+    MPointArray& positions = cache.positionBuffers[cache.frontBuffer];
 
 #ifdef _DEBUG
         if (debug)
         {
-            MString msg = "Posei: ";
-            msg += i;
-            msg += ", weight: ";
-            msg += _poseWeights[i];
+            msg += "Geom: ";
+            msg += geomIndex;
+            msg += ", NumPoses: ";
+            msg += poseArrHnd.elementCount();
+            msg += ", NumActivePoses: ";
+            msg += activeIndices.length();
             MDebugPrint(msg);
         }
 #endif
 
-        MArrayDataHandle poseTargetArrHnd(poseHnd.child(aPoseTarget));
-        for(unsigned j = 0; j < poseTargetArrHnd.elementCount(); ++j, poseTargetArrHnd.next())
+    // Accumulate bind space delta of active targets, densely indexed by component
+    {
+        ProfileScope scope("accumulateDeltas", &_stats.accumulateTime);
+
+        if (cache.delta.size() < cache.numComponents)
         {
-            MDataHandle poseTargetHnd = poseTargetArrHnd.inputValue();
+            cache.delta.resize(cache.numComponents);
+            cache.touched.resize(cache.numComponents, 0);
+        }
 
-            handle = poseTargetHnd.child(aPoseTargetEnvelope);
-            float targetEnv = handle.asFloat();
+        for(unsigned i = 0; i < activeIndices.length(); ++i)
+        {
+            int poseIndex = activeIndices[i];
+            double poseWeight = activeWeights[i];
 
-            double poseWt = poseEnv * targetEnv * _poseWeights[i];
+            if (stream)
+            {
+                // Load targets of the pose now if prefetch didnt get them in yet
+                PoseTargetStreamer::ChunkPtr chunk = _streamer.acquire(poseIndex, geomIndex);
+                if (!chunk)
+                    continue;
 
-            handle = poseTargetHnd.child(aPoseTargetComponents);
-            obj = handle.data();
-            MFnIntArrayData fnIntArrData(obj);
-            MIntArray components = fnIntArrData.array();
+                unsigned numComponents = std::min(chunk->numComponents, cache.numVertices);
+                if (cache.delta.size() < numComponents)
+                {
+                    cache.delta.resize(numComponents);
+                    cache.touched.resize(numComponents, 0);
+                }
 
-            handle = poseTargetHnd.child(aPoseTargetDelta);
-            obj = handle.data();
-            MFnVectorArrayData fnVectorArrData(obj);
-            MVectorArray delta = fnVectorArrData.array();
+                if (poseArrHnd.jumpToElement(poseIndex) != MS::kSuccess)
+                    continue;
+                MArrayDataHandle poseTargetArrHnd(poseArrHnd.inputValue().child(aPoseTarget));
 
-#ifdef _DEBUG
+                for(unsigned j = 0; j < chunk->targets.size(); ++j)
+                {
+                    const PoseTargetStreamer::Target& target = chunk->targets[j];
+
+                    // Envelope is keyable on the node when the poseTarget element exists
+                    float targetEnv = target.envelope;
+                    if (poseTargetArrHnd.jumpToElement(target.index) == MS::kSuccess)
+                        targetEnv = poseTargetArrHnd.inputValue().child(aPoseTargetEnvelope).asFloat();
+
+                    double poseWt = targetEnv * poseWeight;
+                    if (fabs(poseWt) < FLOAT_TOLERANCE)
+                        continue;
+
+                    if (chunk->numComponents <= cache.numVertices)
+                    {
+                        cache.accumulate(&target.components[0], &target.deltas[0], (unsigned)target.components.size(), poseWt);
+                        continue;
+                    }
+
+                    // Exported from another topology, drop vertices past this one
+                    for(unsigned c = 0; c < target.components.size(); ++c)
+                    {
+                        if ((unsigned)target.components[c] < cache.numVertices)
+                            cache.accumulate(&target.components[c], &target.deltas[c], 1, poseWt);
+                    }
+                }
+                continue;
+            }
+
+            PoseTargetMap::const_iterator poseIter = cache.poseTargets.find(poseIndex);
+            if (poseIter == cache.poseTargets.end())
+                continue;
+
+    #ifdef _DEBUG
             if (debug)
             {
-                MString msg = "components: ";
-                msg += components.length();
-                msg += ", delta: ";
-                msg += delta.length();
+                MString msg = "Posei: ";
+                msg += poseIndex;
+                msg += ", weight: ";
+                msg += poseWeight;
                 MDebugPrint(msg);
-        }
-#endif
-            for(unsigned j = 0; j < components.length(); ++j)
-                deltaMap[components[j]] += delta[j] * poseWt;
-        }
-    }
+            }
+    #endif
 
-    if (deltaMap.empty())
-        return MS::kSuccess;
+            // Target envelopes are keyable, read them fresh for the active pose only
+            if (poseArrHnd.jumpToElement(poseIndex) != MS::kSuccess)
+                continue;
+            MArrayDataHandle poseTargetArrHnd(poseArrHnd.inputValue().child(aPoseTarget));
 
-    // Get joint matrices from skinCluster
-    MatrixMap jtMatrices;
-    {
-        // Get skinCluster
-        MFnSkinCluster fnSkinCluster;
-        {
-            MFnDependencyNode fnDeformer(thisMObject());
-            MPlug plug = fnDeformer.findPlug("input");
-            plug = plug[0];
-            plug = plug.child(0);
-
-            MItDependencyGraph iter(
-                plug,
-                MFn::kSkinClusterFilter,
-                MItDependencyGraph::kUpstream,
-                MItDependencyGraph::kDepthFirst,
-                MItDependencyGraph::kNodeLevel,
-                &stat);
-            MCheckStatus(stat, ErrorStr::PSDSCNotFound);
-
-            if (iter.isDone())
-                MReturnFailure(ErrorStr::PSDSCNotFound);
-
-            stat = fnSkinCluster.setObject(iter.currentItem());
-            MCheckStatus(stat, ErrorStr::PSDSCNotFound);
-#if 0
-            MPlug plug = fnDeformer.findPlug(aSkinClusterWeightList);
-            MPlugArray plugArr;
-            plug.connectedTo(plugArr, 1, 0);
-            obj = plugArr[0].node();
-            fnSkinCluster.setObject(obj);
-#endif
-        }
+            const std::vector<PoseTarget>& targets = poseIter->second;
+            for(unsigned j = 0; j < targets.size(); ++j)
+            {
+                const PoseTarget& target = targets[j];
+
+                if (poseTargetArrHnd.jumpToElement(target.index) != MS::kSuccess)
+                    continue;
 
-        MPlug bindPlug = fnSkinCluster.findPlug("bindPreMatrix");
-        MPlug jtMatPlug = fnSkinCluster.findPlug("matrix");
+                handle = poseTargetArrHnd.inputValue().child(aPoseTargetEnvelope);
+                float targetEnv = handle.asFloat();
+
+                double poseWt = targetEnv * poseWeight;
+                if (fabs(poseWt) < FLOAT_TOLERANCE)
+                    continue;
+
+    #ifdef _DEBUG
+                if (debug)
+                {
+                    MString msg = "components: ";
+                    msg += target.end - target.begin;
+                    MDebugPrint(msg);
+                }
+    #endif
+                cache.targetWeights[target.column] = poseWt;
+            }
+        }
 
-        MFnMatrixData fnMatrix;
-        for (unsigned i = 0; i < jtMatPlug.numElements(); ++i)
+        // Only targets whose weight changed since the last evaluation are summed,
+        // the kept base delta is then the delta of this evaluation
+        if (!stream)
         {
-            if (jtMatPlug[i].logicalIndex() != bindPlug[i].logicalIndex())
+            cache.updateBase();
+
+            for (unsigned k = 0; k < cache.baseComponents.size(); ++k)
             {
-                MReturnFailure("Matrix and bindPreMatrix plugs in skincluster doesnt match");
+                int c = cache.baseComponents[k];
+                cache.touched[c] = 1;
+                cache.delta[c] = cache.baseDelta[c];
+                cache.touchedComponents.push_back(c);
             }
+        }
+
+        // Live sculpt layer, weighted like the target it will be committed to
+        for(unsigned i = 0; sculpting && i < activeIndices.length(); ++i)
+        {
+            if (activeIndices[i] != _sculptPose)
+                continue;
 
-            fnMatrix.setObject(bindPlug[i].asMObject());
-            MMatrix bindInvMat = fnMatrix.matrix();
+            float targetEnv = 1.f;
+            if (poseArrHnd.jumpToElement(_sculptPose) == MS::kSuccess)
+            {
+                MArrayDataHandle poseTargetArrHnd(poseArrHnd.inputValue().child(aPoseTarget));
+                if (poseTargetArrHnd.jumpToElement(_sculptTarget) == MS::kSuccess)
+                    targetEnv = poseTargetArrHnd.inputValue().child(aPoseTargetEnvelope).asFloat();
+            }
 
-            fnMatrix.setObject(jtMatPlug[i].asMObject());
-            MMatrix jtMat = fnMatrix.matrix();
+            unsigned numComponents = _sculptComponents.back() + 1;
+            if (cache.delta.size() < numComponents)
+            {
+                cache.delta.resize(numComponents);
+                cache.touched.resize(numComponents, 0);
+            }
 
-            MMatrix scMat = world * bindInvMat * jtMat * world.inverse();
-            jtMatrices[jtMatPlug[i].logicalIndex()] = scMat;
+            cache.accumulate(&_sculptComponents[0], &_sculptDeltas[0], (unsigned)_sculptComponents.size(), activeWeights[i] * targetEnv);
         }
     }
 
-    
-    // Convert delta to skinSpace
-    MArrayDataHandle wtListArrHnd = block.inputArrayValue(aSkinClusterWeightList);
-    for (unsigned i = 0; i < wtListArrHnd.elementCount(); ++i, wtListArrHnd.next())
+
+    // Convert delta to skinSpace, each component independently
     {
-        int c = wtListArrHnd.elementIndex();
+        ProfileScope scope("skinSpaceDeltas", &_stats.skinTime);
 
-        if (deltaMap.find(c) == deltaMap.end())
-            continue;
+        const unsigned numWeighted = (unsigned)cache.weightOffsets.size() - 1;
+        const unsigned numSkinMatrices = (unsigned)cache.skinMatrices.size();
 
-        handle = wtListArrHnd.inputValue();
-        handle = handle.child(aSkinClusterWeights);
-        MArrayDataHandle wtArrHnd(handle);
+        if (!cache.touchedComponents.empty() && numWeighted > 0 && numSkinMatrices > 0)
+            Deltas::toSkinSpace(&cache.touchedComponents[0], (unsigned)cache.touchedComponents.size(), 
+                                &cache.weightOffsets[0], numWeighted, &cache.weightJoints[0], &cache.weightValues[0], 
+                                (const double*)&cache.skinMatrices[0], numSkinMatrices, (double*)&cache.delta[0]);
+    }
 
-        MMatrix bindToSkinMat;
-        for (unsigned j = 0; j < wtArrHnd.elementCount(); ++j, wtArrHnd.next())
+
+    // Set the final positions, all at once
+    {
+        ProfileScope scope("writePositions", &_stats.writeTime);
+
+        unsigned k = 0;
+        for (itGeo.reset(); !itGeo.isDone(); itGeo.next(), ++k)
         {
-            int jtIdx = wtArrHnd.elementIndex();
-            double wt = wtArrHnd.inputValue().asDouble();
-            MMatrix mat = jtMatrices[jtIdx] * wt;
+            int i = itGeo.index();
 
-            if (j)
-                bindToSkinMat += mat;
-            else
-                bindToSkinMat = mat;
+            if ((unsigned)i < cache.touched.size() && cache.touched[i])
+            {
+                float wt = weightValue(block, geomIndex, i);
+                positions[k] += cache.delta[i] * wt * env;
+            }
         }
 
-        deltaMap[c] *= bindToSkinMat;
+        cache.outputKey = key;
+        cache.activeIndices = activeIndices;
+        cache.activeWeights = activeWeights;
+        itGeo.setAllPositions(positions);
     }
 
+    _stats.touchedVertices += (int)cache.touchedComponents.size();
+
+    // Reset touched components for the next evaluation
+    for (unsigned i = 0; i < cache.touchedComponents.size(); ++i)
+        cache.touched[cache.touchedComponents[i]] = 0;
+    cache.touchedComponents.clear();
 
-    // Set the final positions
-    for (itGeo.reset(); !itGeo.isDone(); itGeo.next())
+    return MStatus::kSuccess;
+}
+
+
+MStatus PoseSpaceDeformer::upgradeLegacyAttributes( const MObject& node )
+{
+    MStatus stat;
+    MDGModifier dgMod;
+    bool upgraded = false;
+
+    // Targets, into geometry 0 unless it already has data there
+    MPlug pPoseArray(node, aPose);
+    for (unsigned p = 0; p < pPoseArray.numElements(); ++p)
     {
-        int i = itGeo.index();
+        MPlug pTargetArray = pPoseArray.elementByPhysicalIndex(p).child(aPoseTarget);
+        for (unsigned t = 0; t < pTargetArray.numElements(); ++t)
+        {
+            MPlug pTarget = pTargetArray.elementByPhysicalIndex(t);
+            MPlug pLegacyComp = pTarget.child(aLegacyPoseTargetComponents);
+            MPlug pLegacyDelta = pTarget.child(aLegacyPoseTargetDelta);
+
+            MObject compObj, deltaObj;
+            pLegacyComp.getValue(compObj);
+            pLegacyDelta.getValue(deltaObj);
+            if (compObj.isNull() || deltaObj.isNull())
+                continue;
+
+            MFnIntArrayData fnCompData(compObj);
+            MFnVectorArrayData fnDeltaData(deltaObj);
+            if (fnCompData.length() == 0)
+                continue;
+
+            if (fnCompData.length() != fnDeltaData.length())
+            {
+                MReturnFailure(ErrorStr::PSDInvalidTargetDelta);
+            }
+
+            MPlug pComp = pTarget.child(aPoseTargetComponents).elementByLogicalIndex(0);
+            MObject geomObj;
+            pComp.getValue(geomObj);
+            if (geomObj.isNull() || MFnIntArrayData(geomObj).length() == 0)
+            {
+                MPlug pDelta = pTarget.child(aPoseTargetDelta).elementByLogicalIndex(0);
+                dgMod.newPlugValue(pComp, compObj);
+                dgMod.newPlugValue(pDelta, deltaObj);
+            }
 
-        if (deltaMap.find(i) != deltaMap.end())
+            // Clear the legacy data so the scene stops saving it
+            MFnIntArrayData fnEmptyComp;
+            MObject emptyComp = fnEmptyComp.create(MIntArray());
+            MFnVectorArrayData fnEmptyDelta;
+            MObject emptyDelta = fnEmptyDelta.create(MVectorArray());
+            dgMod.newPlugValue(pLegacyComp, emptyComp);
+            dgMod.newPlugValue(pLegacyDelta, emptyDelta);
+            upgraded = true;
+        }
+    }
+
+    // skinCluster, found from its weightList connection. Matrices used to be
+    // found by walking the graph, connect them too
+    MPlug pLegacyWtList(node, aLegacySkinClusterWeightList);
+    MPlugArray srcPlugs;
+    if (pLegacyWtList.connectedTo(srcPlugs, true, false) && srcPlugs.length())
+    {
+        MFnDependencyNode fnSkin(srcPlugs[0].node());
+        MPlug pSkinCluster = MPlug(node, aSkinCluster).elementByLogicalIndex(0);
+        MPlug pWtList = pSkinCluster.child(aSkinClusterWeightList);
+
+        dgMod.disconnect(srcPlugs[0], pLegacyWtList);
+        if (!pWtList.isConnected())
         {
-            float wt = weightValue(block, geomIndex, i);
-            MPoint position = itGeo.position();
-            position += deltaMap[i] * wt * env;
-            itGeo.setPosition(position);
+            dgMod.connect(srcPlugs[0], pWtList);
+
+            MPlug pMatrix = pSkinCluster.child(aSkinClusterMatrix);
+            if (!pMatrix.isConnected())
+                dgMod.connect(fnSkin.findPlug("matrix"), pMatrix);
+
+            MPlug pBindPreMatrix = pSkinCluster.child(aSkinClusterBindPreMatrix);
+            if (!pBindPreMatrix.isConnected())
+                dgMod.connect(fnSkin.findPlug("bindPreMatrix"), pBindPreMatrix);
         }
+        upgraded = true;
     }
 
-    return MStatus::kSuccess;
+    if (!upgraded)
+        return MS::kSuccess;
+
+    stat = dgMod.doIt();
+    MCheckStatus(stat, ErrorStr::PSDLegacyUpgradeFailed);
+
+    MGlobal::displayInfo(MString("Upgraded ") + MFnDependencyNode(node).name() + " to per geometry targets and skinClusters");
+    return MS::kSuccess;
 }
 
+void PoseSpaceDeformer::afterSceneLoad( void* clientData )
+{
+    MItDependencyNodes itNode(MFn::kPluginDeformerNode);
+    for (; !itNode.isDone(); itNode.next())
+    {
+        MObject node = itNode.thisNode();
+        if (MFnDependencyNode(node).typeId() == id)
+            upgradeLegacyAttributes(node);
+    }
+}
+
+void PoseSpaceDeformer::addCallbacks()
+{
+    _callbacks.append(MSceneMessage::addCallback(MSceneMessage::kAfterOpen, afterSceneLoad));
+    _callbacks.append(MSceneMessage::addCallback(MSceneMessage::kAfterImport, afterSceneLoad));
+    _callbacks.append(MSceneMessage::addCallback(MSceneMessage::kAfterLoadReference, afterSceneLoad));
+    _callbacks.append(MSceneMessage::addCallback(MSceneMessage::kAfterCreateReference, afterSceneLoad));
+}
+
+void PoseSpaceDeformer::removeCallbacks()
+{
+    MMessage::removeCallbacks(_callbacks);
+    _callbacks.clear();
+}
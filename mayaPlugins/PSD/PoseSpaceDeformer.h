@@ -3,18 +3,27 @@
 
 #include <vector>
 #include <map>
+#include <string>
+#include <unordered_map>
 
 #include <maya/MPxDeformerNode.h>
 #include <maya/MTypeId.h>
 #include <maya/MDataBlock.h>
 #include <maya/MVector.h>
 #include <maya/MEulerRotation.h>
+#include <maya/MMatrix.h>
+#if MAYA_API_VERSION >= 201600
+#include <maya/MEvaluationNode.h>
+#endif
 #include <maya/MDoubleArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MVectorArray.h>
+#include <maya/MPointArray.h>
+#include <maya/MCallbackIdArray.h>
 
-
-typedef std::map<int, MVector>  VectorMap;
-typedef std::map<int, MEulerRotation>  RotationMap;
-typedef std::map<int, MMatrix>  MatrixMap;
+#include "PoseTargetStreamer.h"
+#include "SkinInverseCache.h"
+#include "Core/PoseSolver.h"
 
 
 class PoseSpaceDeformer: public MPxDeformerNode
@@ -31,11 +40,37 @@ public:
 
     MStatus compute(const MPlug& plug, MDataBlock& block);
 
+#if MAYA_API_VERSION >= 201600
+    MStatus preEvaluation(  const MDGContext& context, 
+                            const MEvaluationNode& evaluationNode );
+
+    SchedulingType schedulingType() const;
+#endif
+
     MStatus deform( MDataBlock&     block, 
                     MItGeometry&    itGeo, 
                     const MMatrix&  world, 
                     unsigned int    geomIndex );
 
+    // Pose/target name lookups for PoseSpaceCommand, -1 if not found
+    int     poseIndex( const MString& poseName );
+    int     poseTargetIndex( int poseIndex, const MString& targetName );
+
+    // Bind space sculpt layer sorted by component, for PoseSpaceCommand to
+    // commit. False if sculpt input arrived that deform hasnt converted yet
+    bool    sculptLayer( std::vector<int>& components, std::vector<MVector>& deltas ) const;
+
+    // Per vertex inverse skin matrices kept across PoseSpaceCommand target edits
+    SkinInverseCache&   skinInverseCache( unsigned geomIndex )  { return _skinInverseCaches[geomIndex]; }
+
+    // Move single geometry targets and skinCluster connections of scenes saved
+    // before multiple geometries were supported onto geometry 0
+    static  MStatus     upgradeLegacyAttributes( const MObject& node );
+
+    // Upgrade every PSD node after a scene is opened, imported or referenced
+    static  void        addCallbacks();
+    static  void        removeCallbacks();
+
 public:
 
     static  MTypeId         id;  
@@ -51,6 +86,17 @@ public:
     static MObject          aJointRotX;
     static MObject          aJointRotY;
     static MObject          aJointRotZ;
+    static MObject          aJointMatrix;
+    static MObject          aJointQuat;
+    static MObject          aJointQuatX;
+    static MObject          aJointQuatY;
+    static MObject          aJointQuatZ;
+    static MObject          aJointQuatW;
+    static MObject          aJointRestOrient;
+    static MObject          aJointRestOrientX;
+    static MObject          aJointRestOrientY;
+    static MObject          aJointRestOrientZ;
+    static MObject          aJointInputMode;
 
 
     static MObject          aPose;
@@ -69,46 +115,229 @@ public:
     static MObject          aPoseTargetEnvelope;
     static MObject          aPoseTargetComponents;
     static MObject          aPoseTargetDelta;
+    static MObject          aLegacyPoseTargetComponents;
+    static MObject          aLegacyPoseTargetDelta;
 
     static MObject          aIncludeTwist;
 
+    static MObject          aSkinCluster;
     static MObject          aSkinClusterWeightList;
     static MObject          aSkinClusterWeights;
+    static MObject          aSkinClusterMatrix;
+    static MObject          aSkinClusterBindPreMatrix;
+    static MObject          aLegacySkinClusterWeightList;
+    static MObject          aLegacySkinClusterWeights;
+
+    static MObject          aPoseLibraryFile;
+    static MObject          aStreamTargets;
+    static MObject          aTargetMemoryBudget;
+    static MObject          aPruneThreshold;
+    static MObject          aCompressionMode;
+    static MObject          aCompressionError;
+    static MObject          aCompressionRank;
+
+    static MObject          aSculptPose;
+    static MObject          aSculptTarget;
+    static MObject          aSculptGeometry;
+    static MObject          aSculptComponents;
+    static MObject          aSculptDelta;
+
+    static MObject          aStatsEvaluationTime;
+    static MObject          aStatsSolveTime;
+    static MObject          aStatsAccumulateTime;
+    static MObject          aStatsSkinTime;
+    static MObject          aStatsWriteTime;
+    static MObject          aStatsActivePoses;
+    static MObject          aStatsTouchedVertices;
+    static MObject          aStatsCacheHitRate;
+
+    static MObject          aPoseWeights;
+    static MObject          aActivePoseIndices;
+    static MObject          aActivePoseWeights;
 
 
 private:
 
     MStatus calcPoseWeights( MDataBlock& block );
+    MMatrix jointRotation( MDataHandle& jtHnd, short inputMode ) const;
+    MStatus setPoseWeights( MDataBlock& block );
+    void    activePoses( MDataBlock& block, MIntArray& activeIndices, MDoubleArray& activeWeights );
+    MStatus setPoseWeightPlugs( MDataBlock& block );
+    MStatus cachePoseTargets( MDataBlock& block );
+    MStatus cacheSkinWeights( MDataBlock& block, unsigned geomIndex );
+    unsigned inputVertexCount( MDataBlock& block, unsigned geomIndex );
+    MStatus getSkinMatrices( MDataBlock& block, unsigned geomIndex, const MMatrix& world, std::vector<MMatrix>& skinMatrices );
+    MStatus updateStreamer( MDataBlock& block );
+    void    buildNameIndex();
+
+    enum { GENERATION_PLUG_COUNT = 19 };
+    static const MObject* const GenerationPlugs[GENERATION_PLUG_COUNT];
+    static bool isGenerationPlug( const MPlug& plug );
+    MStatus updateSculpt( MDataBlock& block, unsigned geomIndex, const MMatrix& world, bool& skinReady );
+    void    clearSculpt();
 
 
 private:
 
-    static std::map<short, MVector>     AxisVec;
-    static std::map<short, MVector>     UpVec;
+    static MVector                      AxisVec[6];
+    static MVector                      UpVec[6];
+
+    static MCallbackIdArray             _callbacks;
+    static void afterSceneLoad( void* clientData );
+
+    // Primary and up axis of a joint rotation, the vectors pose distances are measured on
+    static PoseSolver::JointFrame jointFrame( const MMatrix& rotMat, short primeAxis );
 
-    class PoseJoint
+    // Range of a target's components/deltas in its GeomCache, and its
+    // coefficient column when the targets are compressed
+    class PoseTarget
     {
     public:
-        PoseJoint() {}
-        PoseJoint(MEulerRotation _rotation, float _fallOff) : rotation(_rotation), fallOff(_fallOff)   {}
-
-        MEulerRotation  rotation;
-        float           fallOff;
+        int             index;
+        unsigned        begin;
+        unsigned        end;
+        unsigned        column;
     };
 
-    typedef std::map<int, PoseJoint>    PoseJointMap;
+    typedef std::map<int, std::vector<PoseTarget> >   PoseTargetMap;
 
-    class PoseInfo
+    // Per geometry caches, targets and skin weights packed into flat arrays
+    class GeomCache
     {
     public:
-        PoseJointMap jtMap;
-        bool ignore;
+        GeomCache() : numVertices(0), numComponents(0), numTargets(0), rank(0), compressed(false), evaluations(0), weightsDirty(true), outputKey(0), frontBuffer(0)   {}
+
+        // Pose targets
+        PoseTargetMap               poseTargets;
+        std::vector<int>            components;
+        std::vector<MVector>        deltas;
+        unsigned                    numVertices;        // Of the input geometry, components are clamped to it
+        unsigned                    numComponents;
+        unsigned                    numTargets;
+        std::vector<PoseTarget>     columns;            // Targets by column
+        std::vector<double>         targetWeights;      // Per evaluation, by column
+
+        // Low rank (PCA) form of all targets, replacing components/deltas.
+        // Deltas of basisComponents = basis * coefficients * target weights,
+        // basis is (3 x basisComponents) x rank, coefficients rank x numTargets,
+        // both column major
+        std::vector<int>            basisComponents;
+        std::vector<double>         basis;
+        std::vector<double>         coefficients;
+        unsigned                    rank;
+        bool                        compressed;
+        std::vector<MVector>        basisDelta;
+
+        // Bind space delta of all targets at appliedWeights, kept across
+        // evaluations and updated by weight changes only
+        std::vector<MVector>        baseDelta;
+        std::vector<char>           baseTouched;
+        std::vector<int>            baseComponents;
+        std::vector<double>         appliedWeights;
+        unsigned                    evaluations;        // Since the last full rebuild
+
+        // skinCluster weights, vertex v in [weightOffsets[v], weightOffsets[v+1])
+        std::vector<unsigned>       weightOffsets;
+        std::vector<int>            weightJoints;
+        std::vector<double>         weightValues;
+        bool                        weightsDirty;
+
+        // skinCluster matrices of this evaluation, in geometry space
+        std::vector<MMatrix>        skinMatrices;
+
+        // Per evaluation delta accumulation
+        std::vector<MVector>        delta;
+        std::vector<char>           touched;
+        std::vector<int>            touchedComponents;
+
+        // Output of the last evaluation, replayed while its active poses and
+        // the input fingerprint (points, joint matrices, generation) stay the same
+        MIntArray                   activeIndices;
+        MDoubleArray                activeWeights;
+        uint64_t                    outputKey;
+        MPointArray                 positionBuffers[2];     // Output in the front one
+        unsigned                    frontBuffer;
+
+        bool activeChanged( const MIntArray& indices, const MDoubleArray& weights ) const;
+        void accumulate( const int* targetComponents, const MVector* targetDeltas, unsigned count, double weight );
+        void accumulateBase( const int* targetComponents, const MVector* targetDeltas, unsigned count, double weight );
+        void resetBase();
+        void updateBase();
+        void compress( double maxError );
+        void reconstruct();
     };
 
+    typedef std::map<unsigned, GeomCache>   GeomCacheMap;
+
     bool                        _posesDirty;
-    std::vector<MDoubleArray>   _pose2PoseWeights;
-    std::vector<PoseInfo>       _poses;    
-    MDoubleArray                _poseWeights;
+    std::vector<double>         _pose2PoseWeights;  // n x n, row major
+    std::vector<PoseSolver::Pose>   _poses;
+    std::vector<int>            _poseIndices;       // Logical index of each of _poses
+    std::vector<double>         _poseWeights;
+
+    bool                        _targetsDirty;
+    unsigned                    _generation;        // Edits of inputs that arent fingerprinted
+    GeomCacheMap                _geomCaches;
+
+    // Stages of the last evaluation, written onto the stats* outputs
+    class Stats
+    {
+    public:
+        Stats() : solveTime(0), accumulateTime(0), skinTime(0), writeTime(0), activePoses(0), touchedVertices(0)  {}
+
+        double                  solveTime;
+        double                  accumulateTime;
+        double                  skinTime;
+        double                  writeTime;
+        int                     activePoses;
+        int                     touchedVertices;
+    };
+
+    Stats                       _stats;
+    unsigned                    _deforms;
+    unsigned                    _replays;
+
+    // Per evaluation scratch, kept to reuse its memory
+    MIntArray                   _activeIndices;
+    MDoubleArray                _activeWeights;
+    MIntArray                   _componentBuffer;   // Target/sculpt input
+    MVectorArray                _deltaBuffer;
+
+    // Active poses of the last solve, written onto activePose*
+    MIntArray                   _solveIndices;
+    MDoubleArray                _solveWeights;
+
+    // Name to logical index of poses, and of targets per pose
+    typedef std::unordered_map<std::string, int>    NameIndexMap;
+
+    bool                        _namesDirty;
+    NameIndexMap                _poseNameIndex;
+    std::map<int, NameIndexMap> _targetNameIndex;
+
+    // Live sculpt layer: skin space input and its bind space conversion per
+    // sculpted component, flattened for accumulation
+    class SculptVertex
+    {
+    public:
+        MVector         skinDelta;
+        MVector         bindDelta;
+    };
+
+    typedef std::map<int, SculptVertex>     SculptMap;
+
+    bool                        _sculptDirty;
+    int                         _sculptPose;
+    int                         _sculptTarget;
+    int                         _sculptGeometry;
+    SculptMap                   _sculpt;
+    std::vector<int>            _sculptComponents;
+    std::vector<MVector>        _sculptDeltas;
+
+    std::map<unsigned, SkinInverseCache>    _skinInverseCaches;
+
+    // Targets paged in from poseLibraryFile when streamTargets is on
+    PoseTargetStreamer          _streamer;
+    std::map<int, double>       _prevPoseWeights;
 
 };
 
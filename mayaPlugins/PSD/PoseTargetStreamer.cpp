@@ -0,0 +1,237 @@
+#include "PoseTargetStreamer.h"
+
+
+PoseTargetStreamer::PoseTargetStreamer()
+:   _open(false),
+    _budget(0),
+    _used(0),
+    _stop(false)
+{
+}
+
+PoseTargetStreamer::~PoseTargetStreamer()
+{
+    close();
+}
+
+bool PoseTargetStreamer::open( const std::string& path, std::string& error )
+{
+    close();
+
+    if (!_reader.open(path, error))
+        return false;
+
+    // Index target records only, deltas stay in the file until a pose fires
+    const PoseLibrary::Header& header = _reader.header();
+    for( uint32_t p=0; p < header.numPoses; ++p )
+    {
+        const PoseLibrary::PoseRecord& pose = _reader.poses()[p];
+        for( uint32_t t=pose.firstTarget; t < pose.firstTarget + pose.numTargets; ++t )
+        {
+            const PoseLibrary::TargetRecord& target = _reader.targets()[t];
+            if (target.numComponents == 0)
+                continue;
+
+            std::vector<uint32_t>& records = _records[Key(pose.index, target.geomIndex)];
+            if (records.empty())
+                _poseGeoms[pose.index].push_back(target.geomIndex);
+            records.push_back(t);
+        }
+    }
+
+    _path = path;
+    _open = true;
+    _stop = false;
+
+    return true;
+}
+
+void PoseTargetStreamer::close()
+{
+    // Prefetches still queued skip their load
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _prefetches.wait();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _resident.clear();
+    _lru.clear();
+    _used = 0;
+    _queued.clear();
+
+    _records.clear();
+    _poseGeoms.clear();
+    _reader.close();
+
+    _path.clear();
+    _open = false;
+}
+
+void PoseTargetStreamer::setMemoryBudget( size_t bytes )
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _budget = bytes;
+    evict();
+}
+
+size_t PoseTargetStreamer::memoryUsed() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _used;
+}
+
+PoseTargetStreamer::ChunkPtr PoseTargetStreamer::acquire( int poseIndex, unsigned geomIndex )
+{
+    if (!_open)
+        return ChunkPtr();
+
+    Key key(poseIndex, geomIndex);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        std::map<Key, Entry>::iterator iter = _resident.find(key);
+        if (iter != _resident.end())
+        {
+            _lru.splice(_lru.begin(), _lru, iter->second.lru);
+            return iter->second.chunk;
+        }
+    }
+
+    // Not resident, load on the calling thread
+    ChunkPtr chunk = load(key);
+    if (!chunk)
+        return chunk;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return insert(key, chunk);
+}
+
+void PoseTargetStreamer::prefetch( int poseIndex )
+{
+    if (!_open)
+        return;
+
+    std::map<int, std::vector<unsigned> >::const_iterator geomIter = _poseGeoms.find(poseIndex);
+    if (geomIter == _poseGeoms.end())
+        return;
+
+    std::vector<Key> keys;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        const std::vector<unsigned>& geoms = geomIter->second;
+        for( unsigned i=0; i < geoms.size(); ++i )
+        {
+            Key key(poseIndex, geoms[i]);
+            if (_resident.count(key) || _queued.count(key))
+                continue;
+
+            _queued.insert(key);
+            keys.push_back(key);
+        }
+    }
+
+    for( unsigned i=0; i < keys.size(); ++i )
+    {
+        Key key = keys[i];
+        _prefetches.run([this, key]() { prefetchChunk(key); });
+    }
+}
+
+// Copy targets of a pose/geometry out of the mapped file
+PoseTargetStreamer::ChunkPtr PoseTargetStreamer::load( const Key& key ) const
+{
+    std::map<Key, std::vector<uint32_t> >::const_iterator recIter = _records.find(key);
+    if (recIter == _records.end())
+        return ChunkPtr();
+
+    std::shared_ptr<Chunk> chunk(new Chunk);
+
+    const std::vector<uint32_t>& records = recIter->second;
+    chunk->targets.resize(records.size());
+    for( unsigned i=0; i < records.size(); ++i )
+    {
+        const PoseLibrary::TargetRecord& record = _reader.targets()[records[i]];
+        Target& target = chunk->targets[i];
+
+        target.index = record.index;
+        target.envelope = record.envelope;
+
+        const int32_t* components = _reader.components(record);
+        const double* deltas = _reader.deltas(record);
+
+        target.components.assign(components, components + record.numComponents);
+        target.deltas.resize(record.numComponents);
+        for( uint32_t c=0; c < record.numComponents; ++c )
+        {
+            target.deltas[c] = MVector(deltas[c*3], deltas[c*3+1], deltas[c*3+2]);
+
+            if ((unsigned)components[c] >= chunk->numComponents)
+                chunk->numComponents = components[c] + 1;
+        }
+
+        chunk->bytes += record.numComponents * (sizeof(int) + sizeof(MVector));
+    }
+
+    return chunk;
+}
+
+// Add a loaded chunk, keeping the one already resident if it was loaded
+// meanwhile. Call with _mutex locked
+PoseTargetStreamer::ChunkPtr PoseTargetStreamer::insert( const Key& key, const ChunkPtr& chunk )
+{
+    std::map<Key, Entry>::iterator iter = _resident.find(key);
+    if (iter != _resident.end())
+    {
+        _lru.splice(_lru.begin(), _lru, iter->second.lru);
+        return iter->second.chunk;
+    }
+
+    _lru.push_front(key);
+
+    Entry& entry = _resident[key];
+    entry.chunk = chunk;
+    entry.lru = _lru.begin();
+    _used += chunk->bytes;
+
+    evict();
+
+    return chunk;
+}
+
+// Drop least recently used chunks over the budget, never the most recent one.
+// Chunks still held by a deform stay alive until released. Call with _mutex locked
+void PoseTargetStreamer::evict()
+{
+    while (_used > _budget && _lru.size() > 1)
+    {
+        Key key = _lru.back();
+        _lru.pop_back();
+
+        std::map<Key, Entry>::iterator iter = _resident.find(key);
+        _used -= iter->second.chunk->bytes;
+        _resident.erase(iter);
+    }
+}
+
+// Prefetch task of one chunk, runs on the thread pool
+void PoseTargetStreamer::prefetchChunk( const Key& key )
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stop)
+            return;
+    }
+
+    ChunkPtr chunk = load(key);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queued.erase(key);
+    if (chunk && !_stop)
+        insert(key, chunk);
+}
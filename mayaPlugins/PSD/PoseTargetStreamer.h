@@ -0,0 +1,104 @@
+#ifndef POSETARGETSTREAMER_H
+#define POSETARGETSTREAMER_H
+
+#include "PoseLibrary.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <map>
+#include <list>
+#include <set>
+#include <memory>
+#include <mutex>
+
+#include <maya/MVector.h>
+
+
+// Pages pose targets in from a pose library file on demand. Targets of a
+// (pose, geometry) pair are loaded as one chunk the first time the pose fires,
+// kept in an LRU bounded by a memory budget, and can be prefetched as tasks
+// of the plugin thread pool
+class PoseTargetStreamer
+{
+public:
+
+    class Target
+    {
+    public:
+        int                     index;
+        float                   envelope;
+        std::vector<int>        components;
+        std::vector<MVector>    deltas;
+    };
+
+    // Targets of one pose on one geometry
+    class Chunk
+    {
+    public:
+        Chunk() : numComponents(0), bytes(0)   {}
+
+        std::vector<Target>     targets;
+        unsigned                numComponents;      // Highest component + 1
+        size_t                  bytes;
+    };
+
+    typedef std::shared_ptr<const Chunk>    ChunkPtr;
+
+
+    PoseTargetStreamer();
+    ~PoseTargetStreamer();
+
+    bool                open( const std::string& path, std::string& error );
+    void                close();
+
+    bool                isOpen() const          { return _open; }
+    const std::string&  path() const            { return _path; }
+
+    void                setMemoryBudget( size_t bytes );
+    size_t              memoryUsed() const;
+
+    // Chunk of pose/geometry, loaded now if it isnt resident. Null if the
+    // pose has no targets on the geometry
+    ChunkPtr            acquire( int poseIndex, unsigned geomIndex );
+
+    // Queue chunks of a pose (all geometries) for loading on the thread pool
+    void                prefetch( int poseIndex );
+
+private:
+    PoseTargetStreamer( const PoseTargetStreamer& );
+    PoseTargetStreamer& operator=( const PoseTargetStreamer& );
+
+    typedef std::pair<int, unsigned>        Key;
+
+    class Entry
+    {
+    public:
+        ChunkPtr                    chunk;
+        std::list<Key>::iterator    lru;
+    };
+
+    ChunkPtr            load( const Key& key ) const;
+    ChunkPtr            insert( const Key& key, const ChunkPtr& chunk );
+    void                evict();
+    void                prefetchChunk( const Key& key );
+
+    bool                                    _open;
+    std::string                             _path;
+    PoseLibrary::Reader                     _reader;
+
+    // Target records of each (pose, geometry), built on open
+    std::map<Key, std::vector<uint32_t> >   _records;
+    std::map<int, std::vector<unsigned> >   _poseGeoms;
+
+    mutable std::mutex                      _mutex;
+    std::map<Key, Entry>                    _resident;
+    std::list<Key>                          _lru;           // Most recently used first
+    size_t                                  _budget;
+    size_t                                  _used;
+
+    std::set<Key>                           _queued;
+    ThreadPool::TaskGroup                   _prefetches;
+    bool                                    _stop;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef SKININVERSECACHE_H
+#define SKININVERSECACHE_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+// Inverse skin matrices (3x3, row major) of each vertex of a geometry, filled
+// lazily as target authoring needs them. Valid as long as the joint matrices
+// and skin weights hashed into key dont change
+class SkinInverseCache
+{
+public:
+    SkinInverseCache() : _key(0)    {}
+
+    // Start using matrices/weights of key, dropping inverses if it changed
+    void reset( uint64_t key, unsigned numVertices )
+    {
+        if (key == _key && _state.size() == numVertices)
+            return;
+
+        _key = key;
+        _state.assign(numVertices, UNKNOWN);
+        _inverses.resize(numVertices * 9);
+    }
+
+    void clear()
+    {
+        _key = 0;
+        _state.clear();
+        _inverses.clear();
+    }
+
+    uint64_t        key() const                 { return _key; }
+    unsigned        size() const                { return (unsigned)_state.size(); }
+
+    bool            has( unsigned v ) const     { return _state[v] != UNKNOWN; }
+
+    // Null if the skin matrix of v is singular
+    const double*   inverse( unsigned v ) const { return _state[v] == INVERTIBLE ? &_inverses[v * 9] : 0; }
+
+    // Null inverse marks v singular. Distinct vertices can be set in parallel
+    void set( unsigned v, const double* inverse )
+    {
+        if (inverse)
+            memcpy(&_inverses[v * 9], inverse, 9 * sizeof(double));
+        _state[v] = inverse ? INVERTIBLE : SINGULAR;
+    }
+
+private:
+    enum State { UNKNOWN = 0, INVERTIBLE, SINGULAR };
+
+    uint64_t                _key;
+    std::vector<char>       _state;
+    std::vector<double>     _inverses;
+};
+
+#endif
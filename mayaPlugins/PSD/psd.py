@@ -6,6 +6,20 @@ PLUGINPATH = 'mayaPlugins'
 PLUGIN = 'plugin'
 NODETYPE = 'poseSpaceDeformer'
 
+# jointInputMode values
+JOINT_INPUT_EULER = 0
+JOINT_INPUT_MATRIX = 1
+JOINT_INPUT_QUATERNION = 2
+
+
+def setThreadCap(threads):
+    '''Cap threads of the plugin thread pool, shared by all plugin nodes and
+    commands. 0 uses all'''
+    cmds.poseSpaceCommand(threadCap=threads)
+
+def threadCap():
+    return cmds.poseSpaceCommand(q=1, threadCap=1)
+
 class PoseSpaceDeformer(object):
 
     name = None
@@ -29,9 +43,21 @@ class PoseSpaceDeformer(object):
         if cmds.nodeType(sel[0]) != 'mesh':
             raise RuntimeError('PSD can be created only on mesh')
         
-        # Find skinCluster
+        skinCluster = PoseSpaceDeformer.findSkinCluster(sel[0])
+
+        name = cmds.deformer(type=NODETYPE, name=name)[0]
+
+        psd = PoseSpaceDeformer(name)
+        psd.connectSkinCluster(skinCluster, psd.geometryIndex(sel[0]))
+
+        return psd
+
+    @staticmethod
+    def findSkinCluster(geometry):
+        '''Find skinCluster deforming geometry'''
+
         skinCluster = None
-        history = cmds.listHistory(sel[0]) or []
+        history = cmds.listHistory(geometry) or []
         for h in history:
             if cmds.nodeType(h) == 'skinCluster':
                 skinCluster = h
@@ -39,11 +65,7 @@ class PoseSpaceDeformer(object):
         if not skinCluster:
             raise RuntimeError('PSD can only be created on mesh with skinCluster')
 
-        name = cmds.deformer(type=NODETYPE, name=name)[0]
-
-        cmds.connectAttr(skinCluster+'.weightList', name+'.skinClusterWeightList')
-
-        return PoseSpaceDeformer(name)
+        return skinCluster
 
     def __init__(self, name):
         
@@ -52,28 +74,121 @@ class PoseSpaceDeformer(object):
             return
         raise RuntimeError('{} is not of type {}'.format(name, NODETYPE))
     
+    def connectSkinCluster(self, skinCluster, geometryIndex=0):
+        '''Connect skinCluster weights and matrices the deformer evaluates the geometry with'''
+
+        scAttr = '{}.skinCluster[{}]'.format(self.name, geometryIndex)
+        for src, dst in [('weightList', 'geomWeightList'),
+                         ('matrix', 'geomMatrix'),
+                         ('bindPreMatrix', 'geomBindPreMatrix')]:
+            if not cmds.isConnected(skinCluster+'.'+src, scAttr+'.'+dst):
+                cmds.connectAttr(skinCluster+'.'+src, scAttr+'.'+dst, f=1)
+
+    def geometries(self):
+        '''Get deformed geometries'''
+
+        return cmds.deformer(self.name, q=1, g=1) or []
+
+    def geometryIndex(self, geometry):
+        '''Get geometry (input) index of deformed geometry'''
+
+        shapes = cmds.ls(geometry, long=1)
+        if shapes and cmds.nodeType(shapes[0]) == 'transform':
+            shapes = cmds.listRelatives(shapes[0], s=1, ni=1, f=1) or []
+
+        geoms = cmds.ls(self.geometries(), long=1)
+        indices = cmds.deformer(self.name, q=1, gi=1) or []
+        for geom, index in zip(geoms, indices):
+            if geom in shapes:
+                return index
+
+        raise RuntimeError('{} is not deformed by {}'.format(geometry, self.name))
+
+    def addGeometry(self, geometry):
+        '''Add skinned geometry to the deformer, poses are shared by all geometries'''
+
+        skinCluster = PoseSpaceDeformer.findSkinCluster(geometry)
+
+        cmds.deformer(self.name, e=1, g=geometry)
+        self.connectSkinCluster(skinCluster, self.geometryIndex(geometry))
+
+    def joint(self, jointIndex):
+        '''Get joint driving the given joint index'''
+
+        jointAttr = '{}.joint[{}]'.format(self.name, jointIndex)
+        for attr in ['jointRot', 'jointMatrix', 'jointRestOrient']:
+            conns = cmds.listConnections('{}.{}'.format(jointAttr, attr), s=1, d=0) or []
+            if conns:
+                return conns[0]
+        return None
+
+    def jointIndex(self, joint):
+        '''Get joint index of joint, -1 if it isnt connected'''
+
+        for ji, jointName in self.jointNames().items():
+            if jointName == joint:
+                return ji
+        return -1
+
+    def jointNames(self):
+        '''Get {jointIndex: joint} of all joint indices, in one query'''
+
+        jointIndices = cmds.poseSpaceCommand(self.name, q=1, jointIndices=1) or []
+        jointNames = cmds.poseSpaceCommand(self.name, q=1, jointNames=1) or []
+        return dict((ji, jn or None) for ji, jn in zip(jointIndices, jointNames))
+
+    def setJointInputMode(self, mode):
+        '''Set joint input mode (JOINT_INPUT_EULER/MATRIX/QUATERNION), reconnecting joints'''
+
+        jointIndices = cmds.getAttr(self.name+'.joint', mi=1) or []
+        joints = [(ji, self.joint(ji)) for ji in jointIndices]
+
+        cmds.setAttr(self.name+'.jointInputMode', mode)
+
+        for ji, joint in joints:
+            if joint:
+                self._connectJoint(joint, ji)
+
+    def _connectJoint(self, joint, index):
+        '''Connect joint onto joint index as per jointInputMode'''
+
+        jointAttr = '{}.joint[{}]'.format(self.name, index)
+        mode = cmds.getAttr(self.name+'.jointInputMode')
+
+        for attr in ['jointRot', 'jointMatrix', 'jointQuat', 'jointRestOrient']:
+            conns = cmds.listConnections('{}.{}'.format(jointAttr, attr), s=1, d=0, p=1) or []
+            for c in conns:
+                cmds.disconnectAttr(c, '{}.{}'.format(jointAttr, attr))
+
+        if mode == JOINT_INPUT_EULER:
+            cmds.connectAttr(joint+'.rotate', jointAttr+'.jointRot')
+
+        elif mode == JOINT_INPUT_MATRIX:
+            cmds.connectAttr(joint+'.matrix', jointAttr+'.jointMatrix')
+            if cmds.attributeQuery('jointOrient', node=joint, exists=1):
+                cmds.connectAttr(joint+'.jointOrient', jointAttr+'.jointRestOrient')
+
+        else:
+            if not cmds.pluginInfo('matrixNodes', q=1, loaded=1):
+                cmds.loadPlugin('matrixNodes')
+            decompose = cmds.createNode('decomposeMatrix', name=joint+'_psdDecompose')
+            cmds.connectAttr(joint+'.matrix', decompose+'.inputMatrix')
+            cmds.connectAttr(decompose+'.outputQuat', jointAttr+'.jointQuat')
+            if cmds.attributeQuery('jointOrient', node=joint, exists=1):
+                cmds.connectAttr(joint+'.jointOrient', jointAttr+'.jointRestOrient')
+
     def poseNames(self):
         '''Get pose names'''
 
-        poseIndices = cmds.getAttr(self.name+'.pose', mi=1) or []
-
-        poseNames = []
-        for pi in poseIndices:
-            pn = cmds.getAttr('{}.pose[{}].poseName'.format(self.name, pi))
-            poseNames.append(pn)
-        return poseNames
+        return cmds.poseSpaceCommand(self.name, q=1, poseNames=1) or []
 
     def poseIndex(self, poseName):
         '''Get pose index'''
 
-        poseIndices = cmds.getAttr(self.name+'.pose', mi=1) or []
-
-        for pi in poseIndices:
-            poseAttr = '{}.pose[{}]'.format(self.name, pi)
-            if poseName == cmds.getAttr('{}.poseName'.format(poseAttr)):
-                return pi
-
-        raise RuntimeError('{} pose doesnt exist'.format(poseName))        
+        index = cmds.poseSpaceCommand(self.name, q=1, poseIndex=poseName)
+        if index == -1:
+            raise RuntimeError('{} pose doesnt exist'.format(poseName))
+        return index
 
     def poseAttr(self, poseName):
         '''Get pose attr'''
@@ -89,8 +204,9 @@ class PoseSpaceDeformer(object):
         
     def printPoseWeights(self):
         
-        for p in self.poseNames():
-            print '{}: {}'.format(p, self.poseWeight(p))
+        poseWeights = cmds.poseSpaceCommand(self.name, q=1, poseWeights=1) or []
+        for p, w in zip(self.poseNames(), poseWeights):
+            print '{}: {}'.format(p, w)
         
     def addPose(self, poseName):
         '''Add new pose'''
@@ -117,21 +233,16 @@ class PoseSpaceDeformer(object):
         for joint in joints:
 
             # Get joint index
-            index = -1
-            jointIndices = cmds.getAttr(self.name+'.joint', mi=1) or []
-            for ji in jointIndices:
-                conns = cmds.listConnections('{}.joint[{}].jointRot'.format(self.name, ji), s=1, d=0) or []
-                if conns and conns[0] == joint:
-                    index = ji
-                    break
+            index = self.jointIndex(joint)
 
             # Connect joint
             if index == -1:
+                jointIndices = cmds.getAttr(self.name+'.joint', mi=1) or []
                 if jointIndices:
                     index = jointIndices[-1] + 1
                 else:
                     index = 0
-                cmds.connectAttr(joint+'.rotate', '{}.joint[{}].jointRot'.format(self.name, index))
+                self._connectJoint(joint, index)
 
             # Set pose joint values
             rot = cmds.getAttr(joint+'.rotate')
@@ -140,28 +251,15 @@ class PoseSpaceDeformer(object):
     def poseJoints(self, poseName):
         '''Get pose joint names'''
 
-        poseAttr = self.poseAttr(poseName)
-
-        joints = []
-        jointIndices = cmds.getAttr('{}.poseJoint'.format(poseAttr), mi=1) or []
-        for ji in jointIndices:
-            conns = cmds.listConnections('{}.joint[{}].jointRot'.format(self.name, ji))
-            joints.append(conns[0])
+        jointNames = self.jointNames()
+        jointIndices = cmds.poseSpaceCommand(self.name, q=1, poseJoints=self.poseIndex(poseName)) or []
 
-        return joints
+        return [jointNames.get(ji) for ji in jointIndices]
     
     def updatePoseJoints(self, poseName):
         '''Update pose joint values'''
 
-        poseAttr = self.poseAttr(poseName)
-
-        jointIndices = cmds.getAttr('{}.poseJoint'.format(poseAttr), mi=1) or []
-        for ji in jointIndices:
-            conns = cmds.listConnections('{}.joint[{}].jointRot'.format(self.name, ji))
-
-            # Set pose joint values
-            rot = cmds.getAttr(conns[0]+'.rotate')
-            cmds.setAttr('{}.poseJoint[{}].poseJointRot'.format(poseAttr, ji), *rot[0])
+        cmds.poseSpaceCommand(self.name, updatePoseJoints=self.poseIndex(poseName))
 
     def setToPose(self, poseName):
         '''Set the joints to pose joint rotations'''
@@ -174,8 +272,8 @@ class PoseSpaceDeformer(object):
             rot = cmds.getAttr('{}.poseJoint[{}].poseJointRot'.format(poseAttr, ji))
 
             # Set joint values
-            conns = cmds.listConnections('{}.joint[{}].jointRot'.format(self.name, ji))
-            cmds.setAttr(conns[0]+'.rotate', *rot[0])
+            joint = self.joint(ji)
+            cmds.setAttr(joint+'.rotate', *rot[0])
 
 
     def setPoseFallOff(self, poseName, fallOff):
@@ -194,15 +292,12 @@ class PoseSpaceDeformer(object):
 
     def poseTargetIndex(self, poseName, targetName):
 
-        poseAttr = self.poseAttr(poseName)
-
-        targetIndices = cmds.getAttr('{}.poseTarget'.format(poseAttr), mi=1) or []
-        for ti in targetIndices:
-            targetAttr = '{}.poseTarget[{}]'.format(poseAttr, ti)
-            if cmds.getAttr('{}.poseTargetName'.format(targetAttr)) == targetName:
-                return ti
+        poseIndex = self.poseIndex(poseName)
 
-        raise RuntimeError('{} target doesnt exist in pose {}'.format(targetName, poseName))
+        index = cmds.poseSpaceCommand(self.name, q=1, poseTargetIndex=(poseIndex, targetName))
+        if index == -1:
+            raise RuntimeError('{} target doesnt exist in pose {}'.format(targetName, poseName))
+        return index
 
     def poseTargetAttr(self, poseName, targetName):
         '''Get pose target attr'''
@@ -216,15 +311,9 @@ class PoseSpaceDeformer(object):
     def poseTargets(self, poseName):
         '''Return target names'''
 
-        poseAttr = self.poseAttr(poseName)
-
-        targets = []
-        targetIndices = cmds.getAttr('{}.poseTarget'.format(poseAttr), mi=1) or []
-        for ti in targetIndices:
-            targetName = cmds.getAttr('{}.poseTarget[{}].poseTargetName'.format(poseAttr, ti))
-            targets.append(targetName)
+        poseIndex = self.poseIndex(poseName)
 
-        return targets
+        return cmds.poseSpaceCommand(self.name, q=1, poseTargetNames=poseIndex) or []
 
 
     def setPoseTargetEnvelope(self, poseName, targetName, envelope):
@@ -232,21 +321,25 @@ class PoseSpaceDeformer(object):
         targetAttr = self.poseTargetAttr(poseName, targetName)
         cmds.setAttr(targetAttr+'.poseTargetEnvelope', envelope)
 
-    def initPoseTarget(self, poseName, targetName):
-        '''Initialize to create/reset pose target'''
+    def initPoseTarget(self, poseName, targetName, geometry=None):
+        '''Initialize to create/reset pose target of geometry (first deformed geometry by default)'''
 
         if self._poseTarget:
             raise RuntimeError('Pose target is already initialized, set/update/cancel before re-initializing')
 
         poseAttr = self.poseAttr(poseName)
 
+        defGeom = self.geometries()
+        if geometry is None:
+            geometry = defGeom[0]
+        geomIndex = self.geometryIndex(geometry)
+
         # Duplicate geometry for target
-        defGeom = cmds.deformer(self.name, q=1, g=1)
-        duplicate = cmds.duplicate(defGeom)
+        duplicate = cmds.duplicate(geometry)
         cmds.hide(defGeom)
         cmds.select(duplicate)
 
-        self._poseTarget = (poseName, targetName, duplicate)
+        self._poseTarget = (poseName, targetName, duplicate, geomIndex)
         
         cmds.warning('Edit the target geometry')
         return duplicate[0]
@@ -257,21 +350,29 @@ class PoseSpaceDeformer(object):
         if not self._poseTarget:
             raise RuntimeError('Pose target should be initialized first')
 
-        (poseName, targetName, duplicate) = self._poseTarget
+        (poseName, targetName, duplicate, geomIndex) = self._poseTarget
 
 
+        poseIndex = self.poseIndex(poseName)
+        targetIndex = self._addPoseTarget(poseName, targetName)
+
+        cmds.select(duplicate)
+        cmds.poseSpaceCommand(self.name, setPoseTarget=[poseIndex, targetIndex], geometryIndex=geomIndex)
+
+        self.cancelPoseTarget()
+        
+
+    def _addPoseTarget(self, poseName, targetName):
+        '''Return index of pose target, adding a new target entry if it doesnt exist'''
+
         # Find target index
-        poseAttr = self.poseAttr(poseName)
-        index = -1
-        targetIndices = cmds.getAttr('{}.poseTarget'.format(poseAttr), mi=1) or []
-        for ti in targetIndices:
-            poseTargetAttr = '{}.poseTarget[{}]'.format(poseAttr, ti)
-            if cmds.getAttr('{}.poseTargetName'.format(poseTargetAttr)) == targetName:
-                index = ti
-                break
+        poseIndex = self.poseIndex(poseName)
+        poseAttr = '{}.pose[{}]'.format(self.name, poseIndex)
+        index = cmds.poseSpaceCommand(self.name, q=1, poseTargetIndex=(poseIndex, targetName))
 
         # Add new target entry
         if index == -1:
+            targetIndices = cmds.poseSpaceCommand(self.name, q=1, poseTargetIndices=poseIndex) or []
             if targetIndices:
                 index = targetIndices[-1] + 1
             else:
@@ -281,14 +382,24 @@ class PoseSpaceDeformer(object):
 
             cmds.aliasAttr(poseName+'_'+targetName, poseTargetAttr+'.poseTargetEnvelope')
 
-        poseIndex = self.poseIndex(poseName)
-        targetIndex = index
+        return index
 
-        cmds.select(duplicate)
-        cmds.poseSpaceCommand(self.name, setPoseTarget=[poseIndex, targetIndex])
+    def setPoseTargets(self, targets, geometry=None):
+        '''Set many pose targets at once from (poseName, targetName, mesh) tuples.
+        Skin data is read once for all the targets'''
 
-        self.cancelPoseTarget()
-        
+        if geometry is None:
+            geometry = self.geometries()[0]
+        geomIndex = self.geometryIndex(geometry)
+
+        batch = []
+        for (poseName, targetName, mesh) in targets:
+            poseIndex = self.poseIndex(poseName)
+            targetIndex = self._addPoseTarget(poseName, targetName)
+            batch.append((poseIndex, targetIndex, mesh))
+
+        if batch:
+            cmds.poseSpaceCommand(self.name, batchSetPoseTarget=batch, geometryIndex=geomIndex)
 
     def updatePoseTarget(self):
         '''Update pose target after initializing'''
@@ -296,13 +407,13 @@ class PoseSpaceDeformer(object):
         if not self._poseTarget:
             raise RuntimeError('Pose target should be initialized first')
 
-        (poseName, targetName, duplicate) = self._poseTarget
+        (poseName, targetName, duplicate, geomIndex) = self._poseTarget
 
         poseIndex = self.poseIndex(poseName)
         targetIndex = self.poseTargetIndex(poseName, targetName)
 
         cmds.select(duplicate)
-        cmds.poseSpaceCommand(self.name, updatePoseTarget=[poseIndex, targetIndex])
+        cmds.poseSpaceCommand(self.name, updatePoseTarget=[poseIndex, targetIndex], geometryIndex=geomIndex)
 
         self.cancelPoseTarget()
 
@@ -312,12 +423,12 @@ class PoseSpaceDeformer(object):
         if not self._poseTarget:
             raise RuntimeError('Pose target should be initialized first')
 
-        (poseName, targetName, duplicate) = self._poseTarget
+        (poseName, targetName, duplicate, geomIndex) = self._poseTarget
         self._poseTarget = None
 
         cmds.delete(duplicate)
 
-        defGeom = cmds.deformer(self.name, q=1, g=1)
+        defGeom = self.geometries()
         cmds.showHidden(defGeom)
         cmds.select(defGeom)
 
@@ -335,6 +446,119 @@ class PoseSpaceDeformer(object):
 
         cmds.removeMultiInstance(targetAttr, b=1)
 
+    def pruneTargets(self, threshold, mergeTolerance=None):
+        '''Drop target deltas shorter than threshold (world space) and optionally
+        merge near identical targets of a pose. Returns the savings report'''
+
+        kwargs = {}
+        if mergeTolerance is not None:
+            kwargs['mergeTolerance'] = mergeTolerance
+
+        return cmds.poseSpaceCommand(self.name, pruneTargets=threshold, **kwargs)
+
+    def setPruneThreshold(self, threshold):
+        '''Prune deltas shorter than threshold (world space) whenever targets are set'''
+
+        cmds.setAttr(self.name+'.pruneThreshold', threshold)
+
+    def startSculpt(self, poseName, targetName, geometry=None):
+        '''Sculpt pose target live on the deformed geometry, no duplicate mesh.
+        Feed strokes with setSculptDelta, then commitSculpt or cancelSculpt'''
+
+        if geometry is None:
+            geometry = self.geometries()[0]
+        geomIndex = self.geometryIndex(geometry)
+
+        poseIndex = self.poseIndex(poseName)
+        targetIndex = self._addPoseTarget(poseName, targetName)
+
+        self.setSculptDelta([], [])
+        cmds.setAttr(self.name+'.sculptGeometry', geomIndex)
+        cmds.setAttr(self.name+'.sculptTarget', targetIndex)
+        cmds.setAttr(self.name+'.sculptPose', poseIndex)
+
+    def setSculptDelta(self, components, deltas):
+        '''Current offset (object space of the deformed geometry) of touched
+        vertices. Only components that changed since the last call are converted'''
+
+        cmds.setAttr(self.name+'.sculptComponents', components, type='Int32Array')
+        cmds.setAttr(self.name+'.sculptDelta', len(deltas), *deltas, type='vectorArray')
+
+    def commitSculpt(self):
+        '''Add sculpted offsets to the pose target, undoable'''
+
+        return cmds.poseSpaceCommand(self.name, commitSculpt=True)
+
+    def cancelSculpt(self):
+        '''Drop sculpted offsets not yet committed and end sculpting'''
+
+        cmds.setAttr(self.name+'.sculptPose', -1)
+        self.setSculptDelta([], [])
+
+    def exportPoseLibrary(self, path):
+        '''Export poses and targets to a binary pose library file'''
+
+        return cmds.poseSpaceCommand(self.name, exportPoseLibrary=path)
+
+    def importPoseLibrary(self, path):
+        '''Import poses and targets from a binary pose library file'''
+
+        numPoses = cmds.poseSpaceCommand(self.name, importPoseLibrary=path)
+
+        # Restore target envelope aliases
+        aliasAttrs = cmds.aliasAttr(self.name, q=1) or []
+        for poseName in self.poseNames():
+            for targetName in self.poseTargets(poseName):
+                alias = poseName+'_'+targetName
+                if alias not in aliasAttrs:
+                    targetAttr = self.poseTargetAttr(poseName, targetName)
+                    cmds.aliasAttr(alias, targetAttr+'.poseTargetEnvelope')
+
+        return numPoses
+
+    def enableTargetStreaming(self, path, memoryBudget=1024, stripTargets=False):
+        '''Export targets to a pose library and page them in from there on demand,
+        keeping at most memoryBudget MB resident. stripTargets removes the target
+        deltas from the node so the scene no longer carries them'''
+
+        self.exportPoseLibrary(path)
+
+        cmds.setAttr(self.name+'.poseLibraryFile', path, type='string')
+        cmds.setAttr(self.name+'.targetMemoryBudget', memoryBudget)
+        cmds.setAttr(self.name+'.streamTargets', True)
+
+        if stripTargets:
+            for poseName in self.poseNames():
+                for targetName in self.poseTargets(poseName):
+                    targetAttr = self.poseTargetAttr(poseName, targetName)
+                    for attr in ('poseTargetGeomComponents', 'poseTargetGeomDelta'):
+                        for gi in cmds.getAttr('{}.{}'.format(targetAttr, attr), mi=1) or []:
+                            cmds.removeMultiInstance('{}.{}[{}]'.format(targetAttr, attr, gi), b=1)
+
+    def disableTargetStreaming(self):
+        '''Go back to targets stored on the node, importing them from the pose library'''
+
+        path = cmds.getAttr(self.name+'.poseLibraryFile')
+        if path:
+            self.importPoseLibrary(path)
+
+        cmds.setAttr(self.name+'.streamTargets', False)
+
+    def enableTargetCompression(self, maxError=0.01):
+        '''Reconstruct targets from a low rank (PCA) basis with relative error
+        under maxError. Returns the rank used'''
+
+        cmds.setAttr(self.name+'.compressionError', maxError)
+        cmds.setAttr(self.name+'.compressionMode', 1)
+
+        # Compressed when the deformed geometry evaluates next
+        cmds.dgeval(self.geometries())
+        return cmds.getAttr(self.name+'.compressionRank')
+
+    def disableTargetCompression(self):
+
+        cmds.setAttr(self.name+'.compressionMode', 0)
+
     def showUI(self):
 
         from functools import partial
@@ -358,14 +582,20 @@ class PoseSpaceDeformer(object):
         cmds.separator()
         cmds.separator()
         cmds.separator()
-        for poseName in self.poseNames():
-            poseAttr = self.poseAttr(poseName)
+        # All names/indices up front, one query each
+        jointNames = self.jointNames()
+        poseNames = self.poseNames()
+        poseIndices = cmds.poseSpaceCommand(self.name, q=1, poseIndices=1) or []
+
+        for poseName, poseIndex in zip(poseNames, poseIndices):
+            poseAttr = '{}.pose[{}]'.format(self.name, poseIndex)
             cmds.text(label=poseName)
             cmds.attrControlGrp(attribute=poseAttr+'.poseWeight')
-            jts = self.poseJoints(poseName)
+            jtIndices = cmds.poseSpaceCommand(self.name, q=1, poseJoints=poseIndex) or []
+            jts = [jointNames.get(ji) for ji in jtIndices]
             if len(jts) == 1:
                 cmds.button(label=jts[0], c=partial(selectInScene, jts[0]), ann='Click to select joint')
-                jtIdx = cmds.getAttr(poseAttr+'.poseJoint', mi=1)[0]
+                jtIdx = jtIndices[0]
                 jtRot = cmds.getAttr('{}.poseJoint[{}].poseJointRot'.format(poseAttr, jtIdx))[0]
                 jtRot = '{:.2f}, {:.2f}, {:.2f}'.format(jtRot[0], jtRot[1], jtRot[2])
                 cmds.button(label=jtRot, c=partial(setToPose, self, poseName), ann='Click to setToPose')
@@ -0,0 +1,25 @@
+#include "Profiler.h"
+#include "utils.h"
+
+
+static int _category = 0;
+
+void Profiler::initialize()
+{
+#if MAYA_API_VERSION >= 20190000
+    _category = MProfiler::addCategory(PluginNames::ProfilerCategory, "Pose space and relax deformers");
+#endif
+}
+
+void Profiler::uninitialize()
+{
+#if MAYA_API_VERSION >= 20190000
+    MProfiler::removeCategory(PluginNames::ProfilerCategory);
+#endif
+    _category = 0;
+}
+
+int Profiler::category()
+{
+    return _category;
+}
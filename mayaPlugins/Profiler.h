@@ -0,0 +1,54 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+
+#if MAYA_API_VERSION >= 20190000
+#include <maya/MProfiler.h>
+#include <maya/MProfilingScope.h>
+#endif
+
+
+// Plugin category in Maya's profiler, added in initializePlugin
+namespace Profiler
+{
+    void    initialize();
+    void    uninitialize();
+    int     category();
+};
+
+
+// Profiler event over the scope, named by a string literal (Maya keeps the
+// pointer). Also adds the elapsed milliseconds to elapsed, if given, for the
+// stats outputs of the nodes
+class ProfileScope
+{
+public:
+    ProfileScope( const char* name, double* elapsed = 0 )
+    :
+#if MAYA_API_VERSION >= 20190000
+        _scope(Profiler::category(), MProfiler::kColorE_L3, name),
+#endif
+        _elapsed(elapsed),
+        _start(std::chrono::high_resolution_clock::now())
+    {
+    }
+
+    ~ProfileScope()
+    {
+        if (_elapsed)
+            *_elapsed += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - _start).count();
+    }
+
+private:
+    ProfileScope( const ProfileScope& );
+    ProfileScope& operator=( const ProfileScope& );
+
+#if MAYA_API_VERSION >= 20190000
+    MProfilingScope                                     _scope;
+#endif
+    double*                                             _elapsed;
+    std::chrono::high_resolution_clock::time_point      _start;
+};
+
+#endif
@@ -1,15 +1,20 @@
 #include "RelaxDeformer.h"
 #include "utils.h"
+#include "Profiler.h"
+#include "Core/Relax.h"
 
 #include <iostream>
 #include <vector>
+#include <string.h>
 
 #include <maya/MGlobal.h>
 #include <maya/MFnNumericAttribute.h>
+#include <maya/MFnEnumAttribute.h>
+#include <maya/MFnTypedAttribute.h>
 #include <maya/MFnMesh.h>
-#include <maya/MItMeshVertex.h>
 #include <maya/MPointArray.h>
 #include <maya/MIntArray.h>
+#include <maya/MPlugArray.h>
 
 
 MTypeId RelaxDeformer::id( PluginIDs::RelaxDeformer );
@@ -21,7 +26,27 @@ MObject RelaxDeformer::aDebug;
 
 MObject RelaxDeformer::aIterations;
 MObject RelaxDeformer::aAmount;
-
+MObject RelaxDeformer::aTolerance;
+MObject RelaxDeformer::aToleranceMode;
+MObject RelaxDeformer::aWarmStart;
+MObject RelaxDeformer::aRestRelative;
+MObject RelaxDeformer::aRestMesh;
+
+MObject RelaxDeformer::aStatsEvaluationTime;
+MObject RelaxDeformer::aStatsTopologyTime;
+MObject RelaxDeformer::aStatsRelaxTime;
+MObject RelaxDeformer::aStatsWriteTime;
+MObject RelaxDeformer::aStatsIterations;
+MObject RelaxDeformer::aStatsTopologies;
+MObject RelaxDeformer::aStatsCacheHitRate;
+
+
+RelaxDeformer::RelaxDeformer()
+:   _weightsGeneration(0),
+    _deforms(0),
+    _replays(0)
+{
+}
 
 void* RelaxDeformer::creator()
 {
@@ -33,6 +58,8 @@ MStatus RelaxDeformer::initialize()
     MStatus stat;
 
     MFnNumericAttribute nAttr;
+    MFnEnumAttribute eAttr;
+    MFnTypedAttribute tAttr;
 
 #ifdef _DEBUG
     aDebug = nAttr.create("debug", "d", MFnNumericData::kBoolean);
@@ -50,14 +77,196 @@ MStatus RelaxDeformer::initialize()
     nAttr.setKeyable(true);
     addAttribute(aAmount);
 
+    // Stop before iterations once a pass moves vertices less than tolerance
+    // (max or RMS displacement). 0 always runs all iterations
+    aTolerance = nAttr.create("tolerance", "tol", MFnNumericData::kDouble, 0.0);
+    nAttr.setMin(0.0);
+    nAttr.setKeyable(true);
+    addAttribute(aTolerance);
+
+    aToleranceMode = eAttr.create("toleranceMode", "tlm", Relax::TOLERANCE_MAX);
+    eAttr.addField( "Max", Relax::TOLERANCE_MAX );
+    eAttr.addField( "RMS", Relax::TOLERANCE_RMS );
+    addAttribute(aToleranceMode);
+
+    // Start from the last cold started result moved by the input motion, if
+    // it converged to tolerance and the input moved less than tolerance since.
+    // Needs tolerance, results then depend on the frames evaluated before by
+    // about tolerance
+    aWarmStart = nAttr.create("warmStart", "wst", MFnNumericData::kBoolean, false);
+    addAttribute(aWarmStart);
+
+    // Delta mush: relax, then put back the detail relax takes off restMesh.
+    // Always runs all iterations, tolerance and warm start dont apply
+    aRestRelative = nAttr.create("restRelative", "rrl", MFnNumericData::kBoolean, false);
+    addAttribute(aRestRelative);
+
+    aRestMesh = tAttr.create("restMesh", "rsm", MFnData::kMesh);
+    tAttr.setStorable(false);
+    addAttribute(aRestMesh);
+
+    // Stats of the last evaluation, times in milliseconds. Written along with
+    // outputGeom and dirtied with it, reading one evaluates outputGeom.
+    // statsIterations is the most passes any geometry ran, statsTopologies
+    // the topologies shared plugin wide and the cache hit rate the share of
+    // deforms replayed since the node was created
+    aStatsEvaluationTime = nAttr.create("statsEvaluationTime", "sev", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsEvaluationTime);
+
+    aStatsTopologyTime = nAttr.create("statsTopologyTime", "sto", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsTopologyTime);
+
+    aStatsRelaxTime = nAttr.create("statsRelaxTime", "srt", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsRelaxTime);
+
+    aStatsWriteTime = nAttr.create("statsWriteTime", "swt", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsWriteTime);
+
+    aStatsIterations = nAttr.create("statsIterations", "sit", MFnNumericData::kInt, 0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsIterations);
+
+    aStatsTopologies = nAttr.create("statsTopologies", "stp", MFnNumericData::kInt, 0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsTopologies);
+
+    aStatsCacheHitRate = nAttr.create("statsCacheHitRate", "shr", MFnNumericData::kDouble, 0.0);
+    nAttr.setWritable(false);
+    nAttr.setStorable(false);
+    addAttribute(aStatsCacheHitRate);
+
     attributeAffects(aIterations, outputGeom);
     attributeAffects(aAmount, outputGeom);
+    attributeAffects(aTolerance, outputGeom);
+    attributeAffects(aToleranceMode, outputGeom);
+    attributeAffects(aWarmStart, outputGeom);
+    attributeAffects(aRestRelative, outputGeom);
+    attributeAffects(aRestMesh, outputGeom);
+
+    attributeAffects(outputGeom, aStatsEvaluationTime);
+    attributeAffects(outputGeom, aStatsTopologyTime);
+    attributeAffects(outputGeom, aStatsRelaxTime);
+    attributeAffects(outputGeom, aStatsWriteTime);
+    attributeAffects(outputGeom, aStatsIterations);
+    attributeAffects(outputGeom, aStatsTopologies);
+    attributeAffects(outputGeom, aStatsCacheHitRate);
 
     return MStatus::kSuccess;
 
 }
 
 
+// Deform all geometries, then report the stages of this evaluation
+MStatus RelaxDeformer::compute( const MPlug& plug, MDataBlock& block )
+{
+    MStatus stat;
+
+    // Stats are written by the outputGeom evaluation, run it through the
+    // datablock for the dirty geometries if a stat is read first
+    if (plug == aStatsEvaluationTime ||
+        plug == aStatsTopologyTime ||
+        plug == aStatsRelaxTime ||
+        plug == aStatsWriteTime ||
+        plug == aStatsIterations ||
+        plug == aStatsTopologies ||
+        plug == aStatsCacheHitRate )
+    {
+        MPlug pOutputGeom(thisMObject(), outputGeom);
+        MArrayDataHandle outputArrHnd = block.outputArrayValue(outputGeom);
+        for (unsigned i = 0; i < outputArrHnd.elementCount(); ++i, outputArrHnd.next())
+        {
+            MPlug pElement = pOutputGeom.elementByLogicalIndex(outputArrHnd.elementIndex());
+            if (block.isClean(pElement))
+                continue;
+
+            stat = compute(pElement, block);
+            MCheckStatus(stat, "");
+        }
+
+        return block.setClean(plug);
+    }
+
+    if (plug != outputGeom)
+        return MPxDeformerNode::compute(plug, block);
+
+    _stats = Stats();
+    double evaluationTime = 0;
+    {
+        ProfileScope scope("relaxDeformer", &evaluationTime);
+
+        stat = MPxDeformerNode::compute(plug, block);
+        MCheckStatus(stat, "");
+    }
+
+    MDataHandle handle = block.outputValue(aStatsEvaluationTime);
+    handle.setDouble(evaluationTime);
+    handle.setClean();
+
+    handle = block.outputValue(aStatsTopologyTime);
+    handle.setDouble(_stats.topologyTime);
+    handle.setClean();
+
+    handle = block.outputValue(aStatsRelaxTime);
+    handle.setDouble(_stats.relaxTime);
+    handle.setClean();
+
+    handle = block.outputValue(aStatsWriteTime);
+    handle.setDouble(_stats.writeTime);
+    handle.setClean();
+
+    handle = block.outputValue(aStatsIterations);
+    handle.setInt(_stats.iterations);
+    handle.setClean();
+
+    handle = block.outputValue(aStatsTopologies);
+    handle.setInt(TopologyCache::size());
+    handle.setClean();
+
+    handle = block.outputValue(aStatsCacheHitRate);
+    handle.setDouble(_deforms ? (double)_replays / _deforms : 0.0);
+    handle.setClean();
+
+    return MS::kSuccess;
+}
+
+
+// Painted weights arent part of the input fingerprint, count their edits instead
+MStatus RelaxDeformer::setDependentsDirty(  const MPlug& plugBeingDirtied, 
+                                            MPlugArray& affectedPlugs )
+{
+    if (plugBeingDirtied == weightList ||
+        plugBeingDirtied == weights )
+        ++_weightsGeneration;
+
+    return MPxDeformerNode::setDependentsDirty(plugBeingDirtied, affectedPlugs);
+}
+
+#if MAYA_API_VERSION >= 201600
+MStatus RelaxDeformer::preEvaluation(   const MDGContext& context, 
+                                        const MEvaluationNode& evaluationNode )
+{
+    if (!context.isNormal())
+        return MS::kSuccess;
+
+    if (evaluationNode.dirtyPlugExists(weightList) ||
+        evaluationNode.dirtyPlugExists(weights) )
+        ++_weightsGeneration;
+
+    return MS::kSuccess;
+}
+#endif
+
+
 MStatus RelaxDeformer::deform(  MDataBlock&     block, 
                                 MItGeometry&    itGeo, 
                                 const MMatrix&  world, 
@@ -83,6 +292,23 @@ MStatus RelaxDeformer::deform(  MDataBlock&     block,
     handle = block.inputValue(aAmount);
     float amount = handle.asFloat();
 
+    handle = block.inputValue(aTolerance);
+    double tolerance = handle.asDouble();
+
+    handle = block.inputValue(aToleranceMode);
+    short toleranceMode = handle.asShort();
+
+    handle = block.inputValue(aWarmStart);
+    bool warmStart = handle.asBool();
+
+    handle = block.inputValue(aRestRelative);
+    bool restRelative = handle.asBool();
+    if (restRelative)
+    {
+        tolerance = 0;
+        warmStart = false;
+    }
+
     // Get mesh fn
     MArrayDataHandle arrHandle = block.inputArrayValue(input);
     arrHandle.jumpToElement(geomIndex);
@@ -92,51 +318,149 @@ MStatus RelaxDeformer::deform(  MDataBlock&     block,
     MObject obj = handle.asMesh();
     MFnMesh fnMesh(obj);
 
-    // Get all positions
-    MPointArray positions;
-    fnMesh.getPoints(positions);
+    // Replay the last output if points and attributes didnt change since
+    const float* rawPoints = fnMesh.getRawPoints(&stat);
+    MCheckStatus(stat, "");
+
+    uint64_t key = hashBytes(rawPoints, fnMesh.numVertices() * 3 * sizeof(float));
+    key = hashBytes(&iterations, sizeof(iterations), key);
+    key = hashBytes(&amount, sizeof(amount), key);
+    key = hashBytes(&env, sizeof(env), key);
+    key = hashBytes(&tolerance, sizeof(tolerance), key);
+    key = hashBytes(&toleranceMode, sizeof(toleranceMode), key);
+    key = hashBytes(&warmStart, sizeof(warmStart), key);
+    key = hashBytes(&_weightsGeneration, sizeof(_weightsGeneration), key);
+
+    // Rest points go into both fingerprints, rest deltas are rebuilt on their own key
+    MObject restObj;
+    uint64_t restKey = 0;
+    if (restRelative)
+    {
+        restObj = block.inputValue(aRestMesh).asMesh();
+        if (restObj.isNull())
+            MReturnFailure(ErrorStr::RelaxRestMeshNotConnected);
 
+        MFnMesh fnRestMesh(restObj);
+        if (fnRestMesh.numVertices() != fnMesh.numVertices())
+            MReturnFailure(ErrorStr::RelaxRestMeshMismatch);
 
-    // Get connected vertices
-    MItMeshVertex itVtx(obj);
-    std::vector<MIntArray> connectedVertices(itVtx.count());
-    for (itVtx.reset(); !itVtx.isDone(); itVtx.next())
-        itVtx.getConnectedVertices(connectedVertices[itVtx.index()]);
+        const float* rawRestPoints = fnRestMesh.getRawPoints(&stat);
+        MCheckStatus(stat, "");
+
+        restKey = hashBytes(rawRestPoints, fnRestMesh.numVertices() * 3 * sizeof(float));
+        restKey = hashBytes(&iterations, sizeof(iterations), restKey);
+        restKey = hashBytes(&amount, sizeof(amount), restKey);
+        key = hashBytes(&restKey, sizeof(restKey), key);
+    }
 
-    // Find relax positions
-    MPointArray newPositions = positions;
-    for (int i = 0; i < iterations; ++i)
+    GeomCache& geomCache = _geomCaches[geomIndex];
+    ++_deforms;
+    if (geomCache.key == key && geomCache.positions.length() == (unsigned)itGeo.count())
     {
-        for (itVtx.reset(); !itVtx.isDone(); itVtx.next())
+        ++_replays;
+        return itGeo.setAllPositions(geomCache.positions);
+    }
+
+    // Get connected vertices, from the shared topology of these face vertices.
+    // Input meshes dont flag topology edits apart from point edits, so the face
+    // vertices are only read again when the mesh element counts change
+    const unsigned numVertices = fnMesh.numVertices();
+    {
+        ProfileScope scope("topology", &_stats.topologyTime);
+
+        int elementCounts[4] = { (int)numVertices, fnMesh.numPolygons(), fnMesh.numFaceVertices(), fnMesh.numEdges() };
+        if (!geomCache.topology || memcmp(elementCounts, geomCache.elementCounts, sizeof(elementCounts)) != 0)
         {
-            int index = itVtx.index();
+            MIntArray faceCounts, faceVertices;
+            fnMesh.getVertices(faceCounts, faceVertices);
+
+            std::vector<int> counts(faceCounts.length());
+            std::vector<int> vertices(faceVertices.length());
+            if (!counts.empty())
+                faceCounts.get(&counts[0]);
+            if (!vertices.empty())
+                faceVertices.get(&vertices[0]);
+
+            const int* countsPtr = counts.empty() ? 0 : &counts[0];
+            const int* verticesPtr = vertices.empty() ? 0 : &vertices[0];
+            geomCache.topology = TopologyCache::acquire(numVertices, countsPtr, (unsigned)counts.size(), verticesPtr);
+            geomCache.restKey = 0;
+            memcpy(geomCache.elementCounts, elementCounts, sizeof(elementCounts));
+        }
+    }
+    const Topology& topology = *geomCache.topology;
+
+    std::vector<double>* buffers = geomCache.buffers;
+    buffers[0].resize(numVertices * 3);
+
+    // Relaxed rest mesh and its detail, once per rest shape
+    if (restRelative && geomCache.restKey != restKey)
+    {
+        const float* rawRestPoints = MFnMesh(restObj).getRawPoints(&stat);
+        MCheckStatus(stat, "");
 
-            MPoint newPos = positions[index];
-            MIntArray connectedVertices;
-            itVtx.getConnectedVertices(connectedVertices);
+        std::vector<double>& restDeltas = geomCache.restDeltas;
+        restDeltas.assign(rawRestPoints, rawRestPoints + numVertices * 3);
+        buffers[0] = restDeltas;
 
-            for (unsigned j = 0; j < connectedVertices.length(); ++j)
-                newPos += positions[connectedVertices[j]];
+        {
+            ProfileScope scope("relaxRestMesh", &_stats.relaxTime);
+            Relax::smooth(topology, buffers, iterations, amount, 0, toleranceMode);
+        }
+
+        if (numVertices)
+            Relax::encodeDetail(topology, &restDeltas[0], &buffers[0][0], &restDeltas[0]);
+        geomCache.restKey = restKey;
+    }
 
-            newPos = newPos / (connectedVertices.length()+1);
+    // Find relax positions from the input points, or warm started from the
+    // last relaxed ones. Passes capped at iterations either way
+    int passes = 0;
+    {
+        ProfileScope scope("relaxPositions", &_stats.relaxTime);
 
-            newPositions[index] = positions[index] + (newPos-positions[index]) * amount;
+        if (warmStart)
+            passes = geomCache.warmStart.relax(topology, rawPoints, buffers, iterations, amount, tolerance, toleranceMode);
+        else
+        {
+            geomCache.warmStart.reset();
+            buffers[0].assign(rawPoints, rawPoints + numVertices * 3);
+            passes = Relax::smooth(topology, buffers, iterations, amount, tolerance, toleranceMode);
         }
+    }
+    if (passes > _stats.iterations)
+        _stats.iterations = passes;
 
-        positions = newPositions;
+    // Put rest detail back in the frames of the relaxed mesh
+    if (restRelative && numVertices)
+    {
+        buffers[1].resize(numVertices * 3);
+        Relax::decodeDetail(topology, &buffers[0][0], &geomCache.restDeltas[0], &buffers[1][0]);
+        buffers[0].swap(buffers[1]);
     }
+    const std::vector<double>& newPositions = buffers[0];
 
 
-    // Set the final positions
-    for (itGeo.reset(); !itGeo.isDone(); itGeo.next())
+    // Set the final positions, all at once
     {
-        int i = itGeo.index();
+        ProfileScope scope("writePositions", &_stats.writeTime);
+
+        MPointArray& finalPositions = geomCache.positions;
+        itGeo.allPositions(finalPositions);
 
-        float wt = weightValue(block, geomIndex, i);
+        unsigned k = 0;
+        for (itGeo.reset(); !itGeo.isDone(); itGeo.next(), ++k)
+        {
+            int i = itGeo.index();
+
+            float wt = weightValue(block, geomIndex, i);
+
+            MPoint& position = finalPositions[k];
+            position += (MPoint(newPositions[i*3], newPositions[i*3+1], newPositions[i*3+2]) - position) * wt * env;
+        }
 
-        MPoint position = itGeo.position();
-        position += (newPositions[i] - position) * wt * env;
-        itGeo.setPosition(position);
+        geomCache.key = key;
+        itGeo.setAllPositions(finalPositions);
     }
 
 
@@ -5,14 +5,40 @@
 #include <maya/MTypeId.h>
 #include <maya/MDataBlock.h>
 #include <maya/MItGeometry.h>
+#include <maya/MPointArray.h>
+#if MAYA_API_VERSION >= 201600
+#include <maya/MEvaluationNode.h>
+#endif
+
+#include <maya/MVector.h>
+#include <maya/MIntArray.h>
+
+#include "Core/Topology.h"
+#include "Core/Relax.h"
+
+#include <map>
+#include <vector>
+#include <stdint.h>
 
 class RelaxDeformer: public MPxDeformerNode
 {
 public:
 
+    RelaxDeformer();
+
     static  void*       creator();
     static  MStatus     initialize();
 
+    MStatus compute( const MPlug& plug, MDataBlock& block );
+
+    MStatus setDependentsDirty( const MPlug& plugBeingDirtied, 
+                                MPlugArray& affectedPlugs );
+
+#if MAYA_API_VERSION >= 201600
+    MStatus preEvaluation(  const MDGContext& context, 
+                            const MEvaluationNode& evaluationNode );
+#endif
+
     MStatus deform( MDataBlock&     block, 
                     MItGeometry&    itGeo, 
                     const MMatrix&  world, 
@@ -31,6 +57,66 @@ private:
     
     static MObject          aIterations;
     static MObject          aAmount;
+    static MObject          aTolerance;
+    static MObject          aToleranceMode;
+    static MObject          aWarmStart;
+    static MObject          aRestRelative;
+    static MObject          aRestMesh;
+
+    static MObject          aStatsEvaluationTime;
+    static MObject          aStatsTopologyTime;
+    static MObject          aStatsRelaxTime;
+    static MObject          aStatsWriteTime;
+    static MObject          aStatsIterations;
+    static MObject          aStatsTopologies;
+    static MObject          aStatsCacheHitRate;
+
+    class GeomCache
+    {
+    public:
+        GeomCache() : key(0), restKey(0)  { elementCounts[0] = elementCounts[1] = elementCounts[2] = elementCounts[3] = -1; }
+
+        // Output of the last evaluation, replayed while the input fingerprint
+        // (points, attributes, weights generation) stays the same
+        uint64_t        key;
+        MPointArray     positions;
+
+        // Adjacency, shared with every geometry of the same topology. Looked
+        // up again when the vertex, face, face vertex or edge count changes
+        TopologyPtr     topology;
+        int             elementCounts[4];
+
+        // Last cold started result and its input, for warm start
+        Relax::WarmStart        warmStart;
+
+        // Scratch reused every evaluation, relax passes swap the two buffers.
+        // Points here are xyz interleaved, as the Relax kernels take them
+        std::vector<double>     buffers[2];
+
+        // Rest mesh detail lost to relax, in the vertex frames of the relaxed
+        // rest mesh. Rebuilt only when the rest points or relax settings change
+        uint64_t                restKey;
+        std::vector<double>     restDeltas;
+    };
+
+    // Stages of the last evaluation, written onto the stats* outputs
+    class Stats
+    {
+    public:
+        Stats() : topologyTime(0), relaxTime(0), writeTime(0), iterations(0)  {}
+
+        double          topologyTime;
+        double          relaxTime;
+        double          writeTime;
+        int             iterations;
+    };
+
+    std::map<unsigned, GeomCache>       _geomCaches;
+    unsigned                            _weightsGeneration;
+
+    Stats                               _stats;
+    unsigned                            _deforms;
+    unsigned                            _replays;
 };
 
 #endif
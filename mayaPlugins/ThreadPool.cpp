@@ -0,0 +1,324 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL    __declspec(thread)
+#else
+#define THREAD_LOCAL    __thread
+#endif
+
+
+ThreadPool* ThreadPool::_pool = 0;
+
+// Worker index of the current thread, -1 on threads the pool didnt start
+static THREAD_LOCAL int _workerIndex = -1;
+
+
+void ThreadPool::TaskGroup::run( const Task& task )
+{
+    if (!_pool)
+    {
+        task();
+        return;
+    }
+
+    ++_pending;
+
+    Job job;
+    job.task = task;
+    job.group = this;
+    _pool->push(job);
+}
+
+void ThreadPool::TaskGroup::wait()
+{
+    // Help with any queued task, tasks of this group may sit behind others.
+    // Block once there is nothing to run until a group finishes or a task is
+    // queued
+    while (_pending > 0)
+    {
+        Job job;
+        if (!_pool)
+            break;
+
+        if (_pool->pop(_workerIndex, job))
+        {
+            _pool->execute(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_pool->_sleepMutex);
+        ++_pool->_waiters;
+        while (_pending > 0 && _pool->_queued <= 0)
+            _pool->_waitCond.wait(lock);
+        --_pool->_waiters;
+    }
+}
+
+
+unsigned ThreadPool::TaskGraph::add( const Task& task )
+{
+    Node node;
+    node.task = task;
+    node.numPredecessors = 0;
+    _nodes.push_back(node);
+
+    return (unsigned)_nodes.size() - 1;
+}
+
+void ThreadPool::TaskGraph::precede( unsigned before, unsigned after )
+{
+    _nodes[before].successors.push_back(after);
+    ++_nodes[after].numPredecessors;
+}
+
+void ThreadPool::TaskGraph::run()
+{
+    const unsigned numNodes = (unsigned)_nodes.size();
+
+    _waiting.reset(new std::atomic<int>[numNodes]);
+    for( unsigned i=0; i < numNodes; ++i )
+        _waiting[i] = _nodes[i].numPredecessors;
+
+    TaskGroup group;
+    for( unsigned i=0; i < numNodes; ++i )
+    {
+        if (_nodes[i].numPredecessors == 0)
+            group.run([this, i, &group]() { runNode(i, group); });
+    }
+    group.wait();
+}
+
+// Run a node, then start successors it was the last dependency of
+void ThreadPool::TaskGraph::runNode( unsigned index, TaskGroup& group )
+{
+    _nodes[index].task();
+
+    const std::vector<unsigned>& successors = _nodes[index].successors;
+    for( unsigned i=0; i < successors.size(); ++i )
+    {
+        unsigned s = successors[i];
+        if (--_waiting[s] == 0)
+            group.run([this, s, &group]() { runNode(s, group); });
+    }
+}
+
+
+void ThreadPool::initialize( unsigned numThreads )
+{
+    uninitialize();
+
+    if (numThreads == 0)
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u) - 1;
+
+    _pool = new ThreadPool(numThreads);
+}
+
+void ThreadPool::uninitialize()
+{
+    delete _pool;
+    _pool = 0;
+}
+
+void ThreadPool::setThreadCap( unsigned cap )
+{
+    if (!_pool)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(_pool->_sleepMutex);
+        _pool->_cap = cap;
+    }
+    _pool->_sleepCond.notify_all();
+}
+
+unsigned ThreadPool::threadCap()
+{
+    return _pool ? _pool->_cap.load() : 0;
+}
+
+unsigned ThreadPool::numThreads()
+{
+    if (!_pool)
+        return 1;
+
+    unsigned all = (unsigned)_pool->_workers.size() + 1;
+    unsigned cap = _pool->_cap;
+    return cap == 0 ? all : std::min(cap, all);
+}
+
+void ThreadPool::parallelFor(   int                 begin, 
+                                int                 end, 
+                                const RangeTask&    body, 
+                                int                 grainSize )
+{
+    const int count = end - begin;
+    if (count <= 0)
+        return;
+
+    const unsigned threads = numThreads();
+    if (grainSize <= 0)
+        grainSize = std::max(count / (int)(threads * 4), 1);
+
+    if (!_pool || threads == 1 || count <= grainSize)
+    {
+        body(begin, end);
+        return;
+    }
+
+    // Queue all chunks but the first, which the caller runs itself
+    TaskGroup group;
+    for( int b=begin + grainSize; b < end; b += grainSize )
+    {
+        int e = std::min(b + grainSize, end);
+        group.run([&body, b, e]() { body(b, e); });
+    }
+
+    body(begin, begin + grainSize);
+    group.wait();
+}
+
+
+ThreadPool::ThreadPool( unsigned numWorkers )
+:   _queued(0),
+    _waiters(0),
+    _cap(0),
+    _stop(false)
+{
+    for( unsigned i=0; i < numWorkers; ++i )
+        _workers.push_back(std::unique_ptr<Worker>(new Worker));
+
+    for( unsigned i=0; i < numWorkers; ++i )
+        _workers[i]->thread = std::thread(&ThreadPool::work, this, (int)i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+        _stop = true;
+    }
+    _sleepCond.notify_all();
+
+    for( unsigned i=0; i < _workers.size(); ++i )
+        _workers[i]->thread.join();
+}
+
+// Workers queue onto their own deque, other threads onto the shared one
+void ThreadPool::push( const Job& job )
+{
+    if (_workerIndex >= 0)
+    {
+        Worker& worker = *_workers[_workerIndex];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.jobs.push_back(job);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(_injectMutex);
+        _inject.push_back(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+        ++_queued;
+    }
+    _sleepCond.notify_one();
+
+    if (_waiters > 0)
+        _waitCond.notify_all();
+}
+
+// Newest job of the own deque, else the oldest shared job, else steal the
+// oldest job of another worker
+bool ThreadPool::pop( int worker, Job& job )
+{
+    if (_queued <= 0)
+        return false;
+
+    if (worker >= 0)
+    {
+        Worker& own = *_workers[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.jobs.empty())
+        {
+            job = own.jobs.back();
+            own.jobs.pop_back();
+            --_queued;
+            return true;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_injectMutex);
+        if (!_inject.empty())
+        {
+            job = _inject.front();
+            _inject.pop_front();
+            --_queued;
+            return true;
+        }
+    }
+
+    const int numWorkers = (int)_workers.size();
+    for( int i=1; i <= numWorkers; ++i )
+    {
+        Worker& victim = *_workers[(worker + i + numWorkers) % numWorkers];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.jobs.empty())
+        {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            --_queued;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Wake waiters once a group finished. The group may be gone right after its
+// last task, only the pool is touched then
+void ThreadPool::execute( Job& job )
+{
+    job.task();
+
+    if (--job.group->_pending == 0 && _waiters > 0)
+    {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+        _waitCond.notify_all();
+    }
+}
+
+void ThreadPool::work( int worker )
+{
+    _workerIndex = worker;
+
+    // Workers past the cap sleep, caller thread counts as one
+    for(;;)
+    {
+        unsigned cap = _cap;
+        bool active = cap == 0 || (unsigned)worker + 1 < cap;
+
+        Job job;
+        if (active && pop(worker, job))
+        {
+            execute(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        while (!_stop)
+        {
+            cap = _cap;
+            active = cap == 0 || (unsigned)worker + 1 < cap;
+            if (active && _queued > 0)
+                break;
+            _sleepCond.wait(lock);
+        }
+
+        if (_stop)
+            return;
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+
+// Plugin wide work stealing scheduler. Created in initializePlugin and shared
+// by every node and command so parallel kernels dont oversubscribe the machine
+// under parallel evaluation. Each worker keeps its own task deque, pops its
+// newest task and steals the oldest of others when idle. Threads waiting on
+// tasks help run them, so kernels can nest.
+// Until initialize is called (or after uninitialize) everything runs serially
+// on the calling thread
+class ThreadPool
+{
+public:
+
+    typedef std::function<void()>                   Task;
+    typedef std::function<void(int, int)>           RangeTask;      // [begin, end)
+
+
+    // Tasks run together, wait returns once all of them finished
+    class TaskGroup
+    {
+    public:
+        TaskGroup() : _pending(0)   {}
+        ~TaskGroup()                { wait(); }
+
+        void    run( const Task& task );
+        void    wait();
+
+    private:
+        TaskGroup( const TaskGroup& );
+        TaskGroup& operator=( const TaskGroup& );
+
+        friend class ThreadPool;
+        std::atomic<int>    _pending;
+    };
+
+
+    // Tasks with dependencies, each runs once all tasks it depends on finished.
+    // Can be run again, it keeps its tasks and edges
+    class TaskGraph
+    {
+    public:
+        unsigned    add( const Task& task );
+        void        precede( unsigned before, unsigned after );
+
+        void        run();
+
+    private:
+        class Node
+        {
+        public:
+            Task                    task;
+            std::vector<unsigned>   successors;
+            int                     numPredecessors;
+        };
+
+        void        runNode( unsigned index, TaskGroup& group );
+
+        std::vector<Node>                               _nodes;
+        std::unique_ptr< std::atomic<int>[] >           _waiting;
+    };
+
+
+    // Start workers, hardware threads - 1 if numThreads is 0. The calling
+    // thread is the other one
+    static void         initialize( unsigned numThreads = 0 );
+    static void         uninitialize();
+
+    // Threads (workers and caller) kernels may use at most, 0 for all
+    static void         setThreadCap( unsigned cap );
+    static unsigned     threadCap();
+
+    // Threads a kernel runs on, the cap or workers + 1
+    static unsigned     numThreads();
+
+    // Split [begin, end) in chunks of grainSize iterations (0 picks a few
+    // chunks per thread) and run body on each
+    static void         parallelFor(    int                 begin, 
+                                        int                 end, 
+                                        const RangeTask&    body, 
+                                        int                 grainSize = 0 );
+
+private:
+    ThreadPool( unsigned numWorkers );
+    ~ThreadPool();
+
+    class Job
+    {
+    public:
+        Task            task;
+        TaskGroup*      group;
+    };
+
+    class Worker
+    {
+    public:
+        std::mutex          mutex;
+        std::deque<Job>     jobs;
+        std::thread         thread;
+    };
+
+    void                push( const Job& job );
+    bool                pop( int worker, Job& job );
+    void                execute( Job& job );
+    void                work( int worker );
+
+    std::vector< std::unique_ptr<Worker> >  _workers;
+
+    std::mutex                              _injectMutex;
+    std::deque<Job>                         _inject;            // From non worker threads
+
+    std::mutex                              _sleepMutex;
+    std::condition_variable                 _sleepCond;
+    std::atomic<int>                        _queued;
+    std::condition_variable                 _waitCond;          // Threads in TaskGroup::wait
+    std::atomic<int>                        _waiters;
+    std::atomic<unsigned>                   _cap;
+    bool                                    _stop;
+
+    static ThreadPool*                      _pool;
+};
+
+#endif
@@ -3,7 +3,11 @@
 #include <maya/MStatus.h>
 #include <maya/MPxNode.h>
 
+#include <stdlib.h>
+
 #include "utils.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
 #include "PSD/PoseSpaceCommand.h"
 #include "PSD/PoseSpaceDeformer.h"
 #include "Relax/RelaxDeformer.h"
@@ -14,6 +18,15 @@ MStatus initializePlugin( MObject obj )
     MStatus result;
     MFnPlugin plugin( obj, "YOUR COMPANY", "1.0", "Any" );
 
+    // One scheduler for every node and command, MAYAPLUGINS_THREADS caps its
+    // threads at load, poseSpaceCommand -threadCap at any time
+    ThreadPool::initialize();
+    const char* threadCap = getenv("MAYAPLUGINS_THREADS");
+    if (threadCap)
+        ThreadPool::setThreadCap(atoi(threadCap));
+
+    Profiler::initialize();
+
     result = plugin.registerCommand( 
                       PoseSpaceCommand::name,
                       PoseSpaceCommand::creator,
@@ -29,6 +42,8 @@ MStatus initializePlugin( MObject obj )
                       MPxNode::kDeformerNode);
     if (!result)
         result.perror("Register PoseSpace deformer failed.");
+    else
+        PoseSpaceDeformer::addCallbacks();
 
     result = plugin.registerNode(
                       RelaxDeformer::name, 
@@ -51,6 +66,8 @@ MStatus uninitializePlugin( MObject obj)
     if (!result)
         result.perror("Deregister PoseSpace command failed.");
 
+    PoseSpaceDeformer::removeCallbacks();
+
     result = plugin.deregisterNode( PoseSpaceDeformer::id );
     if (!result)
         result.perror("Deregister PoseSpace deformer failed.");
@@ -59,5 +76,8 @@ MStatus uninitializePlugin( MObject obj)
     if (!result)
         result.perror("Deregister Relax deformer  failed.");
 
+    ThreadPool::uninitialize();
+    Profiler::uninitialize();
+
     return result;
 }
\ No newline at end of file
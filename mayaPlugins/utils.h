@@ -2,6 +2,9 @@
 #define UTILS_H
 
 #include <limits>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 
 typedef const char* const conststr;
@@ -17,6 +20,7 @@ namespace PluginNames
     conststr PoseSpaceCommand      = "poseSpaceCommand";
     conststr PoseSpaceDeformer     = "poseSpaceDeformer";
     conststr RelaxDeformer         = "relaxDeformer";
+    conststr ProfilerCategory      = "mayaPlugins";
 };
 
 
@@ -27,13 +31,23 @@ namespace ErrorStr
     conststr PSDDeformerNotProvided             = "PoseSpaceDeformer was not provided";
     conststr PSDMeshNotSelected                 = "Mesh was not selected";
     conststr PSDSCNotFound                      = "SkinCluster was not found";
+    conststr PSDSCNotConnected                  = "SkinCluster matrix/bindPreMatrix are not connected to poseSpaceDeformer";
+    conststr PSDSCMatrixMismatch                = "Matrix and bindPreMatrix plugs in skincluster doesnt match";
     conststr PSDInvalidPoseIndex                = "No pose found at given pose index %d";
     conststr PSDInvalidTargetIndex              = "No poseTarget found at given target index %d";
+    conststr PSDDuplicateBatchTarget            = "Pose %d target %d is given more than once to batchSetPoseTarget";
+    conststr PSDInvalidGeomIndex                = "No geometry found at given geometry index in poseSpaceDeformer";
     conststr PSDInvalidPoseTarget               = "Posed mesh and mesh in poseSpaceDeformer differ in vertex count. Failed to add pose";
     conststr PSDInvalidTargetDelta              = "Invalid pose target delta when updating poseTarget";
     conststr PSDPoseTargetDoesntDiffer          = "Posed mesh is similar to mesh in poseSpaceDeformer. Failed to add pose target";
+    conststr PSDInvalidPruneThreshold           = "Prune threshold and merge tolerance should not be negative";
+    conststr PSDNotSculpting                    = "No sculpt in progress on poseSpaceDeformer, set sculptPose first";
+    conststr PSDSculptNotEvaluated              = "Sculpt was not evaluated, sculpted pose has to be active to commit";
+    conststr PSDLegacyUpgradeFailed             = "Failed to upgrade poseSpaceDeformer attributes of an older scene";
 
     conststr RelaxInvalidInput                  = "Relax deformer works on meshes only";
+    conststr RelaxRestMeshNotConnected          = "Relax deformer restRelative needs a restMesh connected";
+    conststr RelaxRestMeshMismatch              = "Relax deformer restMesh and input mesh differ in vertex count";
 };
 
 #define SPRINTF     sprintf
@@ -43,6 +57,29 @@ namespace ErrorStr
 
 #define FLOAT_TOLERANCE    0.0000001f //std::numeric_limits<float>::epsilon
 
+// FNV-1a over 64 bit words, the tail bytes one at a time. The shift folds
+// high bits down that the multiply only carries up. Chained through seed to
+// hash several blocks
+inline uint64_t hashBytes( const void* data, size_t bytes, uint64_t seed = 14695981039346656037ULL )
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const size_t numWords = bytes / sizeof(uint64_t);
+    for( size_t i=0; i < numWords; ++i, p += sizeof(uint64_t) )
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        seed ^= word;
+        seed *= 1099511628211ULL;
+        seed ^= seed >> 32;
+    }
+    for( size_t i=numWords * sizeof(uint64_t); i < bytes; ++i, ++p )
+    {
+        seed ^= *p;
+        seed *= 1099511628211ULL;
+    }
+    return seed;
+}
+
 #define FUNCLINE      (MString(__FUNCTION__) + " (" + __FILE__ + " :" + __LINE__ + ")").asChar()
 
 #define MCheckStatus(status, message)                   \